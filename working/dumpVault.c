@@ -0,0 +1,58 @@
+/* Author:  Keith Shomper
+ * Date:    1 Nov 2017
+ * Purpose: Prints every password in the vault using packed reads, which
+ *          return as many hint-password pairs per read as fit in buf.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <string.h>
+
+#define  BUF_SIZE  65536
+
+/*
+ * Ioctl definitions
+ */
+
+/* Use 'k' as magic number - please use a different 8-bit number in your code */
+#define HW4MOD_IOC_MAGIC  'k'
+#define HW4MOD_IOCTRMODE   _IO  (HW4MOD_IOC_MAGIC,   4)
+#define HW4MOD_READ_PACKED 1
+
+int main () {
+	static char buf[BUF_SIZE];
+	char *p;
+	int  fd;
+	int  i = 1, calls = 0;
+	int  rc;
+
+   if ((fd = open ("/dev/hw4mod", O_RDONLY)) == -1) {
+     perror("opening file");
+     return -1;
+   }
+
+	if (ioctl(fd, HW4MOD_IOCTRMODE, HW4MOD_READ_PACKED) == -1) {
+		perror("ioctl");
+		return -1;
+	}
+
+	printf("Printing passwords in vault:\n");
+	while ((rc = read(fd, buf, BUF_SIZE)) > 0) {
+		calls++;
+		for (p = buf; p < buf + rc; i++) {
+			printf("Password %2d:  %s ", i, p);
+			p += strlen(p) + 1;
+			printf("%s\n", p);
+			p += strlen(p) + 1;
+		}
+	}
+
+	if (rc < 0) perror("read");
+	printf("%d pair(s) in %d read(s)\n", i - 1, calls);
+
+   close(fd);
+
+   return 0;
+}
@@ -0,0 +1,301 @@
+/*
+ * hw4_journal.c -- the journal device of the hw4mod char module
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ * Modified by Keith Shomper, 10/27/2017 for use in CS3320
+ *
+ */
+#include <linux/module.h>
+#include <linux/init.h>
+
+#include <linux/kernel.h>    /* printk() */
+#include <linux/mm.h>        /* kvmalloc_array() */
+#include <linux/vmalloc.h>   /* vzalloc() */
+#include <linux/fs.h>        /* everything... */
+#include <linux/errno.h>     /* error codes */
+#include <linux/types.h>     /* size_t */
+#include <linux/fcntl.h>     /* O_NONBLOCK */
+#include <linux/capability.h> /* capable() */
+#include <linux/cdev.h>
+#include <linux/poll.h>      /* poll_wait() */
+#include <linux/wait.h>      /* wait_event_interruptible() */
+#include <linux/atomic.h>    /* atomic64_inc_return() */
+#include <linux/preempt.h>   /* preempt_disable() */
+#include <linux/log2.h>      /* roundup_pow_of_two() */
+#include <linux/overflow.h>  /* array_size() */
+
+#include <linux/uaccess.h>   /* copy_to_user() */
+
+#include "hw4_mod.h"         /* local definitions */
+
+/* the most records one read copies out, so the bounce buffer stays small */
+#define HW4MOD_JOURNAL_BATCH 64
+
+/*
+ * The journal is a ring of the newest records.  Writers never wait for
+ * readers, and take no lock: each reserves the next seq with one atomic
+ * increment of head and fills that seq's slot in place, so writers to
+ * different users' vaults do not serialize.  A record overwrites the oldest
+ * once the ring is full.  A slot's state says which record it holds and
+ * whether that record is complete, so a reader copies only complete records
+ * and notices one that is overwritten while it copies.
+ */
+struct hw4mod_jslot {
+   u64                 state;  /* HW4MOD_JDONE of the record held, plus
+                                  one while it is written; 0 if none yet  */
+   struct hw4mod_jrec  rec;
+};
+
+/* the state of a slot once record seq in it is complete */
+#define HW4MOD_JDONE(seq) (2 * ((u64) (seq) + 1))
+
+static struct hw4mod_journal {
+   wait_queue_head_t    wait;  /* readers waiting for the next record      */
+   struct hw4mod_jslot *ring;
+   u64                  size;  /* slots in ring, a power of two            */
+   atomic64_t           head;  /* the seq the next record gets             */
+   struct cdev          cdev;
+   int                  added; /* TRUE once cdev is added                  */
+} journal;
+
+/* hw4mod_journal_slot:  returns the slot that record seq goes in           */
+static struct hw4mod_jslot *hw4mod_journal_slot(u64 seq) {
+   return &journal.ring[seq & (journal.size - 1)];
+}
+
+/* hw4mod_journal_ready:  TRUE once record seq is complete, or overwritten  */
+static int hw4mod_journal_ready(u64 seq) {
+   u64 state = smp_load_acquire(&hw4mod_journal_slot(seq)->state);
+
+   return state == HW4MOD_JDONE(seq) || state > HW4MOD_JDONE(seq) + 1;
+}
+
+/* hw4mod_journal_oldest:  returns the seq of the oldest record the ring
+ *                         still holds, or will hold once it is written    */
+static u64 hw4mod_journal_oldest(void) {
+   u64 head = atomic64_read(&journal.head);
+
+   return (head > journal.size) ? head - journal.size : 0;
+}
+
+/*
+ * hw4mod_journal_note:  the vaults' note hook, which appends one record for
+ *                       a pair inserted into or deleted from vault v
+ */
+void hw4mod_journal_note(struct pwd_vault *v, int op, kuid_t uid,
+                         const char *hint, const char *pwd) {
+
+   struct hw4mod_dev   *dev = container_of(v, struct hw4mod_dev, pwd_vault);
+   struct hw4mod_jslot *s;
+   struct hw4mod_jrec  *r;
+   u64                  seq, prev;
+
+   /* the writer holding a slot is never preempted, so others wait briefly */
+   preempt_disable();
+
+   seq  = atomic64_inc_return(&journal.head) - 1;
+   s    = hw4mod_journal_slot(seq);
+   prev = (seq >= journal.size) ? HW4MOD_JDONE(seq - journal.size) : 0;
+
+   /* the writer a lap behind may not have finished with the slot yet */
+   while (smp_load_acquire(&s->state) != prev) cpu_relax();
+
+   /* a reader copying the slot now sees it change, so discards its copy */
+   WRITE_ONCE(s->state, HW4MOD_JDONE(seq) + 1);
+   smp_wmb();
+
+   /* only the strings' bytes and their NULs are written, not the fields */
+   r       = &s->rec;
+   r->seq  = seq;
+   r->uid  = __kuid_val(uid);
+   r->op   = op;
+   r->dev  = dev - hw4mod_devices;
+   r->hlen = strnlen(hint, MAX_HINT_SIZE);
+   r->plen = strnlen(pwd,  MAX_PWD_SIZE);
+   memcpy(r->hint, hint, r->hlen);
+   if (r->hlen < MAX_HINT_SIZE) r->hint[r->hlen] = '\0';
+   memcpy(r->pwd,  pwd,  r->plen);
+   if (r->plen < MAX_PWD_SIZE)  r->pwd[r->plen]  = '\0';
+
+   /* readers take the record only once it is complete */
+   smp_store_release(&s->state, HW4MOD_JDONE(seq));
+
+   preempt_enable();
+
+   /* waking costs nothing when no reader is asleep */
+   if (wq_has_sleeper(&journal.wait)) wake_up_interruptible(&journal.wait);
+}
+
+/*
+ * Open: a journal reader starts at the oldest record the ring still holds.
+ *       The records hold every user's pwds, so only the administrator may
+ *       read them, whatever the mode of the device node.
+ */
+static int hw4mod_journal_open(struct inode *inode, struct file *filp) {
+
+   if (!capable(CAP_SYS_ADMIN))    return -EPERM;
+   if (filp->f_mode & FMODE_WRITE) return -EPERM;
+
+   filp->f_pos = hw4mod_journal_oldest();
+
+   return 0;
+}
+
+/*
+ * Read: copies whole records from seq *f_pos on, waiting for one if there is
+ *       none yet, unless the file was opened O_NONBLOCK.
+ */
+static ssize_t hw4mod_journal_read(struct file *filp, char __user *buf,
+                                   size_t count, loff_t *f_pos) {
+
+   size_t               n = min_t(size_t, count / sizeof(struct hw4mod_jrec),
+                                  HW4MOD_JOURNAL_BATCH);
+   struct hw4mod_jrec  *kbuf;
+   struct hw4mod_jslot *s;
+   u64                  seq, state, k;
+   ssize_t              retval;
+
+   if (n == 0)     return -EINVAL;
+   if (*f_pos < 0) return -EINVAL;
+
+   kbuf = kvmalloc_array(n, sizeof(*kbuf), GFP_KERNEL);
+   if (kbuf == NULL) return -ENOMEM;
+
+   seq = *f_pos;
+   while (!hw4mod_journal_ready(seq)) {
+      if (filp->f_flags & O_NONBLOCK) {
+         retval = -EAGAIN;
+         goto out;
+      }
+
+      if (wait_event_interruptible(journal.wait, hw4mod_journal_ready(seq))) {
+         retval = -ERESTARTSYS;
+         goto out;
+      }
+   }
+
+   /* copy the complete records in order, stopping at one not yet written;
+    * a slot whose state changed during the copy was overwritten
+    */
+   for (k = 0; k < n; k++) {
+      s     = hw4mod_journal_slot(seq + k);
+      state = smp_load_acquire(&s->state);
+      if (state != HW4MOD_JDONE(seq + k)) break;
+
+      kbuf[k] = s->rec;
+      smp_rmb();
+      if (READ_ONCE(s->state) != state) break;
+   }
+
+   /* the records the reader wanted were overwritten; say so, then resume */
+   if (k == 0) {
+      *f_pos = hw4mod_journal_oldest();
+      retval = -EPIPE;
+      goto out;
+   }
+
+   /* copy the records out from kbuf, since the copy may fault or sleep */
+   if (copy_to_user(buf, kbuf, k * sizeof(*kbuf))) {
+      retval = -EFAULT;
+      goto out;
+   }
+
+   *f_pos = seq + k;
+   retval = k * sizeof(*kbuf);
+
+  out:
+   kvfree(kbuf);
+   return retval;
+}
+
+/*
+ * Seek: the file position is a seq number, so seeking picks the next record
+ *       to read; SEEK_END counts from the seq the next change will get.
+ */
+static loff_t hw4mod_journal_llseek(struct file *filp, loff_t off, int whence) {
+
+   loff_t pos;
+
+   switch (whence) {
+   case SEEK_SET: pos = off;                                     break;
+   case SEEK_CUR: pos = filp->f_pos + off;                       break;
+   case SEEK_END: pos = atomic64_read(&journal.head) + off;      break;
+   default:       pos = -EINVAL;                                 break;
+   }
+
+   if (pos < 0) return -EINVAL;
+
+   filp->f_pos = pos;
+   return pos;
+}
+
+/*
+ * Poll: the journal is readable once a record past the file position exists.
+ */
+static __poll_t hw4mod_journal_poll(struct file *filp, poll_table *wait) {
+
+   poll_wait(filp, &journal.wait, wait);
+
+   if (hw4mod_journal_ready(filp->f_pos)) return EPOLLIN | EPOLLRDNORM;
+   return 0;
+}
+
+static const struct file_operations hw4mod_journal_fops = {
+   .owner =    THIS_MODULE,
+   .open =     hw4mod_journal_open,
+   .read =     hw4mod_journal_read,
+   .llseek =   hw4mod_journal_llseek,
+   .poll =     hw4mod_journal_poll,
+};
+
+/*
+ * hw4mod_journal_init:  allocates the ring and adds the journal device as
+ *                       devno; the vaults may note changes once it returns
+ */
+int hw4mod_journal_init(dev_t devno) {
+
+   int err;
+
+   init_waitqueue_head(&journal.wait);
+   atomic64_set(&journal.head, 0);
+   journal.size = roundup_pow_of_two(max(hw4mod_journal_size, 1));
+
+   /* zeroed, so no slot holds a record yet and no stale bytes are read */
+   journal.ring = vzalloc(array_size(journal.size,
+                                     sizeof(struct hw4mod_jslot)));
+   if (journal.ring == NULL) return -ENOMEM;
+
+   cdev_init(&journal.cdev, &hw4mod_journal_fops);
+   journal.cdev.owner = THIS_MODULE;
+   err = cdev_add(&journal.cdev, devno, 1);
+   if (err) {
+      printk(KERN_NOTICE "Error %d adding hw4mod journal", err);
+      return err;
+   }
+   journal.added = TRUE;
+
+   return 0;
+}
+
+/*
+ * hw4mod_journal_cleanup:  removes the journal device and frees the ring; it
+ *                          must follow every change to the vaults
+ */
+void hw4mod_journal_cleanup(void) {
+
+   if (journal.added) cdev_del(&journal.cdev);
+   journal.added = FALSE;
+
+   vfree(journal.ring);
+   journal.ring = NULL;
+}
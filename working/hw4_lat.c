@@ -0,0 +1,199 @@
+/*
+ * hw4_lat.c -- the latency histograms of the hw4mod char module
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ * Modified by Keith Shomper, 10/27/2017 for use in CS3320
+ *
+ */
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+
+#include <linux/kernel.h>    /* printk() */
+#include <linux/fs.h>        /* everything... */
+#include <linux/types.h>     /* size_t */
+#include <linux/percpu.h>    /* DEFINE_PER_CPU() */
+#include <linux/ktime.h>     /* ktime_get_ns() */
+#include <linux/log2.h>      /* ilog2() */
+#include <linux/seq_file.h>
+#include <linux/cdev.h>
+#include <linux/debugfs.h>   /* debugfs_create_file() */
+
+#include "hw4_mod.h"         /* local definitions */
+
+/*
+ * Timing costs two or three clock reads a fop, so it may be turned off
+ * through /sys/module/hw4mod/parameters/hw4mod_latency.
+ */
+int hw4mod_latency = 1;
+module_param(hw4mod_latency, int, S_IRUGO | S_IWUSR);
+
+/* bucket b counts the times of [2^b, 2^(b+1)) ns; bucket 0 also counts 0 */
+#define HW4MOD_LAT_BUCKETS 32
+
+/* the parts each fop's time is split into */
+enum { HW4MOD_LAT_TOTAL, HW4MOD_LAT_WAIT, HW4MOD_LAT_HOLD, HW4MOD_LAT_NR_PARTS };
+
+static const char *const hw4mod_lat_ops[HW4MOD_LAT_NR_OPS] = {
+   "read", "write", "ioctl", "llseek",
+};
+
+static const char *const hw4mod_lat_parts[HW4MOD_LAT_NR_PARTS] = {
+   "total", "wait", "hold",
+};
+
+/*
+ * Each CPU counts into its own histograms, so a fop adds to them without an
+ * atomic or a shared cache line; a read of the debugfs file sums the CPUs'.
+ */
+struct hw4mod_lat_hist {
+   u64 count[HW4MOD_LAT_NR_OPS][HW4MOD_LAT_NR_PARTS][HW4MOD_LAT_BUCKETS];
+   u64 sum  [HW4MOD_LAT_NR_OPS][HW4MOD_LAT_NR_PARTS];
+};
+
+static DEFINE_PER_CPU(struct hw4mod_lat_hist, hw4mod_lat_hist);
+
+/* hw4mod_lat_add:  counts ns in this CPU's histogram of part of op */
+static void hw4mod_lat_add(int op, int part, u64 ns) {
+
+   int b = ns ? min_t(int, ilog2(ns), HW4MOD_LAT_BUCKETS - 1) : 0;
+
+   this_cpu_inc(hw4mod_lat_hist.count[op][part][b]);
+   this_cpu_add(hw4mod_lat_hist.sum[op][part], ns);
+}
+
+/* hw4mod_lat_begin:  starts timing a fop, if timing is on */
+void hw4mod_lat_begin(struct hw4mod_lat *l) {
+
+   l->start = READ_ONCE(hw4mod_latency) ? ktime_get_ns() : 0;
+   l->mark  = 0;
+   l->wait  = 0;
+   l->hold  = 0;
+   l->locks = 0;
+}
+
+/* hw4mod_lat_lock:  notes that the fop is about to ask for a lock */
+void hw4mod_lat_lock(struct hw4mod_lat *l) {
+
+   if (l->start) l->mark = ktime_get_ns();
+}
+
+/* hw4mod_lat_locked:  notes that the fop holds the lock it asked for */
+void hw4mod_lat_locked(struct hw4mod_lat *l) {
+
+   u64 now;
+
+   if (!l->start) return;
+
+   now      = ktime_get_ns();
+   l->wait += now - l->mark;
+   l->mark  = now;
+   l->locks++;
+}
+
+/* hw4mod_lat_unlock:  notes that the fop has released the lock it held */
+void hw4mod_lat_unlock(struct hw4mod_lat *l) {
+
+   if (l->start) l->hold += ktime_get_ns() - l->mark;
+}
+
+/*
+ * hw4mod_lat_end:  counts the fop's time as op; the wait and hold parts are
+ *                  counted only for a fop that took a lock
+ */
+void hw4mod_lat_end(struct hw4mod_lat *l, int op) {
+
+   if (!l->start) return;
+
+   preempt_disable();
+   hw4mod_lat_add(op, HW4MOD_LAT_TOTAL, ktime_get_ns() - l->start);
+   if (l->locks) {
+      hw4mod_lat_add(op, HW4MOD_LAT_WAIT, l->wait);
+      hw4mod_lat_add(op, HW4MOD_LAT_HOLD, l->hold);
+   }
+   preempt_enable();
+}
+
+/*
+ * The control file /sys/kernel/debug/hw4mod/latency reads as the histograms
+ * summed over the CPUs, each non-empty one headed by its op, part, count and
+ * mean, with a row per non-empty bucket.  Writing anything to it zeroes them:
+ *
+ *    echo > /sys/kernel/debug/hw4mod/latency
+ */
+static int hw4mod_lat_show(struct seq_file *m, void *v) {
+
+   u64 count[HW4MOD_LAT_BUCKETS], n, sum;
+   int op, part, b, cpu;
+
+   for (op = 0; op < HW4MOD_LAT_NR_OPS; op++) {
+      for (part = 0; part < HW4MOD_LAT_NR_PARTS; part++) {
+
+         memset(count, 0, sizeof(count));
+         n = sum = 0;
+
+         for_each_possible_cpu(cpu) {
+            struct hw4mod_lat_hist *h = per_cpu_ptr(&hw4mod_lat_hist, cpu);
+
+            for (b = 0; b < HW4MOD_LAT_BUCKETS; b++) {
+               count[b] += READ_ONCE(h->count[op][part][b]);
+               n        += READ_ONCE(h->count[op][part][b]);
+            }
+            sum += READ_ONCE(h->sum[op][part]);
+         }
+
+         if (n == 0) continue;
+
+         seq_printf(m, "%s %s: count %llu mean %llu ns\n",
+                    hw4mod_lat_ops[op], hw4mod_lat_parts[part], n,
+                    div64_u64(sum, n));
+
+         for (b = 0; b < HW4MOD_LAT_BUCKETS; b++) {
+            if (count[b] == 0) continue;
+            seq_printf(m, "  %12llu .. %12llu ns %12llu\n",
+                       b ? 1ULL << b : 0ULL, (1ULL << (b + 1)) - 1, count[b]);
+         }
+      }
+   }
+
+   return 0;
+}
+
+static int hw4mod_lat_open(struct inode *inode, struct file *filp) {
+   return single_open(filp, hw4mod_lat_show, NULL);
+}
+
+/* a fop counting on another CPU as it is zeroed may leave a partial sample */
+static ssize_t hw4mod_lat_write(struct file *filp, const char __user *buf,
+                                size_t count, loff_t *f_pos) {
+   int cpu;
+
+   for_each_possible_cpu(cpu)
+      memset(per_cpu_ptr(&hw4mod_lat_hist, cpu), 0,
+             sizeof(struct hw4mod_lat_hist));
+
+   return count;
+}
+
+static const struct file_operations hw4mod_lat_fops = {
+   .owner   = THIS_MODULE,
+   .open    = hw4mod_lat_open,
+   .read    = seq_read,
+   .write   = hw4mod_lat_write,
+   .llseek  = seq_lseek,
+   .release = single_release,
+};
+
+/* hw4mod_lat_init:  adds the latency control file to the debugfs dir */
+void hw4mod_lat_init(struct dentry *dir) {
+   debugfs_create_file("latency", 0600, dir, NULL, &hw4mod_lat_fops);
+}
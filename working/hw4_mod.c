@@ -32,6 +32,14 @@
 #include <linux/uaccess.h> /* needed for some reason*/
 #include <asm/uaccess.h>   /* copy_*_user */
 #include <linux/sched.h>
+#include <linux/cred.h>      /* current_uid() */
+#include <linux/rcupdate.h>  /* rcu_read_lock() */
+#include <linux/mm.h>        /* kvmalloc(), vm_operations_struct */
+#include <linux/vmalloc.h>   /* vmalloc_user() */
+#include <linux/debugfs.h>   /* debugfs_create_file() */
+#include <linux/overflow.h>  /* check_add_overflow() */
+#include <linux/shrinker.h>  /* shrinker_alloc() */
+#include <linux/poll.h>      /* poll_wait() */
 
 #include "hw4_mod.h"         /* local definitions */
 
@@ -41,10 +49,20 @@
 int hw4mod_major   = HW4MOD_MAJOR;
 int hw4mod_minor   = 0;
 int hw4mod_nr_devs = HW4MOD_NR_DEVS;
+int hw4mod_num_users = HW4MOD_NUM_USERS;
+int hw4mod_num_hints = HW4MOD_NUM_HINTS;
+int hw4mod_journal_size = HW4MOD_JOURNAL_SIZE;
+int hw4mod_user_pairs = 0;          /* no quota by default */
+unsigned long hw4mod_user_bytes = 0;
 
 module_param(hw4mod_major,   int, S_IRUGO);
 module_param(hw4mod_minor,   int, S_IRUGO);
 module_param(hw4mod_nr_devs, int, S_IRUGO);
+module_param(hw4mod_num_users, int, S_IRUGO);
+module_param(hw4mod_num_hints, int, S_IRUGO);
+module_param(hw4mod_journal_size, int, S_IRUGO);
+module_param(hw4mod_user_pairs, int, S_IRUGO);
+module_param(hw4mod_user_bytes, ulong, S_IRUGO);
 
 MODULE_AUTHOR("Alessandro Rubini, Jonathan Corbet modified K. Shomper");
 MODULE_LICENSE("Dual BSD/GPL");
@@ -52,16 +70,295 @@ MODULE_LICENSE("Dual BSD/GPL");
 /* the set of devices allocated in hw4mod_init_module */
 struct hw4mod_dev *hw4mod_devices = NULL;
 
+/* the devices whose vault and cdev hw4mod_init_module has set up */
+static int hw4mod_nr_ready = 0;
+
+/* the debugfs directory holding the control files, NULL if there is none */
+static struct dentry *hw4mod_debugfs = NULL;
+
+/* the proc file of the vaults' counters, NULL if there is none */
+static struct proc_dir_entry *hw4mod_proc = NULL;
+
+/* reclaims the strings of deleted pairs under memory pressure, or NULL */
+static struct shrinker *hw4mod_shrinker = NULL;
+
+/*
+ * hw4mod_cur_lock:  takes user's cur_lock for the file's cursor, first
+ *                   moving the cursor to user's first pair if the file was
+ *                   last used by another uid, or never; the cursor's fp is
+ *                   then the caller's until it drops the lock.  The two
+ *                   cur_locks are never held together, so users moving one
+ *                   file's cursor between them cannot deadlock.
+ */
+static void hw4mod_cur_lock(struct hw4mod_file *hf, struct hpw_list_h *user) {
+
+   struct hpw_list_h *old;
+
+   spin_lock(&user->cur_lock);
+   if (hf->cur_user == user) return;
+   spin_unlock(&user->cur_lock);
+
+   spin_lock(&hf->lock);
+   old = hf->cur_user;
+
+   if (old != user) {
+      if (old != NULL) {
+         spin_lock(&old->cur_lock);
+         remove_cursor(old, &hf->cur);
+         hf->cur_user = NULL;
+         spin_unlock(&old->cur_lock);
+      }
+
+      spin_lock(&user->cur_lock);
+      add_cursor(user, &hf->cur);
+      hf->cur_user = user;
+   } else {
+      spin_lock(&user->cur_lock);
+   }
+
+   spin_unlock(&hf->lock);
+}
+
+/*
+ * hw4mod_apply:  applies one record of len bytes, held in rec, for user
+ *                uid: an empty record deletes the pair at the file's cursor,
+ *                any other is a "hint pwd" pair to insert.  rec must have
+ *                room for a NUL after the record, and the caller must hold
+ *                the user's lock.
+ */
+static int hw4mod_apply(struct hw4mod_file *hf, struct hpw_list_h *user,
+                        kuid_t uid, char *rec, size_t len) {
+
+   struct hw4mod_dev *dev = hf->dev;
+   struct hpw_list   *filePtr;
+   char              *pwd;
+
+   if (len == 0) {
+
+      /* readers move the cursor under cur_lock; holding the user's lock
+       * keeps the pair it points at from being deleted by anyone else
+       */
+      rcu_read_lock();
+      hw4mod_cur_lock(hf, user);
+      filePtr = hf->cur.fp;
+      spin_unlock(&user->cur_lock);
+      rcu_read_unlock();
+
+      /* the pair is in hand, so there is nothing to search for;
+       * delete_pair_at moves the cursor on to the next pair
+       */
+      if (filePtr != NULL) delete_pair_at(&dev->pwd_vault, uid, filePtr);
+
+      return 0;
+   }
+
+   rec[len] = '\0';
+
+   /* the hint ends at the first space, and both strings must fit */
+   pwd = strchr(rec, ' ');
+   if (pwd == NULL || pwd == rec || pwd - rec > MAX_HINT_SIZE ||
+       strlen(pwd + 1) > MAX_PWD_SIZE) return -EINVAL;
+
+   *pwd++ = '\0';
+
+   return add_pair(&dev->pwd_vault, uid, rec, pwd);
+}
+
+/*
+ * hw4mod_snap_stale:  unmaps every page mapped from the device, after the
+ *                     caller changed the pairs of a user; the next touch of a
+ *                     page faults, and the fault rebuilds a snapshot whose
+ *                     user has changed.  The mapped files are kept on the
+ *                     device, since each node of it has its own mapping.
+ */
+static void hw4mod_snap_stale(struct hw4mod_dev *dev) {
+
+   struct hw4mod_file *hf;
+
+   mutex_lock(&dev->map_lock);
+   list_for_each_entry(hf, &dev->maps, map_link) {
+      if (mapping_mapped(hf->snap_mapping))
+         unmap_mapping_range(hf->snap_mapping, 0, 0, 1);
+   }
+   mutex_unlock(&dev->map_lock);
+}
+
+/*
+ * hw4mod_notify:  wakes the pollers of user once the caller has released the
+ *                 locks a write takes, so a woken poller can write without
+ *                 waiting; if user's pairs changed, it wakes them to read as
+ *                 well, with the pollers on dev whose uid had no list head
+ *                 when they polled, and signals the files that asked for SIGIO
+ */
+static void hw4mod_notify(struct hw4mod_dev *dev, struct hpw_list_h *user,
+                          int changed) {
+   __poll_t events = EPOLLOUT | EPOLLWRNORM;
+
+   if (changed) events |= EPOLLIN | EPOLLRDNORM;
+
+   if (wq_has_sleeper(&user->wait))
+      wake_up_interruptible_poll(&user->wait, events);
+   if (changed && wq_has_sleeper(&dev->wait))
+      wake_up_interruptible_poll(&dev->wait, EPOLLIN | EPOLLRDNORM);
+   if (changed) kill_fasync(&user->fasync, SIGIO, POLL_IN);
+}
+
+/*
+ * hw4mod_lock:  takes a lock a write needs, failing with -EAGAIN rather than
+ *               waiting if filp was opened O_NONBLOCK, or with -ERESTARTSYS
+ *               if a signal ends the wait
+ */
+static int hw4mod_lock(struct file *filp, struct mutex *lock) {
+   if (filp->f_flags & O_NONBLOCK) return mutex_trylock(lock) ? 0 : -EAGAIN;
+
+   return mutex_lock_interruptible(lock) ? -ERESTARTSYS : 0;
+}
+
+/*
+ * hw4mod_snap_build:  rewrites the snapshot of hf's mapping in place from
+ *                     user's pairs; the caller holds the user's lock, so the
+ *                     pairs and the count of them hold still
+ */
+static void hw4mod_snap_build(struct hw4mod_file *hf,
+                              struct hpw_list_h *user) {
+
+   struct hw4mod_snap *snap  = hf->snap;
+   size_t              size  = hf->snap_pages << PAGE_SHIFT;
+   u32                 total = user->total_hpw_pairs;
+   size_t              off   = struct_size(snap, rec, total);
+   size_t              hlen, plen;
+   struct hpw_list    *l;
+   u32                 count = 0;
+   int                 fits  = (off <= size);
+
+   rcu_read_lock();
+
+   for (l = first_hint(&hf->dev->pwd_vault, hf->snap_uid); l != NULL;
+        l = next_hint(&hf->dev->pwd_vault, hf->snap_uid, l)) {
+      hlen = strlen(pair_hint(l));
+      plen = strlen(pair_pwd(l));
+
+      /* the records stop at the first pair that does not fit */
+      fits = fits && off + hlen + plen + 2 <= size;
+      if (fits) {
+         snap->rec[count].hint = off;
+         snap->rec[count].pwd  = off + hlen + 1;
+         snap->rec[count].hlen = hlen;
+         snap->rec[count].plen = plen;
+         memcpy((char *) snap + off,            pair_hint(l), hlen + 1);
+         memcpy((char *) snap + off + hlen + 1, pair_pwd(l),  plen + 1);
+         count++;
+      }
+
+      off += hlen + plen + 2;
+   }
+
+   rcu_read_unlock();
+
+   snap->gen   = user->gen;
+   snap->count = count;
+   snap->total = total;
+   snap->size  = off;
+   hf->snap_gen = user->gen;
+}
+
+/*
+ * hw4mod_vm_fault:  maps a page of the snapshot, first rebuilding it if the
+ *                   user's pairs changed since it was built
+ */
+static vm_fault_t hw4mod_vm_fault(struct vm_fault *vmf) {
+
+   struct hw4mod_file *hf = vmf->vma->vm_file->private_data;
+   struct hpw_list_h  *user;
+   struct page        *page;
+
+   if (vmf->pgoff >= hf->snap_pages) return VM_FAULT_SIGBUS;
+
+   /* mmap allocated the user, and users are never freed while loaded */
+   user = vault_user(&hf->dev->pwd_vault, hf->snap_uid, FALSE);
+
+   mutex_lock(&user->lock);
+   if (hf->snap_gen != user->gen) hw4mod_snap_build(hf, user);
+   vault_user_unlock(user);
+
+   page = vmalloc_to_page(hf->snap + (vmf->pgoff << PAGE_SHIFT));
+   get_page(page);
+   vmf->page = page;
+
+   return 0;
+}
+
+static const struct vm_operations_struct hw4mod_vm_ops = {
+   .fault = hw4mod_vm_fault,
+};
+
+/*
+ * Mmap: maps the snapshot of the caller's pairs read-only; the first mmap
+ *       of a file sizes its snapshot, and later ones may map no more of it.
+ *       No page is filled until it is touched.
+ */
+int hw4mod_mmap(struct file *filp, struct vm_area_struct *vma) {
+
+   struct hw4mod_file *hf     = filp->private_data;
+   unsigned long       pages  = vma_pages(vma);
+   int                 retval = 0;
+
+   if (vma->vm_flags & VM_WRITE) return -EPERM;
+   if (vma->vm_pgoff != 0)       return -EINVAL;
+
+   if (filp->f_flags & O_NONBLOCK) {
+      if (!mutex_trylock(&hf->wlock)) return -EAGAIN;
+   } else {
+      mutex_lock(&hf->wlock);
+   }
+
+   if (hf->snap == NULL) {
+
+      /* faults lock the user, so the user must exist before them */
+      if (vault_user(&hf->dev->pwd_vault, current_uid(), TRUE) == NULL) {
+         retval = -ENOMEM;
+         goto out;
+      }
+
+      hf->snap = vmalloc_user(pages << PAGE_SHIFT);
+      if (hf->snap == NULL) {
+         retval = -ENOMEM;
+         goto out;
+      }
+
+      /* no generation is all ones, so the first fault builds the snapshot */
+      hf->snap_pages = pages;
+      hf->snap_uid   = current_uid();
+      hf->snap_gen   = U64_MAX;
+
+      /* from now on a change to the pairs unmaps the file's mapping too */
+      hf->snap_mapping = filp->f_mapping;
+      mutex_lock(&hf->dev->map_lock);
+      list_add(&hf->map_link, &hf->dev->maps);
+      mutex_unlock(&hf->dev->map_lock);
+
+   } else if (pages > hf->snap_pages) {
+      retval = -EINVAL;
+      goto out;
+   }
+
+   vm_flags_mod(vma, VM_DONTEXPAND | VM_DONTDUMP, VM_MAYWRITE);
+   vma->vm_ops = &hw4mod_vm_ops;
+
+  out:
+   mutex_unlock(&hf->wlock);
+   return retval;
+}
+
 /*
  * Open: to open the device is to initialize it for the remaining methods.
  */
 int hw4mod_open(struct inode *inode, struct file *filp) {
 
-   int uid = get_current_user()->uid.val;
-   uid -= 1000;
-
    /* the device this function is handling (one of the hw4mod_devices) */
-   struct hw4mod_dev *dev;
+   struct hw4mod_dev  *dev;
+   struct hw4mod_file *hf;
+   struct hpw_list_h  *user;
 
    /* we need the hw4mod_dev object (dev), but the required prototpye
       for the open method is that it receives a pointer to an inode.
@@ -73,23 +370,30 @@ int hw4mod_open(struct inode *inode, struct file *filp) {
    dev = container_of(inode->i_cdev, struct hw4mod_dev, cdev);
 
    /* so that we don't need to use the container_of() macro repeatedly,
-      we save the handle to dev in the file's private_data for other methods.
+      we save the handle to dev in the file's private_data for other methods,
+      along with the part of a record that a write may leave unfinished.
     */
-   filp->private_data = dev;
-
-   /* grab the semaphore, so the call to trim() is atomic */
-   if (down_interruptible(&dev->sem)) return -ERESTARTSYS;
-
-   dev->pwd_vault.uhpw_data[uid].data;
-   
-   if(dev->pwd_vault.uhpw_data[uid].num_hints > 0){
-     dev->pwd_vault.uhpw_data[uid].fp = dev->pwd_vault.uhpw_data[uid].data[0];
-   } else {
-     dev->pwd_vault.uhpw_data[uid].fp = NULL;
-   }
-
-   /* release the semaphore */
-   up(&dev->sem);
+   hf = kmalloc(sizeof(*hf), GFP_KERNEL);
+   if (hf == NULL) return -ENOMEM;
+
+   hf->dev   = dev;
+   hf->rmode = HW4MOD_READ_PAIR;
+   hf->plen  = 0;
+   hf->snap  = NULL;
+   hf->async = NULL;
+   hf->seen_gen = 0;
+   hf->cur.fp   = NULL;
+   hf->cur_user = NULL;
+   hf->seek_hint = NULL;
+   mutex_init(&hf->wlock);
+   spin_lock_init(&hf->lock);
+   filp->private_data = hf;
+
+   /* the cursor starts at the first pair on the file's first read or seek,
+    * so opening takes no lock; the opener has seen the pairs as they are
+    */
+   user = vault_user(&dev->pwd_vault, current_uid(), FALSE);
+   if (user != NULL) hf->seen_gen = READ_ONCE(user->gen);
 
    return 0;
 }
@@ -97,14 +401,116 @@ int hw4mod_open(struct inode *inode, struct file *filp) {
 /*
  * Release: release is the opposite of open, so it deallocates any
  *          memory allocated by hw4mod_open and shuts down the device.
- *          since open didn't allocate anything and our device exists
- *          only in memory, there are no actions to take here.
+ *          a stream that ends without a newline, as a file copied in with
+ *          cat may, leaves its last record in partial; it is applied here,
+ *          where there is no longer a caller to report a failure to, for
+ *          the writer who left it, whoever closes the file last.
  */
 int hw4mod_release(struct inode *inode, struct file *filp) {
+
+   struct hw4mod_file *hf   = filp->private_data;
+   struct hpw_list_h  *user;
+   int                 applied;
+
+   if (hf->plen > 0) {
+      user = vault_user(&hf->dev->pwd_vault, hf->partial_uid, TRUE);
+      if (user != NULL) {
+         mutex_lock(&user->lock);
+         applied = (hw4mod_apply(hf, user, hf->partial_uid, hf->partial,
+                                 hf->plen) == 0);
+         if (applied) hw4mod_snap_stale(hf->dev);
+         vault_user_unlock(user);
+         hw4mod_notify(hf->dev, user, applied);
+      }
+   }
+
+   /* remove this filp from the asynchronously notified filp's */
+   hw4mod_fasync(-1, filp, 0);
+
+   /* a delete must no longer move the cursor, which is freed below */
+   user = hf->cur_user;
+   if (user != NULL) {
+      spin_lock(&user->cur_lock);
+      remove_cursor(user, &hf->cur);
+      spin_unlock(&user->cur_lock);
+   }
+
+   /* the file outlives every mapping of it, so no one maps the snapshot */
+   if (hf->snap != NULL) {
+      mutex_lock(&hf->dev->map_lock);
+      list_del(&hf->map_link);
+      mutex_unlock(&hf->dev->map_lock);
+   }
+   vfree(hf->snap);
+   kfree(hf->seek_hint);
+   mutex_destroy(&hf->wlock);
+   kfree(hf);
    return 0;
 }
 
 
+/*
+ * hw4mod_read_packed:  fills buf with as many pairs from the cursor on as
+ *                      fit in count bytes, as "hint\0pwd\0", moving the
+ *                      cursor past them; the pairs are gathered under the
+ *                      cursor lock and copied out with one copy_to_user.
+ *                      A read of 0 bytes returns 0, and only a buffer too
+ *                      small for the pair at the cursor fails, with -EINVAL
+ */
+static ssize_t hw4mod_read_packed(struct hw4mod_file *hf,
+                                  struct hpw_list_h *user, kuid_t uid,
+                                  char __user *buf, size_t count,
+                                  struct hw4mod_lat *lat) {
+
+   struct hw4mod_dev *dev = hf->dev;
+   size_t           size = min_t(size_t, count, HW4MOD_READ_MAX);
+   size_t           used = 0, hlen, plen;
+   struct hpw_list *filePtr, *last = NULL;
+   const char      *hint, *pwd;
+   char            *kbuf;
+   ssize_t          retval;
+
+   if (count == 0) return 0;
+
+   kbuf = kvmalloc(size, GFP_KERNEL);
+   if (kbuf == NULL) return -ENOMEM;
+
+   rcu_read_lock();
+   hw4mod_lat_lock(lat);
+   hw4mod_cur_lock(hf, user);
+   hw4mod_lat_locked(lat);
+
+   for (filePtr = hf->cur.fp; filePtr != NULL;
+        filePtr = next_hint(&dev->pwd_vault, uid, filePtr)) {
+      hint = pair_hint(filePtr);
+      pwd  = pair_pwd(filePtr);
+      hlen = strlen(hint) + 1;
+      plen = strlen(pwd)  + 1;
+
+      if (used + hlen + plen > size) break;
+
+      memcpy(kbuf + used,        hint, hlen);
+      memcpy(kbuf + used + hlen, pwd,  plen);
+      used += hlen + plen;
+      last  = filePtr;
+   }
+
+   /* a buffer too small for the pair at the cursor leaves it there */
+   hf->cur.fp = filePtr;
+   if (last != NULL) hf->cur.last = last;
+
+   spin_unlock(&user->cur_lock);
+   hw4mod_lat_unlock(lat);
+   rcu_read_unlock();
+
+   if (used == 0 && filePtr != NULL)        retval = -EINVAL;
+   else if (copy_to_user(buf, kbuf, used)) retval = -EFAULT;
+   else                                     retval = used;
+
+   kvfree(kbuf);
+   return retval;
+}
+
 /*
  * Read: implements the read action on the device by reading count
  *       bytes into buf beginning at file position f_pos from the file 
@@ -115,35 +521,65 @@ int hw4mod_release(struct inode *inode, struct file *filp) {
 ssize_t hw4mod_read(struct file *filp, char __user *buf, size_t count,
                     loff_t *f_pos) {
 
-   struct hw4mod_dev  *dev  = filp->private_data; 
+   struct hw4mod_file *hf   = filp->private_data;
+   struct hw4mod_dev  *dev  = hf->dev;
    ssize_t retval   = 0;
-   char readBuf[80];
-   int uid = get_current_user()->uid.val;
-   uid -= 999;
+   char *readBuf;
+   kuid_t uid = current_uid();
+   struct hpw_list_h *user;
+   struct hw4mod_lat  lat;
+
+   hw4mod_lat_begin(&lat);
+
+   /* a user who never wrote has nothing to read */
+   user = vault_user(&dev->pwd_vault, uid, FALSE);
+   if (user == NULL) goto out;
 
-   /* acquire the semaphore */
-   if (down_interruptible(&dev->sem)) return -ERESTARTSYS;
+   if (READ_ONCE(hf->rmode) == HW4MOD_READ_PACKED) {
+      retval = hw4mod_read_packed(hf, user, uid, buf, count, &lat);
+      goto out;
+   }
+
+   /* the pair is formatted off the kernel stack, as a packed read's are */
+   readBuf = kmalloc(HW4MOD_DATA_SIZE, GFP_KERNEL);
+   if (readBuf == NULL) {
+      retval = -ENOMEM;
+      goto out;
+   }
 
-   /* if the read position is beyond the end of the file, then goto exit
-    * note that we can't simply return, because we are holding the
-    * semaphore, "goto out" provides a single exit point that allows for
-    * releasing the semaphore.
+   /* readers never wait on a writer: the pairs stay valid under RCU, and
+    * cur_lock keeps a writer from unlinking the pair at the cursor
     */
+   rcu_read_lock();
+   hw4mod_lat_lock(&lat);
+   hw4mod_cur_lock(hf, user);
+   hw4mod_lat_locked(&lat);
 
-   struct hpw_list *filePtr = dev->pwd_vault.uhpw_data[uid-1].fp;
+   struct hpw_list *filePtr = hf->cur.fp;
 
    if(filePtr != NULL){
-     buf[0] = '\0';
-     strcat(buf, filePtr->hpw.hint);
-     strcat(buf, " ");
-     strcat(buf, filePtr->hpw.pwd);
+     snprintf(readBuf, HW4MOD_DATA_SIZE, "%s %s", pair_hint(filePtr),
+              pair_pwd(filePtr));
 
-     dev->pwd_vault.uhpw_data[uid-1].fp = next_hint(&dev->pwd_vault, uid, dev->pwd_vault.uhpw_data[uid-1].fp);
+     hf->cur.fp   = next_hint(&dev->pwd_vault, uid, filePtr);
+     hf->cur.last = filePtr;
 
      retval = 1;
    }
 
-   up(&dev->sem);
+   spin_unlock(&user->cur_lock);
+   hw4mod_lat_unlock(&lat);
+   rcu_read_unlock();
+
+   /* copy the pair out only after the locks are dropped, since it may fault */
+   if (retval > 0 &&
+       copy_to_user(buf, readBuf, min(count, strlen(readBuf) + 1))) {
+      retval = -EFAULT;
+   }
+   kfree(readBuf);
+
+  out:
+   hw4mod_lat_end(&lat, HW4MOD_LAT_READ);
    return retval;
 }
 
@@ -152,51 +588,183 @@ ssize_t hw4mod_read(struct file *filp, char __user *buf, size_t count,
  *        bytes from buf into the "file" referenced by filp beginning at the 
  *        file position f_pos.  The attribute "__user" indicates that buf 
  *        originates from user space memory and should therefore not be trusted.
+ *
+ *        buf is a stream of "hint pwd" records, each ended by a newline or a
+ *        NUL.  A NUL also ends the input of the call, so a writer may pass a
+ *        whole buffer holding one NUL-terminated record; an empty record
+ *        ended by a NUL deletes the pair at the cursor, while blank lines
+ *        are skipped.  A record the call does not finish is kept for the
+ *        next write.  The buffer is copied in once and all of its records
+ *        are applied under one acquisition of the user's lock; the count
+ *        returned covers the bytes consumed, stopping short of a record that
+ *        could not be applied.  Through a file opened O_NONBLOCK, a write
+ *        that would wait for another writer fails with -EAGAIN instead.
  */
 ssize_t hw4mod_write(struct file *filp, const char __user *buf, size_t count,
                      loff_t *f_pos) {
 
-   struct hw4mod_dev  *dev  = filp->private_data;
-   ssize_t retval   = -ENOMEM;         /* value used in "goto out" statements */
-
-   if (down_interruptible(&dev->sem)) return -ERESTARTSYS;
-   
-   int uid = get_current_user()->uid.val;
-   uid -= 999;
-   struct hpw_list *filePtr = dev->pwd_vault.uhpw_data[uid-1].fp;
-   
-   char *hint, *password, *temp;
-   
-   if(strcmp(buf, "") == 0){
-     if(filePtr != NULL){
-       struct hpw_list *next_Ptr = filePtr->next;
-       hint = filePtr->hpw.hint;
-       password = filePtr->hpw.pwd;
-       delete_pair(&dev->pwd_vault, uid, hint, password);
-     }
-     struct hpw_list *next_Ptr = filePtr->next;
-
-   }else {
-     password = strchr(buf, ' ');
-     password++;
-     hint = buf;
-     char * tmp = password;
-     tmp[-1] = '\0';
-     insert_pair (&dev->pwd_vault, uid, hint, password);
-
-   }
-
-   up(&dev->sem);
+   struct hw4mod_file *hf   = filp->private_data;
+   struct hw4mod_dev  *dev  = hf->dev;
+   size_t              len  = min_t(size_t, count, HW4MOD_WRITE_MAX);
+   kuid_t              uid  = current_uid();
+   int                 err  = 0, done = FALSE;
+   int                 applied = FALSE;
+   char               *kbuf, *p, *end, *eor;
+   char               *rec  = hf->rec;
+   size_t              n;
+   ssize_t             retval;
+   struct hw4mod_lat   lat;
+
+   if (count == 0) return 0;
+
+   hw4mod_lat_begin(&lat);
+
+   /* the user's first write allocates the user's list head */
+   struct hpw_list_h *user = vault_user(&dev->pwd_vault, uid, TRUE);
+   if (user == NULL) {
+      retval = -ENOMEM;
+      goto out;
+   }
+
+   /* copy the records in before taking any lock, since the copy may fault */
+   kbuf = kvmalloc(len, GFP_KERNEL);
+   if (kbuf == NULL) {
+      retval = -ENOMEM;
+      goto out;
+   }
+
+   if (copy_from_user(kbuf, buf, len)) {
+      retval = -EFAULT;
+      goto out_free;
+   }
+
+   /* writes through one file keep their order around the partial record,
+    * and the wait for them is counted with the wait for the user's lock
+    */
+   hw4mod_lat_lock(&lat);
+   retval = hw4mod_lock(filp, &hf->wlock);
+   if (retval) goto out_free;
+
+   /* only writers with the same uid wait for this lock */
+   retval = hw4mod_lock(filp, &user->lock);
+   if (retval) {
+      mutex_unlock(&hf->wlock);
+      goto out_free;
+   }
+   hw4mod_lat_locked(&lat);
+
+   for (p = kbuf, end = kbuf + len; p < end && !done; p = eor + 1) {
+
+      for (eor = p; eor < end && *eor != '\n' && *eor != '\0'; eor++);
+      n = eor - p;
+
+      /* a record too long for any hint and pwd is rejected */
+      if (hf->plen + n > MAX_HINT_PWD_SIZE - 1) {
+         err = -EINVAL;
+         break;
+      }
+
+      /* an unfinished record waits for the write that finishes it */
+      if (eor == end) {
+         memcpy(hf->partial + hf->plen, p, n);
+         hf->plen       += n;
+         hf->partial_uid = uid;
+         p         = end;
+         break;
+      }
+
+      memcpy(rec, hf->partial, hf->plen);
+      memcpy(rec + hf->plen, p, n);
+      n += hf->plen;
+
+      if (n > 0 || *eor == '\0') {
+         err = hw4mod_apply(hf, user, uid, rec, n);
+         if (err) break;
+         applied = TRUE;
+      }
+
+      hf->plen = 0;
+      done     = (*eor == '\0');
+   }
+
+   /* mappings fault back in, and rebuild their snapshots, before the next
+    * writer can change the pairs again
+    */
+   if (applied) hw4mod_snap_stale(hf->dev);
+
+   vault_user_unlock(user);
+   hw4mod_lat_unlock(&lat);
+
+   /* a failing first record fails the call; a bad one is then discarded */
+   if (err && p == kbuf) {
+      if (err == -EINVAL) hf->plen = 0;
+      retval = err;
+   } else {
+      /* the bytes past a NUL are unused, but they are consumed all the same */
+      retval = done ? count : p - kbuf;
+   }
+
+   mutex_unlock(&hf->wlock);
+
+   /* both locks are free, so pollers waiting to write may go ahead */
+   hw4mod_notify(hf->dev, user, applied);
+
+  out_free:
+   kvfree(kbuf);
+  out:
+   hw4mod_lat_end(&lat, HW4MOD_LAT_WRITE);
    return retval;
 }
 
+/*
+ * The state of a prefix query as prefix_walk hands it each matching pair:
+ * the first skip matches are passed over, the rest are packed as
+ * "hint\0pwd\0" while they fit in buf, and need counts the bytes all of the
+ * rest would take, so the caller can size a retry.  count is the number of
+ * matches passed over or packed, where the next page starts.
+ */
+struct hw4mod_pquery {
+   char   *buf;
+   size_t  size;
+   size_t  used;
+   size_t  need;
+   u32     skip;
+   u32     count;
+};
+
+static int hw4mod_pquery_add(struct hpw_list *l, void *arg) {
+   struct hw4mod_pquery *pq   = arg;
+   const char           *hint = pair_hint(l);
+   const char           *pwd  = pair_pwd(l);
+   size_t                hlen, plen;
+
+   if (pq->skip > 0) {
+      pq->skip--;
+      return 0;
+   }
+
+   hlen = strlen(hint) + 1;
+   plen = strlen(pwd)  + 1;
+
+   if (pq->need == pq->used && pq->used + hlen + plen <= pq->size) {
+      memcpy(pq->buf + pq->used,        hint, hlen);
+      memcpy(pq->buf + pq->used + hlen, pwd,  plen);
+      pq->used += hlen + plen;
+      pq->count++;
+   }
+
+   pq->need += hlen + plen;
+   return 0;
+}
+
 /*
  * Ioctl:  the ioctl() call is the "catchall" device function; its purpose
  *         is to provide device control through a single standard function
  *         call.  It accomplishes this via a command value and an arg
  *         parameter which indicates which action to take.
  */
-long hw4mod_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+static long hw4mod_do_ioctl(struct file *filp, unsigned int cmd,
+                            unsigned long arg, struct hw4mod_lat *lat) {
 
    int err    = 0, tmp;
    int retval = 0;
@@ -208,40 +776,292 @@ long hw4mod_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
     * "write" is reversed
     */
 
-     if(cmd == HW4MOD_IOCGKEY){
-       if (! capable (CAP_SYS_ADMIN))
-           return -EPERM;
-       struct hw4mod_dev  *dev  = filp->private_data;
-       int uid = get_current_user()->uid.val;
-       uid -= 999;
+     if(cmd == HW4MOD_IOCSKEY){
+       struct hw4mod_file *hf   = filp->private_data;
+
+       /* copy the key in first, since the copy may fault */
+       char *key = kmalloc(MAX_HINT_PWD_SIZE, GFP_KERNEL);
+
+       if (key == NULL) return -ENOMEM;
+       tmp = strncpy_from_user(key, (const char __user *) arg,
+                               MAX_HINT_PWD_SIZE - 1);
+       if (tmp < 0) {
+          kfree(key);
+          return tmp;
+       }
+       key[tmp] = '\0';
+
+       /* the key is the file's own, so no user's lock is taken; it replaces
+        * any key that no llseek has taken yet
+        */
+       spin_lock(&hf->lock);
+       swap(key, hf->seek_hint);
+       spin_unlock(&hf->lock);
+       kfree(key);
+    }
+
+     if(cmd == HW4MOD_IOCGPREFIX){
+       struct hw4mod_file   *hf  = filp->private_data;
+       struct hw4mod_dev    *dev = hf->dev;
+       struct hw4mod_prefix  req;
+       struct hw4mod_pquery  pq  = { 0 };
+       struct hpw_list_h    *user;
+
+       if (copy_from_user(&req, (void __user *) arg, sizeof(req)))
+          return -EFAULT;
+       req.prefix[MAX_HINT_SIZE] = '\0';
+
+       pq.skip  = req.count;
+       pq.count = req.count;
+
+       /* no buffer is needed beyond what all of the user's pairs take, and
+        * none beyond what a packed read fills, so a larger answer is paged
+        */
+       user = vault_user(&dev->pwd_vault, current_uid(), FALSE);
+       if (user != NULL) {
+          pq.size = (size_t) READ_ONCE(user->total_hpw_pairs) *
+                    (HW4MOD_DATA_SIZE);
+          pq.size = min3_t(size_t, req.size, pq.size, HW4MOD_READ_MAX);
+          if (pq.size) {
+             pq.buf = kvmalloc(pq.size, GFP_KERNEL_ACCOUNT);
+             if (pq.buf == NULL) return -ENOMEM;
+          }
+
+          err = prefix_walk(&dev->pwd_vault, current_uid(), req.prefix,
+                            hw4mod_pquery_add, &pq);
+       }
+
+       /* the pairs are copied out only after the walk leaves rcu_read_lock */
+       if (!err && pq.used &&
+           copy_to_user(u64_to_user_ptr(req.buf), pq.buf, pq.used))
+          err = -EFAULT;
+       kvfree(pq.buf);
+       if (err) return err;
+
+       req.size  = min_t(size_t, pq.need, U32_MAX);
+       req.count = pq.count;
+       if (copy_to_user((void __user *) arg, &req, sizeof(req)))
+          return -EFAULT;
+
+       /* a buffer too small for the next match can only be grown */
+       if (pq.used == 0 && pq.need > 0) return -ENOSPC;
+
+       retval = pq.used;
+    }
+
+     if(cmd == HW4MOD_IOCGGEN){
+       struct hw4mod_file *hf   = filp->private_data;
+       struct hpw_list_h  *user;
+       u64                 gen  = 0;
+
+       /* the caller has now seen the pairs as of gen, so poll waits for
+        * the next change
+        */
+       user = vault_user(&hf->dev->pwd_vault, current_uid(), FALSE);
+       if (user != NULL) gen = READ_ONCE(user->gen);
+       WRITE_ONCE(hf->seen_gen, gen);
+
+       if (put_user(gen, (u64 __user *) arg)) return -EFAULT;
+    }
 
-       copy_from_user(dev->pwd_vault.uhpw_data[uid].seek_hint, arg, strlen(arg));
-       
-      
+     if(cmd == HW4MOD_IOCDELETE){
+       struct hw4mod_file *hf   = filp->private_data;
+       struct hw4mod_dev  *dev  = hf->dev;
+       kuid_t              uid  = current_uid();
+       struct hpw_list_h  *user;
+       struct hpw_list    *l;
+
+       user = vault_user(&dev->pwd_vault, uid, FALSE);
+       if (user == NULL) return -ENOENT;
+
+       hw4mod_lat_lock(lat);
+       retval = hw4mod_lock(filp, &user->lock);
+       if (retval) return retval;
+       hw4mod_lat_locked(lat);
+
+       /* the user's lock keeps the pair from being deleted by anyone else
+        * once it is taken from the cursor
+        */
+       rcu_read_lock();
+       hw4mod_cur_lock(hf, user);
+       l = hf->cur.last;
+       spin_unlock(&user->cur_lock);
+       rcu_read_unlock();
+
+       if (l != NULL) {
+          delete_pair_at(&dev->pwd_vault, uid, l);
+          hw4mod_snap_stale(hf->dev);
+       } else {
+          retval = -ENOENT;
+       }
+
+       vault_user_unlock(user);
+       hw4mod_lat_unlock(lat);
+       hw4mod_notify(dev, user, l != NULL);
     }
 
       /* Tell: arg is the value */
+     if(cmd == HW4MOD_IOCTRMODE){
+       struct hw4mod_file *hf   = filp->private_data;
+
+       if (arg != HW4MOD_READ_PAIR && arg != HW4MOD_READ_PACKED)
+          return -EINVAL;
+
+       WRITE_ONCE(hf->rmode, (int) arg);
+    }
 
 
    return retval;
 }
 
+long hw4mod_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+
+   struct hw4mod_lat lat;
+   long              retval;
+
+   hw4mod_lat_begin(&lat);
+   retval = hw4mod_do_ioctl(filp, cmd, arg, &lat);
+   hw4mod_lat_end(&lat, HW4MOD_LAT_IOCTL);
+
+   return retval;
+}
+
 
 
 /*
  * Seek:  the only one of the "extended" operations which hw4mod implements.
+ *        The first seek after HW4MOD_IOCSKEY moves the cursor to the first
+ *        pair of the key's hint, whatever off and whence, and returns the
+ *        hint's position among the caller's hints.  Any other seek moves it
+ *        to record off, counting from 0 in the order reads return them,
+ *        from the start, the cursor or the end as whence is SEEK_SET,
+ *        SEEK_CUR or SEEK_END, and returns the record's number; a seek to
+ *        the end or past it leaves nothing to read.  Both take O(log n).
  */
 loff_t hw4mod_llseek(struct file *filp, loff_t off, int whence) {
 
-   struct hw4mod_dev *dev    = filp->private_data;
-   int pos;
+   struct hw4mod_file *hf    = filp->private_data;
+   struct hw4mod_dev  *dev   = hf->dev;
+   kuid_t              uid   = current_uid();
+   struct hpw_list_h  *user;
+   struct hw4mod_lat   lat;
+   char               *key;
+   loff_t              base = 0, pos = 0;
+   int hint_num = 0;
+
+   hw4mod_lat_begin(&lat);
+
+   /* a key set by IOCSKEY serves this seek alone */
+   spin_lock(&hf->lock);
+   key           = hf->seek_hint;
+   hf->seek_hint = NULL;
+   spin_unlock(&hf->lock);
+
+   /* a user who never wrote has no records, only the end */
+   user = vault_user(&dev->pwd_vault, uid, FALSE);
+   if (user == NULL) {
+      if (key == NULL) pos = (whence > SEEK_END || off < 0) ? -EINVAL : off;
+      goto out;
+   }
+
+   /* the lookup takes no sleeping lock; it runs under cur_lock so that the
+    * pair it finds cannot be unlinked before the cursor is pointed at it
+    */
+   rcu_read_lock();
+   hw4mod_lat_lock(&lat);
+   hw4mod_cur_lock(hf, user);
+   hw4mod_lat_locked(&lat);
+
+   if (key != NULL) {
+      hf->cur.fp = find_hint (&dev->pwd_vault, uid, key, &hint_num);
+      pos        = hint_num;
+   } else {
+      switch (whence) {
+      case SEEK_SET: base = 0;                                           break;
+      case SEEK_CUR: base = pair_pos(&dev->pwd_vault, uid, hf->cur.fp); break;
+      case SEEK_END: base = pair_pos(&dev->pwd_vault, uid, NULL);       break;
+      default:       base = -1;                                          break;
+      }
+
+      if (base < 0 || off < -base || off > LLONG_MAX - base) {
+         pos = -EINVAL;
+      } else {
+         pos        = base + off;
+         hf->cur.fp = nth_pair(&dev->pwd_vault, uid, pos);
+      }
+   }
+
+   spin_unlock(&user->cur_lock);
+   hw4mod_lat_unlock(&lat);
+   rcu_read_unlock();
+
+  out:
+   kfree(key);
+   hw4mod_lat_end(&lat, HW4MOD_LAT_LLSEEK);
+   return pos;
+}
+
+/*
+ * Poll:  the file is readable once the caller's pairs have changed since it
+ *        last saw them, at open or through HW4MOD_IOCGGEN, so a client may
+ *        sleep in poll or epoll and re-read only after a real change.  It
+ *        is writable when neither lock a write takes is held as poll looks.
+ *        That is advisory: another writer may take one first, so an
+ *        O_NONBLOCK write after it may still fail with -EAGAIN.
+ */
+__poll_t hw4mod_poll(struct file *filp, poll_table *wait) {
+
+   struct hw4mod_file *hf   = filp->private_data;
+   struct hw4mod_dev  *dev  = hf->dev;
+   struct hpw_list_h  *user;
+   __poll_t            mask = 0;
+
+   /* polling makes no list head; a uid without one has no pairs and no
+    * writer holding its lock, so it waits on the device for its first pairs
+    */
+   user = vault_user(&dev->pwd_vault, current_uid(), FALSE);
+   if (user == NULL) {
+      poll_wait(filp, &dev->wait, wait);
+
+      user = vault_user(&dev->pwd_vault, current_uid(), FALSE);
+      if (user == NULL) {
+         if (!mutex_is_locked(&hf->wlock)) mask |= EPOLLOUT | EPOLLWRNORM;
+         return mask;
+      }
+   }
+
+   poll_wait(filp, &user->wait, wait);
 
-   int uid = get_current_user()->uid.val;
-   uid -= 999;
+   if (READ_ONCE(user->gen) != READ_ONCE(hf->seen_gen))
+      mask |= EPOLLIN | EPOLLRDNORM;
 
-   dev->pwd_vault.uhpw_data[uid-1].fp = find_hint (&dev->pwd_vault, uid, dev->pwd_vault.uhpw_data[uid-1].seek_hint, &pos);
+   if (!mutex_is_locked(&hf->wlock) && !mutex_is_locked(&user->lock))
+      mask |= EPOLLOUT | EPOLLWRNORM;
 
-   return (loff_t) pos;
+   return mask;
+}
+
+/*
+ * Fasync:  a file set O_ASYNC gets SIGIO whenever the pairs of the user who
+ *          set it change.  The user is kept, since another user may hold
+ *          the file by the time the flag is cleared or the file released.
+ */
+int hw4mod_fasync(int fd, struct file *filp, int on) {
+
+   struct hw4mod_file *hf   = filp->private_data;
+   struct hpw_list_h  *user = hf->async;
+   int                 rc;
+
+   if (user == NULL) {
+      if (!on) return 0;
+      user = vault_user(&hf->dev->pwd_vault, current_uid(), TRUE);
+      if (user == NULL) return -ENOMEM;
+   }
+
+   rc = fasync_helper(fd, filp, on, &user->fasync);
+   if (rc >= 0) hf->async = on ? user : NULL;
+
+   return rc;
 }
 
 /* this assignment is what "binds" the template file operations with those that
@@ -253,10 +1073,306 @@ struct file_operations hw4mod_fops = {
    .read =     hw4mod_read,
    .write =    hw4mod_write,
    .unlocked_ioctl = hw4mod_ioctl,
+   .mmap =     hw4mod_mmap,
+   .poll =     hw4mod_poll,
+   .fasync =   hw4mod_fasync,
    .open =     hw4mod_open,
    .release =  hw4mod_release,
 };
 
+/*
+ * The image control files: /sys/kernel/debug/hw4mod/image<n> reads as an
+ * image of device n's vault (see save_vault), taken as the file is opened,
+ * and an image written to it is loaded into the vault as the file is closed
+ * (see load_vault), with close() returning the load's error, if any, so a
+ * vault survives a reload of the module:
+ *
+ *    cat /sys/kernel/debug/hw4mod/image0 > vault.img
+ *    ... reload hw4mod ...
+ *    cat vault.img > /sys/kernel/debug/hw4mod/image0
+ */
+struct hw4mod_image {
+   struct hw4mod_dev *dev;
+   struct mutex       lock;     /* serializes writes and the load          */
+   char              *buf;
+   size_t             size;     /* bytes allocated for buf                 */
+   size_t             len;      /* bytes of the image held in buf          */
+};
+
+static int hw4mod_image_open(struct inode *inode, struct file *filp) {
+
+   struct hw4mod_image *img;
+   size_t               need;
+
+   /* an image is either read or written through one open, not both */
+   if ((filp->f_mode & FMODE_READ) && (filp->f_mode & FMODE_WRITE))
+      return -EINVAL;
+
+   img = kzalloc(sizeof(*img), GFP_KERNEL);
+   if (img == NULL) return -ENOMEM;
+
+   img->dev = inode->i_private;
+   mutex_init(&img->lock);
+
+   /* the vault may grow between sizing the image and saving it */
+   if (filp->f_mode & FMODE_READ) {
+      for (need = save_vault(&img->dev->pwd_vault, NULL, 0);
+           need > img->size;
+           need = save_vault(&img->dev->pwd_vault, img->buf, img->size)) {
+         kvfree(img->buf);
+         img->size = need + need / 8;
+         img->buf  = kvmalloc(img->size, GFP_KERNEL);
+         if (img->buf == NULL) {
+            kfree(img);
+            return -ENOMEM;
+         }
+      }
+      img->len = need;
+   }
+
+   filp->private_data = img;
+   return 0;
+}
+
+static ssize_t hw4mod_image_read(struct file *filp, char __user *buf,
+                                 size_t count, loff_t *f_pos) {
+   struct hw4mod_image *img = filp->private_data;
+
+   return simple_read_from_buffer(buf, count, f_pos, img->buf, img->len);
+}
+
+static ssize_t hw4mod_image_write(struct file *filp, const char __user *buf,
+                                  size_t count, loff_t *f_pos) {
+
+   struct hw4mod_image *img = filp->private_data;
+   size_t               end;
+   char                *grown;
+   ssize_t              retval = count;
+
+   if (*f_pos < 0 || check_add_overflow((size_t) *f_pos, count, &end))
+      return -EINVAL;
+
+   mutex_lock(&img->lock);
+
+   /* double the buffer as the image arrives, so copies amortize */
+   if (end > img->size) {
+      size_t size = max_t(size_t, end, 2 * img->size);
+
+      grown = kvmalloc(size, GFP_KERNEL);
+      if (grown == NULL) {
+         retval = -ENOMEM;
+         goto out;
+      }
+
+      if (img->buf != NULL) memcpy(grown, img->buf, img->len);
+      kvfree(img->buf);
+      img->buf  = grown;
+      img->size = size;
+   }
+
+   if (copy_from_user(img->buf + *f_pos, buf, count)) {
+      retval = -EFAULT;
+      goto out;
+   }
+
+   /* a write past the end leaves a hole, which reads as zeros, as in a file */
+   if (*f_pos > img->len) memset(img->buf + img->len, 0, *f_pos - img->len);
+
+   *f_pos  += count;
+   img->len = max(img->len, end);
+
+  out:
+   mutex_unlock(&img->lock);
+   return retval;
+}
+
+/*
+ * Flush:  the whole image is in, so load it.  Flush runs as each descriptor
+ *         of the file is closed, and what it returns is what close() does,
+ *         so a bad or refused image fails the close.  The image is consumed
+ *         by the load, so closing a dup of the descriptor loads nothing.
+ */
+static int hw4mod_image_flush(struct file *filp, fl_owner_t id) {
+
+   struct hw4mod_image *img = filp->private_data;
+   struct pwd_vault    *v   = &img->dev->pwd_vault;
+   struct hpw_list_h   *user;
+   int                  rc  = 0;
+
+   if (!(filp->f_mode & FMODE_WRITE)) return 0;
+
+   mutex_lock(&img->lock);
+   if (img->len > 0) {
+      rc = load_vault(v, img->buf, img->len);
+      if (rc) printk(KERN_WARNING "hw4mod: image not loaded (%d)\n", rc);
+      img->len = 0;
+
+      /* any user may have gained pairs, even from a load that failed part
+       * way, so every mapping faults back in to rebuild its snapshot, and
+       * every poller is woken to look
+       */
+      hw4mod_snap_stale(img->dev);
+
+      xa_lock(&v->users);
+      list_for_each_entry(user, &v->ulist, ulist)
+         hw4mod_notify(img->dev, user, TRUE);
+      xa_unlock(&v->users);
+   }
+   mutex_unlock(&img->lock);
+
+   return rc;
+}
+
+static int hw4mod_image_release(struct inode *inode, struct file *filp) {
+
+   struct hw4mod_image *img = filp->private_data;
+
+   mutex_destroy(&img->lock);
+   kvfree(img->buf);
+   kfree(img);
+   return 0;
+}
+
+static const struct file_operations hw4mod_image_fops = {
+   .owner =    THIS_MODULE,
+   .open =     hw4mod_image_open,
+   .read =     hw4mod_image_read,
+   .write =    hw4mod_image_write,
+   .llseek =   default_llseek,
+   .flush =    hw4mod_image_flush,
+   .release =  hw4mod_image_release,
+};
+
+/*
+ * The dump control files: /sys/kernel/debug/hw4mod/dump<n> reads as every
+ * pair of device n's vault, one "uid hint pwd" line each, in FORWARD order,
+ * and rdump<n> as the same in REVERSE order.  Each read() resumes the walk
+ * where the last one stopped, holding one user's lock only while it fills
+ * its buffer, so writers wait at most that long; a user whose pairs change
+ * between reads may have a pair skipped or repeated.
+ */
+struct hw4mod_dump {
+   struct pwd_vault    *v;
+   struct vault_cursor  c;
+};
+
+static void *hw4mod_dump_start(struct seq_file *m, loff_t *pos) {
+
+   struct hw4mod_dump *d = m->private;
+   struct hpw_list    *l;
+
+   /* reading on from where the last read stopped resumes the cursor; any
+    * other position is found by walking to it from the start
+    */
+   if (*pos == d->c.pos) return vault_cursor_start(d->v, &d->c);
+
+   vault_cursor_init(&d->c, d->c.dir);
+   for (l = vault_cursor_start(d->v, &d->c); l != NULL && d->c.pos < *pos;
+        l = vault_cursor_next(d->v, &d->c));
+
+   return l;
+}
+
+static void *hw4mod_dump_next(struct seq_file *m, void *v, loff_t *pos) {
+
+   struct hw4mod_dump *d = m->private;
+
+   ++*pos;
+   return vault_cursor_next(d->v, &d->c);
+}
+
+static void hw4mod_dump_stop(struct seq_file *m, void *v) {
+
+   struct hw4mod_dump *d = m->private;
+
+   vault_cursor_stop(d->v, &d->c);
+}
+
+static int hw4mod_dump_show(struct seq_file *m, void *v) {
+
+   struct hw4mod_dump *d = m->private;
+   struct hpw_list    *l = v;
+
+   seq_printf(m, "%u %s %s\n", __kuid_val(d->c.user->uid), pair_hint(l),
+              pair_pwd(l));
+   return 0;
+}
+
+static const struct seq_operations hw4mod_dump_sops = {
+   .start = hw4mod_dump_start,
+   .next  = hw4mod_dump_next,
+   .stop  = hw4mod_dump_stop,
+   .show  = hw4mod_dump_show,
+};
+
+static int hw4mod_dump_open_dir(struct inode *inode, struct file *filp,
+                                int dir) {
+
+   struct hw4mod_dump *d;
+
+   d = __seq_open_private(filp, &hw4mod_dump_sops, sizeof(*d));
+   if (d == NULL) return -ENOMEM;
+
+   d->v = &((struct hw4mod_dev *) inode->i_private)->pwd_vault;
+   vault_cursor_init(&d->c, dir);
+
+   return 0;
+}
+
+static int hw4mod_dump_open(struct inode *inode, struct file *filp) {
+   return hw4mod_dump_open_dir(inode, filp, FORWARD);
+}
+
+static int hw4mod_rdump_open(struct inode *inode, struct file *filp) {
+   return hw4mod_dump_open_dir(inode, filp, REVERSE);
+}
+
+static const struct file_operations hw4mod_dump_fops = {
+   .owner =    THIS_MODULE,
+   .open =     hw4mod_dump_open,
+   .read =     seq_read,
+   .llseek =   seq_lseek,
+   .release =  seq_release_private,
+};
+
+static const struct file_operations hw4mod_rdump_fops = {
+   .owner =    THIS_MODULE,
+   .open =     hw4mod_rdump_open,
+   .read =     seq_read,
+   .llseek =   seq_lseek,
+   .release =  seq_release_private,
+};
+
+/*
+ * The shrinker counts, and scans, in pages of deleted pairs' strings that
+ * the vaults' arenas still hold.  The arenas are compacted as pairs are
+ * deleted once half of an arena is dead, so this is at most half of them.
+ */
+static unsigned long hw4mod_shrink_count(struct shrinker *shrink,
+                                         struct shrink_control *sc) {
+   unsigned long bytes = 0;
+   int           i;
+
+   for (i = 0; i < hw4mod_nr_devs; i++) {
+      bytes += vault_reclaimable(&hw4mod_devices[i].pwd_vault);
+   }
+
+   return bytes >> PAGE_SHIFT;
+}
+
+static unsigned long hw4mod_shrink_scan(struct shrinker *shrink,
+                                        struct shrink_control *sc) {
+   unsigned long nr    = sc->nr_to_scan << PAGE_SHIFT;
+   unsigned long freed = 0;
+   int           i;
+
+   for (i = 0; i < hw4mod_nr_devs && freed < nr; i++) {
+      freed += shrink_vault(&hw4mod_devices[i].pwd_vault, nr - freed);
+   }
+
+   return (freed > 0) ? freed >> PAGE_SHIFT : SHRINK_STOP;
+}
+
 /*
  * Finally, the module stuff
  */
@@ -273,27 +1389,111 @@ void hw4mod_cleanup_module(void) {
    /* if the devices were succesfully allocated, then the referencing pointer
     * will be non-NULL.
     */
+   /* no control file may reach a vault once the vaults are freed */
+   proc_remove(hw4mod_proc);
+   hw4mod_proc = NULL;
+   debugfs_remove_recursive(hw4mod_debugfs);
+   hw4mod_debugfs = NULL;
+
+   /* nor may the shrinker */
+   shrinker_free(hw4mod_shrinker);
+   hw4mod_shrinker = NULL;
+
    if (hw4mod_devices != NULL) {
 
       /* Get rid of our char dev entries by first deallocating memory and then
-       * deleting them from the kernel */
+       * deleting them from the kernel; a failed load set up only some, and
+       * a vault that fails to initialize releases what it had itself
+       */
       int i;
-      for (i = 0; i < hw4mod_nr_devs; i++) {
+      for (i = 0; i < hw4mod_nr_ready; i++) {
 	 finalize_vault(&(hw4mod_devices+i)->pwd_vault);
          cdev_del(&hw4mod_devices[i].cdev);
+         mutex_destroy(&hw4mod_devices[i].map_lock);
       }
+      hw4mod_nr_ready = 0;
 
       /* free the referencing structures */
       kfree(hw4mod_devices);
    }
 
+   /* the vaults are gone, so their slab caches are empty and no more
+    * changes reach the journal */
+   finalize_vault_caches();
+   hw4mod_journal_cleanup();
+
    /* cleanup_module is never called if registering failed */
-   unregister_chrdev_region(devno, hw4mod_nr_devs);
+   unregister_chrdev_region(devno, hw4mod_nr_devs + 1);
 
    printk(KERN_NOTICE "hw4mod unloaded\n");
 }
 
 
+/*
+ * The proc file /proc/hw4mod reads as a line of totals for each device:
+ *
+ *    hw4mod0 users 2 hints 3 pairs 5 bytes 420 inserts 9 deletes 4 lookups 12 misses 1
+ *
+ * The totals are summed from per-CPU counters, so a read takes no vault or
+ * user lock and costs the same however many pairs the vaults hold.
+ */
+static int hw4mod_proc_show(struct seq_file *m, void *v) {
+
+   struct pwd_vault   *vault;
+   struct vault_stats  sum;
+   int                 i;
+
+   for (i = 0; i < hw4mod_nr_devs; i++) {
+      vault = &hw4mod_devices[i].pwd_vault;
+      vault_stats(vault, &sum);
+
+      seq_printf(m, "hw4mod%d users %d hints %ld pairs %ld bytes %ld "
+                 "inserts %llu deletes %llu lookups %llu misses %llu\n", i,
+                 READ_ONCE(vault->num_users), sum.hints, sum.pairs, sum.bytes,
+                 sum.inserts, sum.deletes, sum.lookups, sum.misses);
+   }
+
+   return 0;
+}
+
+/*
+ * The users control files: /sys/kernel/debug/hw4mod/users<n> reads as a
+ * line for each of device n's users, from the users' own counters:
+ *
+ *    uid 1000 hints 2 pairs 4 bytes 340
+ *    uid 1001 hints 1 pairs 1 bytes 80
+ *
+ * Which uids hold pwds is not for every user to see, so unlike /proc/hw4mod
+ * the files are readable by root alone, as the dump files are.
+ */
+static int hw4mod_users_show(struct seq_file *m, void *v) {
+
+   struct pwd_vault  *vault = &((struct hw4mod_dev *) m->private)->pwd_vault;
+   struct hpw_list_h *user;
+
+   xa_lock(&vault->users);
+   list_for_each_entry(user, &vault->ulist, ulist) {
+      seq_printf(m, "uid %u hints %d pairs %d bytes %zu\n",
+                 __kuid_val(user->uid), READ_ONCE(user->num_hints),
+                 READ_ONCE(user->total_hpw_pairs), READ_ONCE(user->bytes));
+   }
+   xa_unlock(&vault->users);
+
+   return 0;
+}
+
+static int hw4mod_users_open(struct inode *inode, struct file *filp) {
+   return single_open(filp, hw4mod_users_show, inode->i_private);
+}
+
+static const struct file_operations hw4mod_users_fops = {
+   .owner =    THIS_MODULE,
+   .open =     hw4mod_users_open,
+   .read =     seq_read,
+   .llseek =   seq_lseek,
+   .release =  single_release,
+};
+
 /*
  * Set up the char_dev structure for this device.
  */
@@ -319,14 +1519,16 @@ int hw4mod_init_module(void) {
 
    /*
     * Compile-time default for major is zero (dynamically assigned) unless 
-    * directed otherwise at load time.  Also get range of minors to work with.
+    * directed otherwise at load time.  Also get range of minors to work with,
+    * one per vault and one more for the journal.
     */
    if (hw4mod_major == 0) {
-      result      = alloc_chrdev_region(&dev,hw4mod_minor,hw4mod_nr_devs,"hw4mod");
+      result      = alloc_chrdev_region(&dev,hw4mod_minor,hw4mod_nr_devs + 1,
+                                        "hw4mod");
       hw4mod_major = MAJOR(dev);
    } else {
       dev    = MKDEV(hw4mod_major, hw4mod_minor);
-      result = register_chrdev_region(dev, hw4mod_nr_devs, "hw4mod");
+      result = register_chrdev_region(dev, hw4mod_nr_devs + 1, "hw4mod");
    }
 
    /* report failue to aquire major number */
@@ -335,6 +1537,17 @@ int hw4mod_init_module(void) {
       return result;
    }
 
+   /* create the slab caches that hold the vaults' hints and passwords */
+   if (!initialize_vault_caches()) {
+      result = -ENOMEM;
+      goto fail;
+   }
+
+   /* the journal must be ready before any vault can change */
+   result = hw4mod_journal_init(MKDEV(hw4mod_major,
+                                      hw4mod_minor + hw4mod_nr_devs));
+   if (result < 0) goto fail;
+
    /* 
     * allocate the devices -- we can't have them static, as the number
     * can be specified at load time
@@ -352,9 +1565,50 @@ int hw4mod_init_module(void) {
 
    /* Initialize each device. */
    for (i = 0; i < hw4mod_nr_devs; i++) {
-      initialize_vault(&hw4mod_devices[i].pwd_vault, HW4MOD_MAX_USERS_IN_VAULT);
-      sema_init(&hw4mod_devices[i].sem, 1);
+      mutex_init(&hw4mod_devices[i].map_lock);
+      INIT_LIST_HEAD(&hw4mod_devices[i].maps);
+      init_waitqueue_head(&hw4mod_devices[i].wait);
+      if (!initialize_vault(&hw4mod_devices[i].pwd_vault, hw4mod_num_users,
+                            hw4mod_num_hints)) {
+         result = -ENOMEM;
+         goto fail;
+      }
+      hw4mod_devices[i].pwd_vault.note      = hw4mod_journal_note;
+      hw4mod_devices[i].pwd_vault.max_pairs = hw4mod_user_pairs;
+      hw4mod_devices[i].pwd_vault.max_bytes = hw4mod_user_bytes;
       hw4mod_setup_cdev(&hw4mod_devices[i], i);
+      hw4mod_nr_ready = i + 1;
+   }
+
+   /* the control files are a convenience, so the module loads without them */
+   hw4mod_debugfs = debugfs_create_dir("hw4mod", NULL);
+   for (i = 0; i < hw4mod_nr_devs; i++) {
+      char name[16];
+
+      snprintf(name, sizeof(name), "image%d", i);
+      debugfs_create_file(name, 0600, hw4mod_debugfs, &hw4mod_devices[i],
+                          &hw4mod_image_fops);
+      snprintf(name, sizeof(name), "dump%d", i);
+      debugfs_create_file(name, 0400, hw4mod_debugfs, &hw4mod_devices[i],
+                          &hw4mod_dump_fops);
+      snprintf(name, sizeof(name), "rdump%d", i);
+      debugfs_create_file(name, 0400, hw4mod_debugfs, &hw4mod_devices[i],
+                          &hw4mod_rdump_fops);
+      snprintf(name, sizeof(name), "users%d", i);
+      debugfs_create_file(name, 0400, hw4mod_debugfs, &hw4mod_devices[i],
+                          &hw4mod_users_fops);
+   }
+   hw4mod_lat_init(hw4mod_debugfs);
+
+   /* as is the proc file */
+   hw4mod_proc = proc_create_single("hw4mod", 0444, NULL, hw4mod_proc_show);
+
+   /* the vaults work without the shrinker, only holding dead strings longer */
+   hw4mod_shrinker = shrinker_alloc(0, "hw4mod");
+   if (hw4mod_shrinker != NULL) {
+      hw4mod_shrinker->count_objects = hw4mod_shrink_count;
+      hw4mod_shrinker->scan_objects  = hw4mod_shrink_scan;
+      shrinker_register(hw4mod_shrinker);
    }
 
    printk(KERN_NOTICE "hw4mod loaded\n");
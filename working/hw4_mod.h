@@ -26,6 +26,7 @@
 #define _HW4_MOD_H_
 
 #include <linux/ioctl.h>      /* needed for the _IOW etc stuff used later */
+#include <linux/types.h>      /* __u32, __u64 */
 
 #ifndef HW4MOD_MAJOR
 #define HW4MOD_MAJOR 0        /* dynamic major by default    */
@@ -35,8 +36,24 @@
 #define HW4MOD_NR_DEVS 1      /* need hw4mod0 only           */
 #endif
 
-#ifndef HW4MOD_MAX_USERS_IN_VAULT
-#define HW4MOD_MAX_USERS_IN_VAULT 20  /* sufficient for HW exercise */
+#ifndef HW4MOD_NUM_USERS
+#define HW4MOD_NUM_USERS 20   /* users preallocated at load  */
+#endif
+
+#ifndef HW4MOD_NUM_HINTS
+#define HW4MOD_NUM_HINTS 16   /* hints indexed per new user  */
+#endif
+
+#ifndef HW4MOD_JOURNAL_SIZE
+#define HW4MOD_JOURNAL_SIZE 4096 /* records the journal ring holds */
+#endif
+
+#ifndef HW4MOD_WRITE_MAX
+#define HW4MOD_WRITE_MAX 65536 /* most bytes one write() takes in */
+#endif
+
+#ifndef HW4MOD_READ_MAX
+#define HW4MOD_READ_MAX  65536 /* most bytes one packed read() fills */
 #endif
 
 #define HW4MOD_DATA_SIZE MAX_HINT_PWD_SIZE+2 /* [MAX_HINT_PWD_SIZE] */
@@ -45,16 +62,34 @@
  * The bare device is a pwd_vault data structure in memory.
  *
  * hw4mod_dev.pwd_vault               is the password vault
- * hw4mod_dev.pwd_vault->uhpw_data    is the array of hints and pwds for ea user
- * hw4mod_dev.pwd_vault->uhpw_data[i] is the hints and pwds for user i
+ * hw4mod_dev.pwd_vault->users        is the map from kuid to each user's hints
+ *                                    and pwds, allocated on the user's first
+ *                                    write; vault_user(v, uid, 0) looks one up
+ * uhpw_data[i] = vault_user(v, i, 0) is the hints and pwds for user i
+ *   uhpw_data[i]->lock               is the mutex writers hold while they
+ *                                    change user i's hints and pwds; readers
+ *                                    look them up under rcu_read_lock
+ *   uhpw_data[i]->cur_lock           is the spinlock guarding the cursors
  *   uhpw_data[i]->total_hpw_pairs    is the num of [hint pwd] pairs for user i
  *   uhpw_data[i]->num_hints          is the num of hints for user i
- *   uhpw_data[i]->seek_hint          is the user's seek paramater set in ioctl
- *   uhpw_data[i]->data               is an array of lists of [hint pwd] pairs
- *   uhpw_data[i]->fp                 is the "file position", a pointer to the
- *                                    current [hint pwd] pair
- *   uhpw_data[i]->data[j]            is the first [hint pwd] in the list of 
- *                                    [hint pwd] pairs for hint j
+ *   uhpw_data[i]->bytes              is the bytes user i is charged, checked
+ *                                    against hw4mod_user_bytes on insert
+ *   uhpw_data[i]->slots              is the list of slots, one per hint, in
+ *                                    the order the hints were inserted
+ *   uhpw_data[i]->cursors            is the list of the cursors of the open
+ *                                    files last used by user i; a cursor's
+ *                                    fp is the "file position", a pointer to
+ *                                    the current [hint pwd] pair
+ *   slot->pairs                      is the list of [hint pwd] pairs that 
+ *                                    share the slot's hint
+ *   uhpw_data[i]->index              is a hash index from each hint to its
+ *                                    slot
+ *   uhpw_data[i]->trie               is a crit-bit trie of the slots, in hint
+ *                                    order, which answers prefix queries
+ *   uhpw_data[i]->order              is an order index of the slots and their
+ *                                    pairs, which numbers records for llseek
+ *   uhpw_data[i]->arena              is one contiguous block holding the
+ *                                    strings of all of user i's pairs
  *   struct hpw_list *l=next_hint(l); is how to walk to the next pair in list
  *
  */
@@ -62,8 +97,49 @@
 
 struct hw4mod_dev {
 	struct pwd_vault    pwd_vault;  /* the password vault               */
-	struct semaphore    sem;        /* mutual exclusion semaphore       */
 	struct cdev         cdev;	     /* Char device structure	   	     */
+	struct mutex        map_lock;   /* guards maps                      */
+	struct list_head    maps;       /* the files mapped, by map_link    */
+	wait_queue_head_t   wait;       /* pollers whose uid has no head    */
+};
+
+/*
+ * Each open of the device keeps a hw4mod_file in filp->private_data.  A
+ * write may end in the middle of a record; partial holds the start of that
+ * record until a later write (or the release) ends it, and partial_uid the
+ * writer it belongs to, since the release may run as anyone.  A file that is
+ * mapped also keeps the snapshot of the mapping user's pairs; the snap_
+ * fields other than snap and snap_mapping, which the first mmap sets, are
+ * guarded by that user's lock.  A mapped file is on its device's maps, under
+ * map_lock, so a change made through any node of the device unmaps it.
+ *
+ * Each file has its own cursor and seek key, so readers sharing a uid scan
+ * independently.  The cursor is registered with the list head of the uid
+ * that last read or seeked through the file, and is guarded by that head's
+ * cur_lock; cur_user changes only under lock, which also guards seek_hint.
+ * The record a write is applying is assembled in rec, under wlock, rather
+ * than on the kernel stack.
+ */
+struct hw4mod_file {
+	struct hw4mod_dev  *dev;        /* the device this file opened          */
+	struct mutex        wlock;      /* serializes writes and the first mmap */
+	int                 rmode;      /* HW4MOD_READ_PAIR or _PACKED          */
+	size_t              plen;       /* bytes of the record held in partial  */
+	char                partial[MAX_HINT_PWD_SIZE];
+	kuid_t              partial_uid; /* the writer of the partial record  */
+	void               *snap;       /* the mapped snapshot, vmalloc_user'd  */
+	unsigned long       snap_pages; /* pages in snap                        */
+	struct address_space *snap_mapping; /* the mapping of the file's node   */
+	struct list_head    map_link;   /* on dev->maps while snap is mapped    */
+	kuid_t              snap_uid;   /* the user whose pairs snap holds      */
+	u64                 snap_gen;   /* the user's gen when snap was built   */
+	u64                 seen_gen;   /* the user's gen the reader last saw   */
+	struct hpw_list_h  *async;      /* the user whose changes signal SIGIO  */
+	spinlock_t          lock;       /* guards cur_user and the seek key     */
+	struct hpw_cursor   cur;        /* the file's place in cur_user's pairs */
+	struct hpw_list_h  *cur_user;   /* the user cur is registered with      */
+	char               *seek_hint;  /* IOCSKEY's key, for the next llseek   */
+	char                rec[MAX_HINT_PWD_SIZE]; /* a write's record, wlock'd */
 };
 
 /*
@@ -72,6 +148,13 @@ struct hw4mod_dev {
 extern int   hw4mod_major;
 extern int   hw4mod_nr_devs;
 extern int   hw4mod_num_users;
+extern int   hw4mod_num_hints;
+extern int   hw4mod_journal_size;
+extern int   hw4mod_user_pairs;
+extern unsigned long hw4mod_user_bytes;
+extern int   hw4mod_latency;
+
+extern struct hw4mod_dev *hw4mod_devices;
 
 /*
  * Prototypes for shared functions
@@ -82,6 +165,44 @@ ssize_t hw4mod_write (struct file *filp, const char __user *buf, size_t count,
                       loff_t *f_pos);
 loff_t  hw4mod_llseek(struct file *filp, loff_t off, int whence);
 long    hw4mod_ioctl (struct file *filp, unsigned int cmd, unsigned long arg);
+int     hw4mod_mmap  (struct file *filp, struct vm_area_struct *vma);
+__poll_t hw4mod_poll (struct file *filp, struct poll_table_struct *wait);
+int     hw4mod_fasync(int fd, struct file *filp, int on);
+
+/*
+ * The journal device, in hw4_journal.c, takes the minor after the vaults'
+ */
+int     hw4mod_journal_init   (dev_t devno);
+void    hw4mod_journal_cleanup(void);
+void    hw4mod_journal_note   (struct pwd_vault *v, int op, kuid_t uid,
+                               const char *hint, const char *pwd);
+
+/*
+ * The latency histograms, in hw4_lat.c, time each read, write, ioctl and
+ * llseek, split into the time it waited for the user's locks and the time
+ * it held them.  A fop starts its hw4mod_lat with hw4mod_lat_begin, calls
+ * _lock before asking for a lock, _locked once it holds it and _unlock once
+ * it lets it go, and ends with hw4mod_lat_end.
+ */
+enum { HW4MOD_LAT_READ, HW4MOD_LAT_WRITE, HW4MOD_LAT_IOCTL, HW4MOD_LAT_LLSEEK,
+       HW4MOD_LAT_NR_OPS };
+
+struct hw4mod_lat {
+   u64 start;                          /* ns the fop began, 0 if not timed  */
+   u64 mark;                           /* ns a lock was asked for or taken  */
+   u64 wait;                           /* ns spent waiting for locks        */
+   u64 hold;                           /* ns spent holding them             */
+   int locks;                          /* locks taken                       */
+};
+
+struct dentry;
+
+void    hw4mod_lat_init  (struct dentry *dir);
+void    hw4mod_lat_begin (struct hw4mod_lat *l);
+void    hw4mod_lat_lock  (struct hw4mod_lat *l);
+void    hw4mod_lat_locked(struct hw4mod_lat *l);
+void    hw4mod_lat_unlock(struct hw4mod_lat *l);
+void    hw4mod_lat_end   (struct hw4mod_lat *l, int op);
 
 /*
  * Ioctl definitions
@@ -97,6 +218,101 @@ long    hw4mod_ioctl (struct file *filp, unsigned int cmd, unsigned long arg);
  */
 #define HW4MOD_IOCSKEY     _IOW (HW4MOD_IOC_MAGIC,   1, char)
 #define HW4MOD_IOCGKEY     _IOR (HW4MOD_IOC_MAGIC,   2, char)
-#define HW4MOD_IOC_MAXNR                             2
+#define HW4MOD_IOCGPREFIX  _IOWR(HW4MOD_IOC_MAGIC,  3, struct hw4mod_prefix)
+#define HW4MOD_IOCTRMODE   _IO  (HW4MOD_IOC_MAGIC,   4)
+#define HW4MOD_IOCGGEN     _IOR (HW4MOD_IOC_MAGIC,   5, __u64)
+#define HW4MOD_IOCDELETE   _IO  (HW4MOD_IOC_MAGIC,   6)
+#define HW4MOD_IOC_MAXNR                             6
+
+/*
+ * A read-only mmap of the device exposes a snapshot of the caller's pairs:
+ * a header, a table of count records, then the strings each record points
+ * at, NUL-terminated.  Offsets are from the start of the mapping.  The
+ * snapshot is rebuilt only when a page is faulted after the pairs change,
+ * and every write that changes them unmaps the pages, so gen tells whether
+ * a scan saw one snapshot.  A mapping too small for every pair holds only
+ * the first count of total pairs; size is the mapping the whole needs.
+ */
+struct hw4mod_snap_rec {
+   __u32 hint;                         /* offset of the hint                */
+   __u32 pwd;                          /* offset of the pwd                 */
+   __u16 hlen;                         /* hint length, NUL not included     */
+   __u16 plen;                         /* pwd length, NUL not included      */
+};
+
+struct hw4mod_snap {
+   __u64 gen;                          /* generation of the user's pairs    */
+   __u32 count;                        /* records in this snapshot          */
+   __u32 total;                        /* pairs the user has                */
+   __u64 size;                         /* bytes a snapshot of all needs     */
+   struct hw4mod_snap_rec rec[];
+};
+
+/*
+ * The journal device reads as a stream of hw4mod_jrec records, one for each
+ * pair inserted into or deleted from any vault, numbered by seq from 0 in
+ * the order the changes were made.  A read blocks until a record past the
+ * file position is written, and then returns as many whole records as fit.
+ * The file position is the seq of the next record to read, so a consumer
+ * resumes with lseek(fd, seq, SEEK_SET), or skips to new records with
+ * lseek(fd, 0, SEEK_END).  The journal keeps only its newest records; a
+ * reader that falls behind them gets EPIPE once and resumes at the oldest.
+ * Since the records hold every user's pwds, only CAP_SYS_ADMIN may open it.
+ * A hint or pwd shorter than its field ends with a NUL, and the bytes past
+ * the NUL are left over from older records.
+ */
+#define HW4MOD_JOURNAL_INSERT 0       /* VAULT_INSERT                      */
+#define HW4MOD_JOURNAL_DELETE 1       /* VAULT_DELETE                      */
+
+struct hw4mod_jrec {
+   __u64 seq;                          /* the number of this record         */
+   __u32 uid;                          /* the user whose pair changed       */
+   __u8  op;                           /* HW4MOD_JOURNAL_INSERT or _DELETE  */
+   __u8  dev;                          /* the vault's device number         */
+   __u8  hlen;                         /* bytes of hint used, without NUL   */
+   __u8  plen;                         /* bytes of pwd used, without NUL    */
+   char  hint[MAX_HINT_SIZE];
+   char  pwd[MAX_PWD_SIZE];
+};
+
+/*
+ * HW4MOD_IOCTRMODE tells an open file how read() returns pairs.  In the
+ * default HW4MOD_READ_PAIR mode each read returns one pair as "hint pwd";
+ * in HW4MOD_READ_PACKED mode each read fills the buffer with as many pairs
+ * as fit, as "hint\0pwd\0", and returns the bytes filled.
+ */
+#define HW4MOD_READ_PAIR   0
+#define HW4MOD_READ_PACKED 1
+
+/*
+ * Every change to a user's pairs moves the user's generation, which
+ * HW4MOD_IOCGGEN returns.  Each open file remembers the generation it last
+ * saw, at open or through HW4MOD_IOCGGEN, and polls readable (and sends
+ * SIGIO, if set O_ASYNC) once the user's has moved past it.
+ */
+
+/*
+ * HW4MOD_IOCDELETE deletes the pair the file's last read returned (the last
+ * of a packed read's), without searching for it, or fails with -ENOENT if
+ * there is none or it has since been deleted.  The cursor stays where the
+ * read left it, so a client may read and delete pair by pair.
+ */
+
+/*
+ * HW4MOD_IOCGPREFIX fills the buffer at buf, of size bytes, with the caller's
+ * pairs whose hint starts with prefix, as "hint\0pwd\0" in hint order,
+ * skipping the first count of them, and returns the bytes filled.  No more
+ * than HW4MOD_READ_MAX bytes are filled at once.  On return, size holds the
+ * bytes all of the matches not skipped need and count the number of matches
+ * skipped or filled, so a caller pages through the matches by asking again
+ * with count unchanged until the call fills size bytes.  If the buffer is
+ * too small for the next match, the call fails with ENOSPC.
+ */
+struct hw4mod_prefix {
+   __u64 buf;
+   __u32 size;
+   __u32 count;
+   char  prefix[MAX_HINT_SIZE+1];
+};
 
 #endif /* _HW4_MOD_H_ */
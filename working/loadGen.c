@@ -0,0 +1,371 @@
+/* Author:  Keith Shomper
+ * Date:    1 Nov 2017
+ * Purpose: Load generator for the key vault implementation that is
+ *          embedded in a kernel module.  Forks worker processes, each
+ *          under its own uid (so each works on its own pairs, behind its
+ *          own lock), that run a mix of inserts, sequential reads, seeks
+ *          (ioctl + lseek) and deletes against /dev/hw4mod for a while.
+ *          The workers double from 1 to the most asked for, and each step
+ *          reports the throughput and p50/p99/p999 latency of each op.
+ *
+ *          Run as root, so the workers can take their uids:
+ *
+ *          sudo ./loadGen [-w workers] [-t secs] [-m ins:read:seek:del]
+ *                         [-k hints] [-u uid] [-s] [device]
+ *
+ *          -s runs every worker under one uid, to measure the contention
+ *          for one user's lock; without root, -s runs them as the caller.
+ */
+
+#define _GNU_SOURCE          /* setresuid() */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "pwd_vault.h"
+
+#define HW4MOD_IOC_MAGIC  'k'
+#define HW4MOD_IOCSKEY     _IOW (HW4MOD_IOC_MAGIC,   1, char)
+
+#define BUF_SIZE   (MAX_HINT_PWD_SIZE)
+
+/* the ops a worker mixes, in the order -m gives their weights */
+enum { OP_INSERT, OP_READ, OP_SEEK, OP_DELETE, NUM_OPS };
+
+static const char *op_name[NUM_OPS] = { "insert", "read", "seek", "delete" };
+
+/*
+ * Latencies are counted in buckets of 16 per power of two, so a percentile
+ * read from the buckets is within about 6% of the true one.
+ */
+#define SUB_BITS   4
+#define SUB        (1 << SUB_BITS)
+#define NUM_BUCKETS ((64 - SUB_BITS + 1) * SUB)
+
+struct op_stats {
+   uint64_t count;
+   uint64_t bucket[NUM_BUCKETS];
+};
+
+/* what each worker shares with the parent, in a MAP_SHARED mapping */
+struct worker {
+   struct op_stats op[NUM_OPS];
+   uint64_t        errors;
+};
+
+/* the parent sets go to start the workers' clocks and stop to end them */
+struct control {
+   volatile int go;
+   volatile int stop;
+   int          nworkers;      /* workers forked                         */
+   int          ready;         /* workers done preloading                */
+   int          stopped;       /* workers out of their timed loop        */
+};
+
+static int   weight[NUM_OPS] = { 10, 70, 10, 10 };
+static int   nhints  = 1000;
+static uid_t base    = 20000;
+static int   shared  = 0;
+static char *device  = "/dev/hw4mod";
+
+static uint64_t now(void) {
+   struct timespec t;
+
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return (uint64_t) t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/* bucket_of:  the bucket counting a latency of ns */
+static int bucket_of(uint64_t ns) {
+   int msb;
+
+   if (ns < SUB) return (int) ns;
+
+   msb = 63 - __builtin_clzll(ns);
+   return (msb - SUB_BITS + 1) * SUB +
+          (int) ((ns >> (msb - SUB_BITS)) & (SUB - 1));
+}
+
+/* bucket_value:  the middle of the latencies bucket b counts */
+static uint64_t bucket_value(int b) {
+   int      shift;
+   uint64_t lo;
+
+   if (b < SUB) return b;
+
+   shift = b / SUB - 1;
+   lo    = (uint64_t) (SUB + b % SUB) << shift;
+   return lo + ((1ULL << shift) >> 1);
+}
+
+/* percentile:  the latency that a fraction p of the op's count lie under */
+static uint64_t percentile(struct op_stats *s, double p) {
+   uint64_t want = (uint64_t) (p * s->count), seen = 0;
+   int      b;
+
+   for (b = 0; b < NUM_BUCKETS; b++) {
+      seen += s->bucket[b];
+      if (seen > want) return bucket_value(b);
+   }
+   return 0;
+}
+
+static void record(struct worker *w, int op, uint64_t t0, int ok) {
+   uint64_t ns = now() - t0;
+
+   w->op[op].count++;
+   w->op[op].bucket[bucket_of(ns)]++;
+   if (!ok) w->errors++;
+}
+
+/* seek:  points the file's cursor at the first pair of hint h */
+static int seek(int fd, int h) {
+   char key[BUF_SIZE];
+
+   snprintf(key, sizeof(key), "h%d", h);
+   if (ioctl(fd, HW4MOD_IOCSKEY, key) == -1) return 0;
+
+   /* lseek returns the hint's position, so 0 is not a failure */
+   return lseek(fd, 0, SEEK_SET) != -1;
+}
+
+/* clear:  deletes every pair of the preloaded hints, which are all the
+ *         hints the workers use; a read after a seek returns nothing once
+ *         the hint has no pairs left                                     */
+static void clear(int fd) {
+   char buf[BUF_SIZE];
+   int  k;
+
+   for (k = 0; k < nhints; k++) {
+      while (seek(fd, k) && read(fd, buf, sizeof(buf)) > 0 &&
+             seek(fd, k) && write(fd, "", 1) == 1);
+   }
+}
+
+/* run_worker:  the body of worker i of n, which returns only by exiting */
+static void run_worker(int i, int n, int fd, struct worker *w,
+                       struct control *c) {
+   char     buf[BUF_SIZE];
+   int      total = 0, k, op, r, len, ok;
+   unsigned seed  = getpid() ^ (unsigned) now();
+   uint64_t t0, seq = 0;
+   uid_t    uid   = shared ? base : base + i;
+
+   /* the device was opened as root, so the open survives dropping it */
+   if (geteuid() == 0 && setresuid(uid, uid, uid) == -1) {
+      perror("setresuid");
+      exit(1);
+   }
+
+   for (op = 0; op < NUM_OPS; op++) total += weight[op];
+
+   /* each hint starts with one pair, so every seek and delete finds one;
+    * workers sharing a uid share the preloading                        */
+   for (k = shared ? i : 0; k < nhints; k += shared ? n : 1) {
+      len = snprintf(buf, sizeof(buf), "h%d p%d.%llu\n", k, i,
+                     (unsigned long long) seq++);
+      if (write(fd, buf, len) != len) w->errors++;
+   }
+   seek(fd, 0);
+
+   __atomic_add_fetch(&c->ready, 1, __ATOMIC_SEQ_CST);
+   while (!c->go) usleep(100);
+
+   while (!c->stop) {
+      r = rand_r(&seed) % total;
+      for (op = 0; r >= weight[op]; op++) r -= weight[op];
+      k = rand_r(&seed) % nhints;
+
+      switch (op) {
+      case OP_INSERT:
+         len = snprintf(buf, sizeof(buf), "h%d p%d.%llu\n", k, i,
+                        (unsigned long long) seq++);
+         t0  = now();
+         ok  = write(fd, buf, len) == len;
+         record(w, op, t0, ok);
+         break;
+
+      /* a read past the last pair starts the walk over from h0 */
+      case OP_READ:
+         t0 = now();
+         r  = read(fd, buf, sizeof(buf));
+         record(w, op, t0, r >= 0);
+         if (r == 0) seek(fd, 0);
+         break;
+
+      case OP_SEEK:
+         t0 = now();
+         ok = seek(fd, k);
+         record(w, op, t0, ok);
+         break;
+
+      /* deleting at a hint that has no pairs left deletes nothing */
+      case OP_DELETE:
+         t0 = now();
+         ok = seek(fd, k) && write(fd, "", 1) == 1;
+         record(w, op, t0, ok);
+         break;
+      }
+   }
+
+   /* leave the vault as it was, once no worker of the uid is running */
+   __atomic_add_fetch(&c->stopped, 1, __ATOMIC_SEQ_CST);
+   if (!shared || i == 0) {
+      while (shared && __atomic_load_n(&c->stopped, __ATOMIC_SEQ_CST) <
+                       __atomic_load_n(&c->nworkers, __ATOMIC_SEQ_CST)) {
+         usleep(100);
+      }
+      clear(fd);
+   }
+
+   exit(0);
+}
+
+/* step:  runs nworkers workers for secs seconds and reports their ops */
+static int step(int nworkers, int secs) {
+   struct control *c;
+   struct worker  *w;
+   struct op_stats sum;
+   uint64_t        errors = 0, t;
+   size_t          size   = sizeof(*c) + nworkers * sizeof(*w);
+   pid_t           pid;
+   int             i, op, b, fd, status, failed = 0;
+
+   c = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+            -1, 0);
+   if (c == MAP_FAILED) {
+      perror("mmap");
+      return -1;
+   }
+   w = (struct worker *) (c + 1);
+
+   /* the workers must not inherit, and so repeat, unwritten output */
+   fflush(stdout);
+
+   c->nworkers = nworkers;
+   for (i = 0; i < nworkers && !failed; i++) {
+      if ((fd = open(device, O_RDWR)) == -1) {
+         perror("opening file");
+         failed = 1;
+      } else if ((pid = fork()) == -1) {
+         perror("fork");
+         failed = 1;
+      } else if (pid == 0) {
+         run_worker(i, nworkers, fd, &w[i], c);
+      }
+      if (fd != -1) close(fd);
+   }
+
+   /* let the workers that did start clean up and exit */
+   if (failed) {
+      __atomic_store_n(&c->nworkers, i - 1, __ATOMIC_SEQ_CST);
+      c->stop = 1;
+      c->go   = 1;
+      while (wait(NULL) > 0);
+      munmap(c, size);
+      return -1;
+   }
+
+   /* the clock starts once every worker holds its pairs */
+   while (__atomic_load_n(&c->ready, __ATOMIC_SEQ_CST) < nworkers) {
+      usleep(1000);
+   }
+   t     = now();
+   c->go = 1;
+   sleep(secs);
+   c->stop = 1;
+   t       = now() - t;
+
+   while (wait(&status) > 0) {
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+   }
+
+   if (failed) {
+      fprintf(stderr, "a worker failed\n");
+      munmap(c, size);
+      return -1;
+   }
+
+   for (op = 0; op < NUM_OPS; op++) {
+      if (weight[op] == 0) continue;
+
+      memset(&sum, 0, sizeof(sum));
+      for (i = 0; i < nworkers; i++) {
+         sum.count += w[i].op[op].count;
+         for (b = 0; b < NUM_BUCKETS; b++) {
+            sum.bucket[b] += w[i].op[op].bucket[b];
+         }
+      }
+      if (sum.count == 0) continue;
+
+      printf("%7d %-7s %11.0f %9.1f %9.1f %9.1f\n", nworkers, op_name[op],
+             sum.count * 1e9 / t, percentile(&sum, 0.50) / 1e3,
+             percentile(&sum, 0.99) / 1e3, percentile(&sum, 0.999) / 1e3);
+   }
+
+   for (i = 0; i < nworkers; i++) errors += w[i].errors;
+   if (errors) printf("%7d %llu ops failed\n", nworkers,
+                      (unsigned long long) errors);
+   fflush(stdout);
+
+   munmap(c, size);
+   return 0;
+}
+
+int main(int argc, char *argv[]) {
+   int max  = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+   int secs = 5;
+   int n, opt;
+
+   while ((opt = getopt(argc, argv, "w:t:m:k:u:s")) != -1) {
+      switch (opt) {
+      case 'w': max    = atoi(optarg); break;
+      case 't': secs   = atoi(optarg); break;
+      case 'k': nhints = atoi(optarg); break;
+      case 'u': base   = atoi(optarg); break;
+      case 's': shared = 1;            break;
+      case 'm':
+         if (sscanf(optarg, "%d:%d:%d:%d", &weight[OP_INSERT], &weight[OP_READ],
+                    &weight[OP_SEEK], &weight[OP_DELETE]) == 4) break;
+         /* fall through */
+      default:
+         fprintf(stderr, "Usage:  %s [-w workers] [-t secs] "
+                 "[-m ins:read:seek:del] [-k hints] [-u uid] [-s] [device]\n",
+                 argv[0]);
+         return 1;
+      }
+   }
+   if (optind < argc) device = argv[optind];
+
+   if (max < 1 || secs < 1 || nhints < 1 || weight[OP_INSERT] < 0 ||
+       weight[OP_READ] < 0 || weight[OP_SEEK] < 0 || weight[OP_DELETE] < 0 ||
+       weight[OP_INSERT] + weight[OP_READ] + weight[OP_SEEK] +
+       weight[OP_DELETE] == 0) {
+      fprintf(stderr, "%s: bad argument\n", argv[0]);
+      return 1;
+   }
+
+   if (geteuid() != 0 && !shared) {
+      fprintf(stderr, "%s: workers need root to take their own uids; "
+              "use -s to run them all as you\n", argv[0]);
+      return 1;
+   }
+
+   printf("%7s %-7s %11s %9s %9s %9s\n", "workers", "op", "ops/s",
+          "p50 us", "p99 us", "p999 us");
+
+   /* double the workers, ending with exactly max */
+   for (n = 1; ; n = (2 * n < max) ? 2 * n : max) {
+      if (step(n, secs) != 0) return 1;
+      if (n == max) break;
+   }
+
+   return 0;
+}
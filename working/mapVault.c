@@ -0,0 +1,81 @@
+/* Author:  Keith Shomper
+ * Date:    1 Nov 2017
+ * Purpose: Prints every password in the vault from a read-only mapping of
+ *          the vault's snapshot, remapping it larger if it is too small.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+/*
+ * Snapshot layout, as the vault maps it
+ */
+
+struct hw4mod_snap_rec {
+	uint32_t hint;
+	uint32_t pwd;
+	uint16_t hlen;
+	uint16_t plen;
+};
+
+struct hw4mod_snap {
+	uint64_t gen;
+	uint32_t count;
+	uint32_t total;
+	uint64_t size;
+	struct hw4mod_snap_rec rec[];
+};
+
+int main () {
+	struct hw4mod_snap *snap;
+	size_t  page = sysconf(_SC_PAGESIZE);
+	size_t  len  = page;
+	char   *base;
+	int     fd;
+	int     i;
+
+   if ((fd = open ("/dev/hw4mod", O_RDONLY)) == -1) {
+     perror("opening file");
+     return -1;
+   }
+
+	/* a file's first mapping fixes the most of it that can be mapped, so a
+	 * mapping that proves too small is retried through a new open
+	 */
+	for (;;) {
+		base = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+		if (base == MAP_FAILED) {
+			perror("mmap");
+			return -1;
+		}
+
+		snap = (struct hw4mod_snap *) base;
+		if (snap->count == snap->total) break;
+
+		size_t need = (snap->size + page - 1) / page * page;
+
+		munmap(base, len);
+		close(fd);
+		len = need;
+
+		if ((fd = open ("/dev/hw4mod", O_RDONLY)) == -1) {
+			perror("opening file");
+			return -1;
+		}
+	}
+
+	printf("Printing passwords in vault (generation %llu):\n",
+	       (unsigned long long) snap->gen);
+	for (i = 0; i < snap->count; i++) {
+		printf("Password %2d:  %s %s\n", i + 1, base + snap->rec[i].hint,
+		       base + snap->rec[i].pwd);
+	}
+
+	munmap(base, len);
+   close(fd);
+
+   return 0;
+}
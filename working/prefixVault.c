@@ -0,0 +1,90 @@
+/* Author:  Keith Shomper
+ * Date:    1 Nov 2017
+ * Purpose: Lists the caller's hint-password pairs whose hint starts with a
+ *          prefix, using the vault's prefix query ioctl.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <string.h>
+#include <errno.h>
+
+#define MAX_HINT_SIZE 255
+
+/*
+ * Ioctl definitions
+ */
+
+struct hw4mod_prefix {
+	uint64_t buf;
+	uint32_t size;
+	uint32_t count;
+	char     prefix[MAX_HINT_SIZE+1];
+};
+
+/* Use 'k' as magic number - please use a different 8-bit number in your code */
+#define HW4MOD_IOC_MAGIC  'k'
+#define HW4MOD_IOCGPREFIX  _IOWR(HW4MOD_IOC_MAGIC,  3, struct hw4mod_prefix)
+
+int main (int argc, char **argv) {
+	struct hw4mod_prefix req;
+	char   *buf = NULL;
+	char   *p;
+	size_t  size = 0;
+	unsigned count;
+	int     fd;
+	int     rc;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage:  %s \"hint prefix\"\n", argv[0]);
+		return 1;
+	}
+
+   if ((fd = open ("/dev/hw4mod", O_RDONLY)) == -1) {
+     perror("opening file");
+     return -1;
+   }
+
+	/* ask with an empty buffer to learn the size, then fetch the matches a
+	 * page at a time, growing the buffer whenever the next one does not fit
+	 */
+	count = 0;
+	do {
+		memset(&req, 0, sizeof(req));
+		strncpy(req.prefix, argv[1], MAX_HINT_SIZE);
+		req.buf   = (uintptr_t) buf;
+		req.size  = size;
+		req.count = count;
+
+		if ((rc = ioctl(fd, HW4MOD_IOCGPREFIX, &req)) < 0) {
+			if (errno != ENOSPC) {
+				perror("prefix query");
+				return -1;
+			}
+			size = req.size;
+			if ((buf = realloc(buf, size)) == NULL) {
+				perror("realloc");
+				return -1;
+			}
+			continue;
+		}
+
+		for (p = buf; p < buf + rc; p += strlen(p) + 1) {
+			printf("[%s ", p);
+			p += strlen(p) + 1;
+			printf("%s]\n", p);
+		}
+		count = req.count;
+	} while (rc < 0 || (size_t) rc < req.size);
+
+	printf("%u pair(s) match \"%s\"\n", count, req.prefix);
+
+	free(buf);
+   close(fd);
+
+   return 0;
+}
@@ -2,568 +2,2112 @@
  * Date:    8 Nov 2016
  * Purpose: Supports HW4 for CS3320 */
 
+#include <linux/module.h>     /* for EXPORT_SYMBOL_GPL */
 #include <linux/slab.h>       /* for kmalloc*/
 #include <linux/string.h>     /* for memset*/
+#include <linux/random.h>     /* for get_random_bytes */
+#include <linux/rculist.h>    /* for list_add_tail_rcu, hlist_add_head_rcu */
+#include <linux/sched.h>      /* for cond_resched */
+#include <linux/poll.h>       /* for EPOLLOUT */
 #include "pwd_vault.h"
 
 //#define DEBUG 1
 
+/* keep the vault caches from being merged with other caches of the same size,
+ * so their usage shows up under their own names in /proc/slabinfo, and charge
+ * their objects to the memory cgroup of the writer allocating them */
+#ifdef SLAB_NO_MERGE
+#define HPW_CACHE_FLAGS (SLAB_NO_MERGE | SLAB_ACCOUNT)
+#else
+#define HPW_CACHE_FLAGS SLAB_ACCOUNT
+#endif
+
+/* the bytes a user is charged for each pair, besides its arena record, and
+ * for each hint, against the vault's byte quota */
+#define PAIR_BYTES sizeof(struct hpw_list)
+#define HINT_BYTES (sizeof(struct hpw_slot) + sizeof(struct hpw_crit))
+
+/* the number of objects handed to kmem_cache_free_bulk at a time */
+#define HPW_FREE_BATCH 32
+
+/* the subtrees a prefix walk keeps pending on the kernel stack; a deeper
+ * trie costs the walk a descent from the top for each one it drops       */
+#define HPW_WALK_DEPTH 32
+
+/* the slab caches from which all list elements, slots and trie nodes are
+ * allocated */
+static struct kmem_cache *hpw_list_cache;
+static struct kmem_cache *hpw_slot_cache;
+static struct kmem_cache *hpw_crit_cache;
+
+/* collects objects of one cache, so they are released in bulk */
+struct hpw_batch {
+   struct kmem_cache *cache;
+   size_t             n;
+   void              *obj[HPW_FREE_BATCH];
+};
+
+/* batch_flush:  releases every object collected in batch b */
+static void batch_flush (struct hpw_batch *b) {
+   if (b->n > 0) kmem_cache_free_bulk(b->cache, b->n, b->obj);
+   b->n = 0;
+}
+
+/* batch_add:  adds obj to batch b, releasing the batch once it is full */
+static void batch_add (struct hpw_batch *b, void *obj) {
+   b->obj[b->n++] = obj;
+   if (b->n == HPW_FREE_BATCH) batch_flush(b);
+}
+
+/* batch_slot:  adds slot s and every pair in its list to the batches */
+static void batch_slot (struct hpw_batch *pairs, struct hpw_batch *slots,
+                        struct hpw_slot *s) {
+   struct hpw_list *l, *tail;
+
+   list_for_each_entry_safe(l, tail, &s->pairs, list) batch_add(pairs, l);
+   batch_add(slots, s);
+}
+
+/* pair_free_rcu:  returns a pair to its cache once no reader can hold it  */
+static void pair_free_rcu (struct rcu_head *rcu) {
+   kmem_cache_free(hpw_list_cache, container_of(rcu, struct hpw_list, rcu));
+}
+
+/* slot_free_rcu:  returns a slot to its cache once no reader can hold it  */
+static void slot_free_rcu (struct rcu_head *rcu) {
+   kmem_cache_free(hpw_slot_cache, container_of(rcu, struct hpw_slot, rcu));
+}
+
+/* crit_free_rcu:  returns a trie node to its cache once no reader has it */
+static void crit_free_rcu (struct rcu_head *rcu) {
+   kmem_cache_free(hpw_crit_cache, container_of(rcu, struct hpw_crit, rcu));
+}
+
+/* rec_of:  returns the arena record holding string str                     */
+static struct hpw_rec* rec_of (char *str) {
+   return (struct hpw_rec *) (str - offsetof(struct hpw_rec, data));
+}
+
+/* pwd_inline:  TRUE if pair l keeps its pwd in the pair itself, not the arena */
+static int pwd_inline (struct hpw_list *l) {
+   return l->pwd == l->ipwd;
+}
+
+/* rec_point:  points the owner of record r at the string r holds; readers
+ *             may be following the owner, so the string is published     */
+static void rec_point (struct hpw_rec *r) {
+   smp_store_release(r->ref, r->data);
+}
+
+/* rec_copy:  appends a copy of record r to arena a, which has room for it,
+ *            and points r's owner at the copy                             */
+static void rec_copy (struct hpw_arena *a, struct hpw_rec *r) {
+   struct hpw_rec *n = (struct hpw_rec *) (a->buf + a->used);
+
+   memcpy(n, r, r->size);
+   rec_point(n);
+   a->used += n->size;
+}
+
+/* arena_grow:  copies the user's live records to a new arena with room for
+ *              at least need more bytes, allocated with gfp; each hint is
+ *              laid out ahead of the long pwds under it, in the order the
+ *              user's pairs are walked, so later walks read the arena front
+ *              to back.  Readers may still be reading the old arena, so it
+ *              is freed only after they are done.  Returns FALSE if
+ *              allocation fails.                                           */
+static int arena_grow (struct hpw_list_h *user, size_t need, gfp_t gfp) {
+   struct hpw_arena *old  = user->arena;
+   size_t            live = (old != NULL) ? old->used - old->dead : 0;
+   size_t            size = ARENA_MIN_SIZE;
+   struct hpw_arena *a;
+   struct hpw_slot  *s;
+   struct hpw_list  *l;
+
+   /* leave as much room again as is live, so growth amortizes over inserts */
+   while (size < 2 * (live + need)) size *= 2;
+
+   a = kvmalloc(sizeof(struct hpw_arena) + size, gfp);
+   if (a == NULL) return FALSE;
+
+   a->size = size;
+   a->used = 0;
+   a->dead = 0;
+
+   list_for_each_entry(s, &user->slots, list) {
+      rec_copy(a, rec_of(s->hint));
+
+      list_for_each_entry(l, &s->pairs, list) {
+         if (!pwd_inline(l)) rec_copy(a, rec_of(l->pwd));
+      }
+   }
+
+   if (old != NULL) kvfree_rcu(old, rcu);
+   user->arena = a;
+   return TRUE;
+}
+
+/* rec_size:  the arena bytes taken by a record of a string of len bytes    */
+static size_t rec_size (size_t len) {
+   return ALIGN(offsetof(struct hpw_rec, data) + len + 1, sizeof(void *));
+}
+
+/* pwd_size:  the arena bytes a pwd of len bytes takes, 0 if kept inline    */
+static size_t pwd_size (size_t len) {
+   return (len < HPW_INLINE_PWD) ? 0 : rec_size(len);
+}
+
+/* rec_fill:  appends a record of the len bytes at str to arena a, which has
+ *            room for it, and points *ref at the record's string           */
+static void rec_fill (struct hpw_arena *a, char **ref, const char *str,
+                      size_t len) {
+   struct hpw_rec *r = (struct hpw_rec *) (a->buf + a->used);
+
+   r->ref  = ref;
+   r->size = rec_size(len);
+   memcpy(r->data, str, len);
+   r->data[len] = '\0';
+
+   a->used += r->size;
+   rec_point(r);
+}
+
+/* pwd_fill:  stores the len bytes of pwd in pair l, inline if they fit and
+ *            otherwise in arena a, which then has room for them            */
+static void pwd_fill (struct hpw_arena *a, struct hpw_list *l,
+                      const char *pwd, size_t len) {
+   if (len < HPW_INLINE_PWD) {
+      memcpy(l->ipwd, pwd, len);
+      l->ipwd[len] = '\0';
+      l->pwd       = l->ipwd;
+   } else {
+      rec_fill(a, &l->pwd, pwd, len);
+   }
+}
+
+/* arena_reserve:  makes room for need more bytes in the user's arena, so
+ *                 that records of that many bytes can be filled in without
+ *                 the arena moving; returns FALSE if allocation fails      */
+static int arena_reserve (struct hpw_list_h *user, size_t need) {
+   if (need == 0) return TRUE;
+   if (user->arena != NULL && user->arena->used + need <= user->arena->size)
+      return TRUE;
+
+   return arena_grow(user, need, GFP_KERNEL_ACCOUNT);
+}
+
+/* arena_drop:  marks the record holding str dead; its bytes are reclaimed
+ *              by the next arena_compact                                   */
+static void arena_drop (struct hpw_list_h *user, char *str) {
+   struct hpw_rec *r = rec_of(str);
+
+   r->ref             = NULL;
+   user->arena->dead += r->size;
+}
+
+/* arena_repack:  copies the live records of the user's arena to a new one
+ *                allocated with gfp, reclaiming the dead records; records
+ *                never move within an arena, since readers may be reading
+ *                it.  Returns the bytes reclaimed.                         */
+static size_t arena_repack (struct hpw_list_h *user, gfp_t gfp) {
+   struct hpw_arena *a = user->arena;
+   size_t            dead;
+
+   if (a == NULL || a->dead == 0) return 0;
+   dead = a->dead;
+
+   /* nothing is live, so give the whole arena back */
+   if (a->dead == a->used) {
+      kvfree_rcu(a, rcu);
+      user->arena = NULL;
+      return dead;
+   }
+
+   /* if the copy cannot be allocated, the dead bytes wait for the next try */
+   return arena_grow(user, 0, gfp) ? dead : 0;
+}
+
+/* arena_compact:  once dead records hold over half the user's arena, copies
+ *                 the live records to a smaller one                        */
+static void arena_compact (struct hpw_list_h *user) {
+   struct hpw_arena *a = user->arena;
+
+   if (a == NULL || a->dead * 2 <= a->used) return;
+
+   arena_repack(user, GFP_KERNEL_ACCOUNT);
+}
+
+/* slot_hint:  returns the hint shared by every pair in slot s; it stays
+ *             readable until readers are done, even once s is retired      */
+static char* slot_hint (struct hpw_slot *s) {
+   return READ_ONCE(s->hint);
+}
+
+/* hint_hash:  hashes hint with the vault's secret seed; because the seed is
+ *             random, users cannot choose colliding hints                  */
+static u64 hint_hash (struct pwd_vault *v, char *hint) {
+   return siphash(hint, strnlen(hint, MAX_HINT_SIZE), &v->hkey);
+}
+
+/* index_bucket:  returns the bucket of index ix that holds hash h          */
+static struct hlist_head* index_bucket (struct hpw_index *ix, u64 h) {
+   return &ix->b[h & ((1UL << ix->bits) - 1)];
+}
+
+/* index_of:  returns the user's hint index, for a caller holding the lock  */
+static struct hpw_index* index_of (struct hpw_list_h *user) {
+   return rcu_dereference_protected(user->index, lockdep_is_held(&user->lock));
+}
+
+/* index_alloc:  allocates an empty hint index of 2^bits buckets, or NULL   */
+static struct hpw_index* index_alloc (unsigned int bits) {
+   struct hpw_index *ix = kmalloc(struct_size(ix, b, 1UL << bits),
+                                  GFP_KERNEL_ACCOUNT);
+   int               i;
+
+   if (ix == NULL) return NULL;
+
+   ix->bits = bits;
+   for (i = 0; i < (1 << bits); i++) INIT_HLIST_HEAD(&ix->b[i]);
+
+   return ix;
+}
+
+/* index_lookup:  returns the user's slot for hint, or NULL; the caller holds
+ *                the user's lock or rcu_read_lock.  A lookup racing with
+ *                index_resize may miss, so a miss is retried after the rehash */
+static struct hpw_slot* index_lookup (struct pwd_vault *v,
+                                      struct hpw_list_h *user, char *hint) {
+   u64               h = hint_hash(v, hint);
+   struct hpw_index *ix;
+   struct hpw_slot  *s;
+   unsigned int      seq;
+
+   do {
+      seq = read_seqcount_begin(&user->hseq);
+      ix  = rcu_dereference_check(user->index, lockdep_is_held(&user->lock));
+
+      hlist_for_each_entry_rcu(s, index_bucket(ix, h), hnode,
+                               lockdep_is_held(&user->lock)) {
+         if (strncmp(slot_hint(s), hint, MAX_HINT_SIZE) == 0) return s;
+      }
+   } while (read_seqcount_retry(&user->hseq, seq));
+
+   return NULL;
+}
+
+/* index_resize:  replaces the user's hint index with one of 2^bits buckets
+ *                and rehashes the slots into it; returns FALSE if
+ *                allocation fails                                          */
+static int index_resize (struct pwd_vault *v, struct hpw_list_h *user,
+                         unsigned int bits) {
+   struct hpw_index *old = index_of(user);
+   struct hpw_index *ix  = index_alloc(bits);
+   struct hpw_slot  *s;
+
+   if (ix == NULL) return FALSE;
+
+   /* every slot is on the user's list, so there is no need to walk buckets;
+    * a lookup that overlaps the moves sees the count change and retries   */
+   write_seqcount_begin(&user->hseq);
+   list_for_each_entry(s, &user->slots, list) {
+      hlist_add_head_rcu(&s->hnode,
+                         index_bucket(ix, hint_hash(v, slot_hint(s))));
+   }
+   rcu_assign_pointer(user->index, ix);
+   write_seqcount_end(&user->hseq);
+
+   kfree_rcu(old, rcu);
+   return TRUE;
+}
+
+/* ORDER_MIN_SIZE:  the fewest positions an order index is allocated with  */
+#define ORDER_MIN_SIZE 16
+
+/* fen_add:  adds d to position i of the Fenwick tree t of size positions    */
+static void fen_add (int *t, unsigned int size, unsigned int i, int d) {
+   for (; i <= size; i += i & -i) WRITE_ONCE(t[i], t[i] + d);
+}
+
+/* fen_sum:  returns the sum of positions 1 to i of the Fenwick tree t      */
+static int fen_sum (int *t, unsigned int size, unsigned int i) {
+   int sum = 0;
+
+   for (i = min(i, size); i > 0; i -= i & -i) sum += READ_ONCE(t[i]);
+
+   return sum;
+}
+
+/* fen_find:  returns the last position p of the Fenwick tree t, of a power
+ *            of 2 positions, whose sum of positions 1 to p is at most *k,
+ *            and takes that sum from *k                                     */
+static unsigned int fen_find (int *t, unsigned int size, int *k) {
+   unsigned int p = 0, step;
+
+   for (step = size; step > 0; step >>= 1) {
+      if (p + step <= size && READ_ONCE(t[p + step]) <= *k) {
+         p  += step;
+         *k -= READ_ONCE(t[p]);
+      }
+   }
+
+   return p;
+}
+
+/* order_of:  returns the user's order index, for a caller holding the lock,
+ *            cur_lock or rcu_read_lock                                      */
+static struct hpw_order* order_of (struct hpw_list_h *user) {
+   return rcu_dereference_check(user->order,
+                                lockdep_is_held(&user->lock) ||
+                                lockdep_is_held(&user->cur_lock));
+}
+
+/* order_alloc:  allocates an empty order index of size positions, or NULL */
+static struct hpw_order* order_alloc (unsigned int size) {
+   struct hpw_order *o;
+   size_t            n = size + 1;
+
+   o = kvzalloc(sizeof(*o) + n * (sizeof(*o->slot) + 2 * sizeof(int)),
+                GFP_KERNEL_ACCOUNT);
+   if (o == NULL) return NULL;
+
+   o->size  = size;
+   o->slot  = (struct hpw_slot **) (o + 1);
+   o->hints = (int *) (o->slot + n);
+   o->pairs = o->hints + n;
+
+   return o;
+}
+
+/* order_reserve:  makes room in the user's order index for n more slots,
+ *                 replacing it with one of the live slots alone, in order,
+ *                 with room for as many again, if it has none; returns
+ *                 FALSE if allocation fails.  The caller holds the lock.   */
+static int order_reserve (struct hpw_list_h *user, unsigned int n) {
+   struct hpw_order *old = order_of(user), *o;
+   struct hpw_slot  *s;
+   unsigned int      size = ORDER_MIN_SIZE, i = 0, j;
+
+   if (old != NULL && old->used + n <= old->size) return TRUE;
+
+   while (size < 2 * (user->num_hints + n)) size *= 2;
+
+   o = order_alloc(size);
+   if (o == NULL) return FALSE;
+
+   /* the trees are built bottom up, each position adding to its parent */
+   list_for_each_entry(s, &user->slots, list) {
+      o->slot[++i]  = s;
+      o->hints[i]   = 1;
+      o->pairs[i]   = s->npairs;
+   }
+   o->used = i;
+
+   for (i = 1; i <= size; i++) {
+      j = i + (i & -i);
+      if (j > size) continue;
+      o->hints[j] += o->hints[i];
+      o->pairs[j] += o->pairs[i];
+   }
+
+   /* cursor holders see the slots move along with the index */
+   spin_lock(&user->cur_lock);
+   for (i = 1; i <= o->used; i++) WRITE_ONCE(o->slot[i]->pos, i);
+   rcu_assign_pointer(user->order, o);
+   spin_unlock(&user->cur_lock);
+
+   if (old != NULL) kvfree_rcu(old, rcu);
+   return TRUE;
+}
+
+/* order_count:  counts d more pairs for slot s in the user's order index,
+ *               first giving s the next position if it has none; the caller
+ *               holds the lock and cur_lock, and reserved the position     */
+static void order_count (struct hpw_list_h *user, struct hpw_slot *s, int d) {
+   struct hpw_order *o = order_of(user);
+
+   if (s->pos == 0) {
+      WRITE_ONCE(o->slot[o->used + 1], s);
+      fen_add(o->hints, o->size, o->used + 1, 1);
+      WRITE_ONCE(s->pos, o->used + 1);
+      WRITE_ONCE(o->used, o->used + 1);
+   }
+
+   s->npairs += d;
+   fen_add(o->pairs, o->size, s->pos, d);
+}
+
+/* order_retire:  drops retired slot s from the user's order index; the
+ *                caller holds the lock and cur_lock                        */
+static void order_retire (struct hpw_list_h *user, struct hpw_slot *s) {
+   struct hpw_order *o = order_of(user);
+
+   fen_add(o->hints, o->size, s->pos, -1);
+   WRITE_ONCE(o->slot[s->pos], NULL);
+}
+
+/* slot_ord:  returns the position of slot s among the user's hints; exact
+ *            for a caller holding the lock or cur_lock, and otherwise one
+ *            that held while the caller looked                           */
+static int slot_ord (struct hpw_list_h *user, struct hpw_slot *s) {
+   struct hpw_order *o = order_of(user);
+
+   return fen_sum(o->hints, o->size, READ_ONCE(s->pos) - 1);
+}
+
+/* trie_is_node:  TRUE if trie child p is an internal node, not a slot     */
+static int trie_is_node (void *p) {
+   return ((unsigned long) p & 1) != 0;
+}
+
+/* trie_node:  returns the internal node that trie child p refers to       */
+static struct hpw_crit* trie_node (void *p) {
+   return (struct hpw_crit *) ((unsigned long) p - 1);
+}
+
+/* trie_dir:  returns which child of q the key of length len lies under     */
+static int trie_dir (struct hpw_crit *q, const char *key, size_t len) {
+   u8 c = (q->byte < len) ? key[q->byte] : 0;
+
+   return (1 + (q->otherbits | c)) >> 8;
+}
+
+/* trie_insert:  adds slot s to the user's trie under its hint, using the
+ *               preallocated node c, which is freed if the trie was empty */
+static void trie_insert (struct hpw_list_h *user, struct hpw_slot *s,
+                         struct hpw_crit *c) {
+   const char  *key = slot_hint(s);
+   size_t       len = strlen(key);
+   void __rcu **where;
+   const char  *best;
+   void        *p;
+   u32          byte;
+   u8           bits;
+   int          dir;
+
+   p = rcu_dereference_protected(user->trie, lockdep_is_held(&user->lock));
+   if (p == NULL) {
+      kmem_cache_free(hpw_crit_cache, c);
+      rcu_assign_pointer(user->trie, s);
+      return;
+   }
+
+   /* find the hint nearest key; the hints are distinct, so they differ */
+   while (trie_is_node(p)) {
+      struct hpw_crit *q = trie_node(p);
+
+      p = rcu_dereference_protected(q->child[trie_dir(q, key, len)],
+                                    lockdep_is_held(&user->lock));
+   }
+   best = slot_hint(p);
+
+   for (byte = 0; byte < len && best[byte] == key[byte]; byte++);
+   bits = best[byte] ^ key[byte];
+
+   /* keep only the highest differing bit, then complement the mask */
+   while (bits & (bits - 1)) bits &= bits - 1;
+   bits ^= 0xff;
+   dir   = (1 + (bits | (u8) best[byte])) >> 8;
+
+   c->byte      = byte;
+   c->otherbits = bits;
+   RCU_INIT_POINTER(c->child[1 - dir], s);
+
+   /* the node goes above the first node that tests a later bit */
+   where = &user->trie;
+   for (;;) {
+      struct hpw_crit *q;
+
+      p = rcu_dereference_protected(*where, lockdep_is_held(&user->lock));
+      if (!trie_is_node(p)) break;
+
+      q = trie_node(p);
+      if (q->byte > byte || (q->byte == byte && q->otherbits > bits)) break;
+      where = &q->child[trie_dir(q, key, len)];
+   }
+
+   /* the node is complete, so readers may find it from here on */
+   RCU_INIT_POINTER(c->child[dir], p);
+   rcu_assign_pointer(*where, (void *) ((unsigned long) c + 1));
+}
+
+/* trie_delete:  removes slot s, held under key, from the user's trie      */
+static void trie_delete (struct hpw_list_h *user, struct hpw_slot *s,
+                         const char *key) {
+   size_t           len   = strnlen(key, MAX_HINT_SIZE);
+   void __rcu     **where = &user->trie;
+   void __rcu     **up    = NULL;
+   struct hpw_crit *q     = NULL;
+   void            *p;
+   int              dir   = 0;
+
+   p = rcu_dereference_protected(*where, lockdep_is_held(&user->lock));
+   while (trie_is_node(p)) {
+      up    = where;
+      q     = trie_node(p);
+      dir   = trie_dir(q, key, len);
+      where = &q->child[dir];
+      p     = rcu_dereference_protected(*where, lockdep_is_held(&user->lock));
+   }
+
+   if (p != s) return;
+
+   /* the slot's sibling takes the place of the slot's parent */
+   if (up == NULL) {
+      RCU_INIT_POINTER(user->trie, NULL);
+      return;
+   }
+
+   rcu_assign_pointer(*up, rcu_dereference_protected(q->child[1 - dir],
+                                           lockdep_is_held(&user->lock)));
+   call_rcu(&q->rcu, crit_free_rcu);
+}
+
+/* trie_free:  releases the internal nodes of trie p, which has no readers  */
+static void trie_free (void *p) {
+   struct hpw_crit *q;
+
+   if (!trie_is_node(p)) return;
+
+   q = trie_node(p);
+   trie_free(rcu_dereference_protected(q->child[0], TRUE));
+   trie_free(rcu_dereference_protected(q->child[1], TRUE));
+   kmem_cache_free(hpw_crit_cache, q);
+}
+
+/* initialize_vault_caches:  creates the slab caches used by every vault */
+int  initialize_vault_caches (void) {
+   hpw_list_cache = KMEM_CACHE(hpw_list, HPW_CACHE_FLAGS);
+   hpw_slot_cache = KMEM_CACHE(hpw_slot, HPW_CACHE_FLAGS);
+   hpw_crit_cache = KMEM_CACHE(hpw_crit, HPW_CACHE_FLAGS);
+
+   /* if any cache could not be created, release the others */
+   if (hpw_list_cache == NULL || hpw_slot_cache == NULL ||
+       hpw_crit_cache == NULL) {
+      finalize_vault_caches();
+      return FALSE;
+   }
+
+   return TRUE;
+}
+
+/* finalize_vault_caches:  destroys the caches once every vault is finalized */
+void finalize_vault_caches (void) {
+
+   /* pairs and slots deleted from the vaults may still be awaiting readers */
+   rcu_barrier();
+
+   kmem_cache_destroy(hpw_list_cache);
+   kmem_cache_destroy(hpw_slot_cache);
+   kmem_cache_destroy(hpw_crit_cache);
+   hpw_list_cache = NULL;
+   hpw_slot_cache = NULL;
+   hpw_crit_cache = NULL;
+}
+
+/* user_alloc:  allocates an empty list head, with a hint index of the size
+ *              the vault was initialized for; NULL if allocation fails     */
+static struct hpw_list_h* user_alloc (struct pwd_vault *v) {
+   struct hpw_list_h *user = kzalloc(sizeof(struct hpw_list_h),
+                                     GFP_KERNEL_ACCOUNT);
+
+   if (user == NULL) return NULL;
+
+   RCU_INIT_POINTER(user->index, index_alloc(v->hbits));
+   if (rcu_access_pointer(user->index) == NULL) {
+      kfree(user);
+      return NULL;
+   }
+
+   mutex_init(&user->lock);
+   spin_lock_init(&user->cur_lock);
+   init_waitqueue_head(&user->wait);
+   seqcount_mutex_init(&user->hseq, &user->lock);
+   INIT_LIST_HEAD(&user->slots);
+   INIT_LIST_HEAD(&user->cursors);
+
+   return user;
+}
+
+/* user_free:  releases a list head and everything it holds; the pairs and
+ *             slots are added to the batches, to be released in bulk       */
+static void user_free (struct hpw_list_h *user, struct hpw_batch *pairs,
+                       struct hpw_batch *slots) {
+   struct hpw_slot *s, *t;
+
+   /* free memory for each chain of linked-list passwords */
+   list_for_each_entry_safe(s, t, &user->slots, list) {
+      batch_slot(pairs, slots, s);
+   }
+
+   /* free the allocated memory for user's strings and hint indexes */
+   trie_free (rcu_dereference_protected(user->trie, TRUE));
+   mutex_destroy (&user->lock);
+   kvfree (user->arena);
+   kvfree (rcu_dereference_protected(user->order, TRUE));
+   kfree (rcu_dereference_protected(user->index, TRUE));
+   kfree (user);
+}
+
+/* find_user:  returns the list head of user uid, or NULL if uid has none   */
+static struct hpw_list_h* find_user (struct pwd_vault *v, kuid_t uid) {
+   return xa_load(&v->users, __kuid_val(uid));
+}
+
 /* initialize_vault:  initializes the pwd vault */
-int  initialize_vault (struct pwd_vault *v, int size) {
+int  initialize_vault (struct pwd_vault *v, int nusers, int nhints) {
+   int i;
 
-   /* allocate memory for the password vault */
+   /* the vault starts without users; list heads are allocated on demand.
+    * The lists are set up first, so a failed vault finalizes cleanly    */
    v->num_users = 0;
-   v->uhpw_data = kmalloc(size*sizeof(struct hpw_list_h), GFP_KERNEL);
-   memset(v->uhpw_data, 0, size*sizeof(struct hpw_list_h));
+   v->note      = NULL;
+   v->max_pairs = 0;
+   v->max_bytes = 0;
+   xa_init(&v->users);
+   INIT_LIST_HEAD(&v->ulist);
+   INIT_LIST_HEAD(&v->pool);
+
+   /* the counters are the one allocation a vault cannot do without */
+   v->stats = alloc_percpu(struct vault_stats);
+   if (v->stats == NULL) return FALSE;
+
+   /* size new hint indexes for nhints hints, one per bucket */
+   for (v->hbits = HINT_INDEX_BITS; (1 << v->hbits) < nhints; v->hbits++);
+
+   /* seed the hash used by the users' hint indexes */
+   get_random_bytes(&v->hkey, sizeof(v->hkey));
+
+   /* preallocate list heads for the first nusers users */
+   for (i = 0; i < nusers; i++) {
+      struct hpw_list_h *user = user_alloc(v);
+
+      /* if error with allocation, release the pool and return FALSE */
+      if (user == NULL) {
+         finalize_vault(v);
+         return FALSE;
+      }
 
-   /* if error with allocation, return FALSE */
-   if (v->uhpw_data == NULL) return FALSE;
+      list_add(&user->ulist, &v->pool);
+   }
 
-   /* otherwise, set the num_users field accordingly */
-   v->num_users = size;
    return TRUE;
 }
+EXPORT_SYMBOL_GPL(initialize_vault);
+
+/* dump_pair:  walk_vault callback that prints one pair to the kernel log */
+static int dump_pair (struct hpw_list *l, void *arg) {
+   printk(KERN_WARNING "\t[%s %s]\n", pair_hint(l), pair_pwd(l));
+   return 0;
+}
 
 /* dump_vault:  prints the contents of the vault to the kernel log */
 void dump_vault (struct pwd_vault *v, int dir) {
-   struct hpw_list_h *udata = v->uhpw_data;
-   seq_func_ptr       next  = (dir == FORWARD) ? next_hint : prev_hint;
-   int                num   = v->num_users;
-   int                u;
-   
-   /* print the hints for each user */
-   for (u = 0; u < num; u++) {
-      int  uid  = (dir == FORWARD) ? u : num-u-1; /* uid is zero-indexed */
-      int  n    = udata[uid].num_hints;
-
-      /* this user has no hints to print */
-      if (n == 0) continue;
-
-      /* references the hint-pwd pair to be printed */
+   walk_vault(v, dir, dump_pair, NULL);
+}
+
+/* user_first:  returns the first pair in the user's set, or NULL            */
+static struct hpw_list* user_first (struct hpw_list_h *user) {
+   struct hpw_slot *s;
+
+   s = list_first_or_null_rcu(&user->slots, struct hpw_slot, list);
+   if (s == NULL) return NULL;
+
+   return list_first_or_null_rcu(&s->pairs, struct hpw_list, list);
+}
+
+/* user_last:  returns the last pair in the user's set, or NULL; lists are
+ *             only walked backward under the user's lock or cur_lock       */
+static struct hpw_list* user_last (struct hpw_list_h *user) {
+   if (list_empty(&user->slots)) return NULL;
+
+   return list_last_entry(&list_last_entry(&user->slots, struct hpw_slot,
+                                           list)->pairs,
+                          struct hpw_list, list);
+}
+
+/* user_next:  returns the pair after l in the user's set, or NULL; safe
+ *             under rcu_read_lock, even if l has just been deleted         */
+static struct hpw_list* user_next (struct hpw_list_h *user,
+                                   struct hpw_list *l) {
+   struct hpw_slot *s = l->slot;
+   struct hpw_list *n;
+
+   /* return the next hint in the current list, if present */
+   n = list_next_or_null_rcu(&s->pairs, &l->list, struct hpw_list, list);
+   if (n != NULL) return n;
+
+   /* otherwise, return the first hint in the next slot, skipping any slot
+    * that a writer has emptied but not yet unlinked; NULL after the last  */
+   while ((s = list_next_or_null_rcu(&user->slots, &s->list, struct hpw_slot,
+                                     list)) != NULL) {
+      n = list_first_or_null_rcu(&s->pairs, struct hpw_list, list);
+      if (n != NULL) return n;
+   }
+
+   return NULL;
+}
+
+/* user_prev:  returns the pair before l in the user's set, or NULL; for the
+ *             user's lock or cur_lock holders only                         */
+static struct hpw_list* user_prev (struct hpw_list_h *user,
+                                   struct hpw_list *l) {
+   struct hpw_slot *s = l->slot;
+
+   /* return the prev hint in the current list, if present */
+   if (!list_is_first(&l->list, &s->pairs)) return list_prev_entry(l, list);
+
+   /* if this hint is first overall hint for this user, return NULL */
+   if (list_is_first(&s->list, &user->slots)) return NULL;
+
+   /* otherwise, return the last hint in the prev slot */
+   return list_last_entry(&list_prev_entry(s, list)->pairs,
+                          struct hpw_list, list);
+}
+
+/* walk_vault:  calls fn on every pair in FORWARD (or REVERSE) order; returns
+ *              the first non-zero value fn returns, or 0 */
+int  walk_vault (struct pwd_vault *v, int dir,
+                 int (*fn)(struct hpw_list *l, void *arg), void *arg) {
+   struct hpw_list_h *user;
+
+   /* visit the hints for each user, in FORWARD (or REVERSE) kuid order */
+   for (user = (dir == FORWARD) ?
+               list_first_entry(&v->ulist, struct hpw_list_h, ulist) :
+               list_last_entry(&v->ulist, struct hpw_list_h, ulist);
+        &user->ulist != &v->ulist;
+        user = (dir == FORWARD) ? list_next_entry(user, ulist) :
+                                  list_prev_entry(user, ulist)) {
+
+      /* references the hint-pwd pair to be visited */
       struct hpw_list *l;
 
       /* point l at the first (or last) hint in the user's set */
-      if   (dir == FORWARD) l = udata[uid].data[0];
-      else                  l = get_last_in_list(udata[uid].data[n-1]);
+      if   (dir == FORWARD) l = user_first(user);
+      else                  l = user_last(user);
 
-      /* print hints in FORWARD (or REVERSE) order until they are exhausted */
+      /* visit hints in FORWARD (or REVERSE) order until they are exhausted */
       while (l != NULL) {
-         printk(KERN_WARNING "\t[%s %s]\n", l->hpw.hint, l->hpw.pwd);
-         l = next(v, uid+1, l);
+         int rc = fn(l, arg);
+
+         if (rc) return rc;
+         l = (dir == FORWARD) ? user_next(user, l) : user_prev(user, l);
+      }
+   }
+
+   return 0;
+}
+EXPORT_SYMBOL_GPL(walk_vault);
+
+/* cursor_step:  the pair after (or before) l in c's direction, or NULL     */
+static struct hpw_list* cursor_step (struct vault_cursor *c,
+                                     struct hpw_list *l) {
+   return (c->dir == FORWARD) ? user_next(c->user, l) : user_prev(c->user, l);
+}
+
+/* cursor_adjacent:  the user after (or before) user in dir's kuid order, or
+ *                   the first (or last) user if user is NULL; NULL if none */
+static struct hpw_list_h* cursor_adjacent (struct pwd_vault *v, int dir,
+                                           struct hpw_list_h *user) {
+   struct list_head *n;
+
+   xa_lock(&v->users);
+   if (dir == FORWARD) n = (user != NULL) ? user->ulist.next : v->ulist.next;
+   else                n = (user != NULL) ? user->ulist.prev : v->ulist.prev;
+   xa_unlock(&v->users);
+
+   return (n != &v->ulist) ? list_entry(n, struct hpw_list_h, ulist) : NULL;
+}
+
+/* cursor_seek:  points c at the first (or last) pair of user or, if user has
+ *               none, of the first user after it in c's direction who has;
+ *               c holds that user's lock, or is at the end                 */
+static struct hpw_list* cursor_seek (struct pwd_vault *v,
+                                     struct vault_cursor *c,
+                                     struct hpw_list_h *user) {
+   for (; user != NULL; user = cursor_adjacent(v, c->dir, user)) {
+      mutex_lock(&user->lock);
+
+      c->l = (c->dir == FORWARD) ? user_first(user) : user_last(user);
+      if (c->l != NULL) {
+         c->user   = user;
+         c->done   = 0;
+         c->locked = TRUE;
+         return c->l;
+      }
+
+      vault_user_unlock(user);
+   }
+
+   c->user = NULL;
+   c->l    = NULL;
+   return NULL;
+}
+
+/* vault_cursor_init:  points c before the first pair of a walk in dir order */
+void vault_cursor_init (struct vault_cursor *c, int dir) {
+   memset(c, 0, sizeof(*c));
+   c->dir = dir;
+}
+EXPORT_SYMBOL_GPL(vault_cursor_init);
+
+/* vault_cursor_start:  returns the pair at c, with its user's lock held */
+struct hpw_list* vault_cursor_start (struct pwd_vault *v,
+                                     struct vault_cursor *c) {
+   struct hpw_list *l;
+   size_t           k;
+
+   if (!c->started) {
+      c->started = TRUE;
+      return cursor_seek(v, c, cursor_adjacent(v, c->dir, NULL));
+   }
+
+   /* the walk is over */
+   if (c->user == NULL) return NULL;
+
+   mutex_lock(&c->user->lock);
+   c->locked = TRUE;
+
+   /* the pair at the cursor may have been deleted, so count off the pairs
+    * the walk had passed instead; a user who changed may thus have a pair
+    * skipped or repeated, as with any walk that takes no snapshot      */
+   if (c->user->gen != c->gen) {
+      l = (c->dir == FORWARD) ? user_first(c->user) : user_last(c->user);
+      for (k = 0; l != NULL && k < c->done; k++) l = cursor_step(c, l);
+
+      if (l == NULL) {
+         vault_user_unlock(c->user);
+         c->locked = FALSE;
+         return cursor_seek(v, c, cursor_adjacent(v, c->dir, c->user));
       }
+      c->l = l;
    }
+
+   return c->l;
 }
+EXPORT_SYMBOL_GPL(vault_cursor_start);
+
+/* vault_cursor_next:  moves c to the next pair and returns it, or NULL */
+struct hpw_list* vault_cursor_next (struct pwd_vault *v,
+                                    struct vault_cursor *c) {
+   struct hpw_list *l;
+
+   c->pos++;
+   if (c->user == NULL) return NULL;
+
+   c->done++;
+
+   l = cursor_step(c, c->l);
+   if (l != NULL) return c->l = l;
+
+   /* the user's pairs are exhausted, so move on to the next user's */
+   vault_user_unlock(c->user);
+   c->locked = FALSE;
+   return cursor_seek(v, c, cursor_adjacent(v, c->dir, c->user));
+}
+EXPORT_SYMBOL_GPL(vault_cursor_next);
+
+/* vault_cursor_stop:  releases the user's lock, noting the user's gen so a
+ *                     later start can tell whether l is still there      */
+void vault_cursor_stop (struct pwd_vault *v, struct vault_cursor *c) {
+   if (!c->locked) return;
+
+   c->gen    = c->user->gen;
+   c->locked = FALSE;
+   vault_user_unlock(c->user);
+}
+EXPORT_SYMBOL_GPL(vault_cursor_stop);
 
 /* finalize_vault:  releases the allocated memory for the vault */
 void finalize_vault (struct pwd_vault *v) {
+   struct hpw_list_h *user, *next;
+
+   /* the chains of every user are released together, in bulk */
+   struct hpw_batch pairs = { .cache = hpw_list_cache };
+   struct hpw_batch slots = { .cache = hpw_slot_cache };
+
    /* no data allocated, simply return */
-   if (v->uhpw_data == NULL) return;
+   if (v->stats == NULL) return;
 
-   /* release allocations for each user */
-   int i;
-   for (i = 0; i < v->num_users; i++) {
-      
-      /* if memory was allocated to this user, release it */
-      if (v->uhpw_data[i].data != NULL) {
-
-         /* free memory for each chain of linked-list passwords */
-         int n = v->uhpw_data[i].num_hints;
-         int k;
-         for (k = 0; k < n; k++){
-            free_list(v->uhpw_data[i].data[k]);
-         }
+   /* release allocations for each user, and for the unused list heads */
+   list_for_each_entry_safe(user, next, &v->ulist, ulist) {
+      user_free(user, &pairs, &slots);
+   }
+   list_for_each_entry_safe(user, next, &v->pool, ulist) {
+      user_free(user, &pairs, &slots);
+   }
+   batch_flush(&pairs);
+   batch_flush(&slots);
 
-         /* free the allocated memory for user's data */
-         kfree (v->uhpw_data[i].data);
-      }
+   /* empty the map of users */
+   xa_destroy(&v->users);
+   INIT_LIST_HEAD(&v->ulist);
+   INIT_LIST_HEAD(&v->pool);
+   v->num_users = 0;
+
+   free_percpu(v->stats);
+   v->stats = NULL;
+}
+EXPORT_SYMBOL_GPL(finalize_vault);
+
+/* vault_user:  returns the list head of user uid, allocating it if create is
+ *              TRUE and the user has none; NULL if absent or out of memory */
+struct hpw_list_h* vault_user (struct pwd_vault *v, kuid_t uid, int create) {
+   struct hpw_list_h *user = find_user(v, uid);
+   struct hpw_list_h *succ;
+   unsigned long      idx  = __kuid_val(uid);
+   int                err;
+
+   /* the common case: the user exists, found without taking any lock */
+   if (user != NULL || !create) return user;
+
+   /* take a preallocated list head, if one is left */
+   xa_lock(&v->users);
+   user = list_first_entry_or_null(&v->pool, struct hpw_list_h, ulist);
+   if (user != NULL) list_del(&user->ulist);
+   xa_unlock(&v->users);
+
+   if (user == NULL) user = user_alloc(v);
+   if (user == NULL) return NULL;
+
+   user->uid = uid;
+
+   xa_lock(&v->users);
+   err = __xa_insert(&v->users, idx, user, GFP_KERNEL);
+
+   /* keep the users in kuid order, ahead of the next larger kuid */
+   if (err == 0) {
+      succ = (idx < ULONG_MAX) ? xa_find_after(&v->users, &idx, ULONG_MAX,
+                                               XA_PRESENT) : NULL;
+      list_add_tail(&user->ulist, (succ != NULL) ? &succ->ulist : &v->ulist);
+      v->num_users++;
+
+   /* otherwise, return the unused list head to the pool */
+   } else {
+      list_add(&user->ulist, &v->pool);
    }
+   xa_unlock(&v->users);
+
+   /* another thread may have inserted the same user first */
+   if (err == -EBUSY) return find_user(v, uid);
+
+   return (err == 0) ? user : NULL;
+}
+
+/* vault_user_unlock:  releases the user's lock, waking anyone polling for
+ *                     a write that would take it without waiting; every
+ *                     holder of the lock releases it here               */
+void vault_user_unlock (struct hpw_list_h *user) {
+   mutex_unlock(&user->lock);
 
-   /* free the array of user data */
-   kfree (v->uhpw_data);
+   if (wq_has_sleeper(&user->wait))
+      wake_up_interruptible_poll(&user->wait, EPOLLOUT | EPOLLWRNORM);
 }
+EXPORT_SYMBOL_GPL(vault_user_unlock);
 
-/* num_hints:  how many unique hints inserted by this; user uid 1-indexed */
-int num_hints (struct pwd_vault *v, int uid) {
-   if (uid < 1 || uid > v->num_users) return -1;
-   
-   return v->uhpw_data[uid-1].num_hints;
+/* num_hints:  how many unique hints inserted by this user */
+int num_hints (struct pwd_vault *v, kuid_t uid) {
+   struct hpw_list_h *user = find_user(v, uid);
+
+   return (user != NULL) ? user->num_hints : 0;
 }
 
 /* rem_hints:  how many additional unique hints may yet be inserted by user */
-/* uid 1-indexed */
-int rem_hints (struct pwd_vault *v, int uid) {
-   if (uid < 1 || uid > v->num_users) return -1;
-   
-   return MAX_HINT_USER - v->uhpw_data[uid-1].num_hints;
+int rem_hints (struct pwd_vault *v, kuid_t uid) {
+   return INT_MAX - num_hints(v, uid);
 }
 
 /* num_pairs(int):  how many total hint-pwd pairs have been inserted by user */
-/* uid 1-indexed */
-int num_pairs (struct pwd_vault *v, int uid) {
-   if (uid < 1 || uid > v->num_users) return -1;
-   
-   return v->uhpw_data[uid-1].total_hpw_pairs;
+int num_pairs (struct pwd_vault *v, kuid_t uid) {
+   struct hpw_list_h *user = find_user(v, uid);
+
+   return (user != NULL) ? user->total_hpw_pairs : 0;
 }
 
-/* num_vhints(void):  how many unique hints have been inserted into vault */
-int num_vhints (struct pwd_vault *v) {
-   int sum = 0, uid;
-   for (uid = 0; uid < v->num_users; uid++) {
-      sum += num_hints(v, uid+1);
-   }
-   return sum;
+/* num_bytes:  how many bytes the user's pairs are charged against the quota */
+size_t num_bytes (struct pwd_vault *v, kuid_t uid) {
+   struct hpw_list_h *user = find_user(v, uid);
+
+   return (user != NULL) ? READ_ONCE(user->bytes) : 0;
 }
+EXPORT_SYMBOL_GPL(num_bytes);
 
-/* num_vpairs(void):  how many hint-pwd pairs have been inserted into vault */
-int num_vpairs (struct pwd_vault *v) {
-   int sum = 0, uid;
-   for (uid = 0; uid < v->num_users; uid++) {
-      sum += num_pairs(v, uid+1);
+/* vault_stats:  sums the vault's per-CPU counters into sum; the sums of a
+ *                vault being changed may be off by the changes in flight  */
+void vault_stats (struct pwd_vault *v, struct vault_stats *sum) {
+   int cpu;
+
+   memset(sum, 0, sizeof(*sum));
+
+   for_each_possible_cpu(cpu) {
+      struct vault_stats *c = per_cpu_ptr(v->stats, cpu);
+
+      sum->inserts += READ_ONCE(c->inserts);
+      sum->deletes += READ_ONCE(c->deletes);
+      sum->lookups += READ_ONCE(c->lookups);
+      sum->misses  += READ_ONCE(c->misses);
+      sum->hints   += READ_ONCE(c->hints);
+      sum->pairs   += READ_ONCE(c->pairs);
+      sum->bytes   += READ_ONCE(c->bytes);
    }
-   return sum;
 }
+EXPORT_SYMBOL_GPL(vault_stats);
 
-/* insert_pair: inserts hint-pwd pair for given uid (one-indexed) into vault */
-int  insert_pair (struct pwd_vault *v, int uid, char *hint, char *pwd) {
+/* num_vhints(void):  how many unique hints have been inserted into vault */
+int num_vhints (struct pwd_vault *v) {
+   struct vault_stats sum;
 
-#ifdef DEBUG
-   printk(KERN_WARNING "insert_pair: v is %x\n", v);
-#endif
+   vault_stats(v, &sum);
+   return sum.hints;
+}
 
-   /* hint-pwd pairs not kept for this uid, return FALSE */
-   if (uid < 1 || uid > v->num_users) return FALSE;
+/* num_vpairs(void):  how many hint-pwd pairs have been inserted into vault */
+int num_vpairs (struct pwd_vault *v) {
+   struct vault_stats sum;
 
-#ifdef DEBUG
-   printk(KERN_WARNING "insert_pair: v->users is %x\n", v->num_users);
-   printk(KERN_WARNING "insert_pair: v->uhpw_data is %x\n", v->uhpw_data);
-#endif
+   vault_stats(v, &sum);
+   return sum.pairs;
+}
 
-   /* locate the given user's hint data */
-   struct hpw_list_h *user = &v->uhpw_data[uid-1];
+/* over_quota:  TRUE if pairs more pairs, taking bytes more bytes, would put
+ *              user over one of the vault's quotas                         */
+static int over_quota (struct pwd_vault *v, struct hpw_list_h *user,
+                       size_t pairs, size_t bytes) {
+   return (v->max_pairs != 0 &&
+           user->total_hpw_pairs + pairs > (size_t) v->max_pairs) ||
+          (v->max_bytes != 0 && user->bytes + bytes > v->max_bytes);
+}
 
-#ifdef DEBUG
-   printk(KERN_WARNING "insert_pair: user->num_hints is %d\n", user->num_hints);
-#endif
+/* add_pair:  inserts hint-pwd pair for given uid into vault; returns 0,
+ *            -ENOSPC if the user's quotas leave no room, or -ENOMEM        */
+int  add_pair (struct pwd_vault *v, kuid_t uid, char *hint, char *pwd) {
+   size_t hlen = strnlen(hint, MAX_HINT_SIZE);
+   size_t need = pwd_size(strnlen(pwd, MAX_PWD_SIZE));
+   size_t cost;
 
-   /* if first hint for this user, then we need to allocate memory */
-   if (user->data == NULL) {
 #ifdef DEBUG
-      printk(KERN_WARNING "insert_pair: first hint for user %d\n", uid);
-      printk(KERN_WARNING "insert_pair: allocating %d hints for user\n", 
-                           MAX_HINT_USER);
+   printk(KERN_WARNING "add_pair: v is %p\n", v);
 #endif
 
-      user->data = kmalloc(MAX_HINT_USER*sizeof(struct hpw_list*), GFP_KERNEL);
-
-      /* if allocation fails, then return false */
-      if (user->data == NULL) {
-#ifdef DEBUG
-         printk(KERN_WARNING "insert_pair: allocation failed\n");
-#endif
-         return FALSE;
-      }
-      memset(user->data, 0, MAX_HINT_USER*sizeof(struct hpw_list*));
+   /* locate the given user's hint data, allocating it on the first insert */
+   struct hpw_list_h *user = vault_user(v, uid, TRUE);
 
+   /* if allocation fails, then report it */
+   if (user == NULL) {
 #ifdef DEBUG
-      printk(KERN_WARNING "insert_pair: allocations succeeded\n");
+      printk(KERN_WARNING "add_pair: allocation failed\n");
 #endif
+      return -ENOMEM;
    }
-   
-   /* scan this user's hints for duplicates */
-   struct hpw_list **la = user->data;
-   int i;
-   for (i = 0; i < user->num_hints; i++) {
-      /* duplicate hint found, exit loop */
+
 #ifdef DEBUG
-      printk(KERN_WARNING "insert_pair: searching duplicate among hint %d\n",i);
+   printk(KERN_WARNING "add_pair: user->num_hints is %d\n", user->num_hints);
 #endif
-      if (strncmp(la[i]->hpw.hint, hint, MAX_HINT_SIZE) == 0) break;
-   }
 
-   /* no more new hints permitted for this user, return FALSE */
-   if (i == MAX_HINT_USER) return FALSE;
+   /* look up duplicates in this user's hint index */
+   struct hpw_slot *s = index_lookup(v, user, hint);
 
 #ifdef DEBUG
-   if (i < user->num_hints) {
-      printk(KERN_WARNING "insert_pair: hint %s is duplicate of hint %d\n",
-             hint, i);
+   if (s != NULL) {
+      printk(KERN_WARNING "add_pair: hint %s is duplicate of hint %d\n",
+             hint, slot_ord(user, s));
    } else {
-      printk(KERN_WARNING "insert_pair: hint %s unique among stored hints\n",
+      printk(KERN_WARNING "add_pair: hint %s unique among stored hints\n",
              hint);
    }
-
-   printk(KERN_WARNING "insert_pair: la[i] for i = %d is %x\n", i, la[i]);
 #endif
 
-   int rc = insert_in_list(&la[i], hint, pwd);
+   /* a new hint takes a record of its own; the quotas are checked against
+    * the user's running totals                                          */
+   if (s == NULL) need += rec_size(hlen);
+   cost = PAIR_BYTES + need + ((s == NULL) ? HINT_BYTES : 0);
+   if (over_quota(v, user, 1, cost)) return -ENOSPC;
+
+   /* a new hint needs a new slot at the end of the user's list */
+   if (s == NULL) {
 
-   /* hint was successfully inserted */
-   if (rc) {
-      user->total_hpw_pairs++;
+      /* keep the index at no more than one hint per bucket */
+      if (user->num_hints >= (1 << index_of(user)->bits) &&
+          !index_resize(v, user, index_of(user)->bits + 1)) return -ENOMEM;
 
-      /* inserted hint was a new (non-duplicate) hint */
-      if (i == user->num_hints) user->num_hints++;
+      /* and find the slot a position in the order index */
+      if (!order_reserve(user, 1)) return -ENOMEM;
+
+      /* the slot's trie node is allocated up front, so nothing can fail
+       * once the slot is published                                      */
+      struct hpw_crit *c = kmem_cache_alloc(hpw_crit_cache, GFP_KERNEL);
+      if (c == NULL) return -ENOMEM;
+
+      s = kmem_cache_alloc(hpw_slot_cache, GFP_KERNEL);
+      if (s == NULL) {
+         kmem_cache_free(hpw_crit_cache, c);
+         return -ENOMEM;
+      }
 
+      /* the arena must not move between the hint and the pwd going in,
+       * since it is copied from the user's list, which lacks the slot  */
+      if (!arena_reserve(user, need)) {
+         kmem_cache_free(hpw_slot_cache, s);
+         kmem_cache_free(hpw_crit_cache, c);
+         return -ENOMEM;
+      }
+
+      rec_fill(user->arena, &s->hint, hint, hlen);
+      INIT_LIST_HEAD(&s->pairs);
+      s->pos    = 0;
+      s->npairs = 0;
+
+      /* a slot is indexed only once its list holds a pair */
+      if (!insert_in_list(user, s, pwd)) {
+         arena_drop(user, s->hint);
+         kmem_cache_free(hpw_slot_cache, s);
+         kmem_cache_free(hpw_crit_cache, c);
+         return -ENOMEM;
+      }
+
+      /* the slot is complete, so publish it to readers */
+      trie_insert(user, s, c);
+      list_add_tail_rcu(&s->list, &user->slots);
+      hlist_add_head_rcu(&s->hnode, index_bucket(index_of(user),
+                                                 hint_hash(v, hint)));
+      user->num_hints++;
+      this_cpu_inc(v->stats->hints);
+
+   /* otherwise, add the pwd to the end of the hint's list */
+   } else if (!insert_in_list(user, s, pwd)) {
 #ifdef DEBUG
-      printk(KERN_WARNING "insert_pair: success (%d, %d)\n", 
-                           user->num_hints, user->total_hpw_pairs);
-   /* or not */
-   } else {
-      printk(KERN_WARNING "insert_pair: %s %s failure\n", hint, pwd);
+      printk(KERN_WARNING "add_pair: %s %s failure\n", hint, pwd);
 #endif
+      return -ENOMEM;
    }
 
-   return rc;
+   /* count the pair where cursor holders look positions up */
+   spin_lock(&user->cur_lock);
+   order_count(user, s, 1);
+   spin_unlock(&user->cur_lock);
+
+   user->total_hpw_pairs++;
+   user->bytes += cost;
+   WRITE_ONCE(user->gen, user->gen + 1);
+   this_cpu_inc(v->stats->inserts);
+   this_cpu_inc(v->stats->pairs);
+   this_cpu_add(v->stats->bytes, cost);
+   if (v->note != NULL) v->note(v, VAULT_INSERT, uid, hint, pwd);
+
+#ifdef DEBUG
+   printk(KERN_WARNING "add_pair: success (%d, %d)\n",
+                        user->num_hints, user->total_hpw_pairs);
+#endif
+
+   return 0;
 }
+EXPORT_SYMBOL_GPL(add_pair);
 
-/* delete_pair: deletes hint-pwd pair for given uid (one-indexed) from vault */
-void delete_pair (struct pwd_vault *v, int uid, char *hint, char *pwd) {
+/* insert_pair: inserts hint-pwd pair for given uid into vault */
+int  insert_pair (struct pwd_vault *v, kuid_t uid, char *hint, char *pwd) {
+   return add_pair(v, uid, hint, pwd) == 0;
+}
+EXPORT_SYMBOL_GPL(insert_pair);
+
+/* delete_pair: deletes hint-pwd pair for given uid from vault */
+void delete_pair (struct pwd_vault *v, kuid_t uid, char *hint, char *pwd) {
 
    /* find the hint to delete */
    struct hpw_list *l = find_hint_pwd(v, uid, hint, pwd);
 
 #ifdef DEBUG
-   printk(KERN_WARNING "delete_pair:  deleting hint at position %x\n", l);
+   printk(KERN_WARNING "delete_pair:  deleting hint at position %p\n", l);
 #endif
 
    /* hint-pwd pair is not present */
    if (l == NULL) return;
 
-   /* determine if the hint is at the head of a list */
-   int i;
-   int num_hints = v->uhpw_data[uid-1].num_hints;
-   for (i = 0; i < num_hints; i++) {
-      if (v->uhpw_data[uid-1].data[i] == l) break;
-   }
-
-   /* test for head of list with only one element */
-   int only_element_in_list = FALSE;
-   int head_of_list = FALSE;
-   if (i < num_hints) {
-      head_of_list = TRUE;
+   delete_pair_at(v, uid, l);
+}
 
-#ifdef DEBUG
-      printk(KERN_WARNING "delete_pair:  the hint is a head of list\n");
-#endif
-      
-      only_element_in_list = (int) (l->next == NULL);
+/* delete_pair_at:  deletes pair l, which the caller already holds, from
+ *                  uid's set without searching the vault for it          */
+void delete_pair_at (struct pwd_vault *v, kuid_t uid, struct hpw_list *l) {
+
+   struct hpw_list_h *user = find_user(v, uid);
+   struct hpw_slot   *s    = l->slot;
+   char              *hint = slot_hint(s);
+   struct hpw_cursor *c;
+   size_t             cost = PAIR_BYTES;
+   int                retire;
+
+   if (!pwd_inline(l)) cost += rec_of(l->pwd)->size;
+
+   /* the strings noted are the pair's own, so the change is noted while
+    * the pair is still whole                                           */
+   if (v->note != NULL) v->note(v, VAULT_DELETE, uid, hint, pair_pwd(l));
+
+   /* unlink under cur_lock, so that no cursor is left on the pair, nor
+    * remembers it as the pair last read                               */
+   spin_lock(&user->cur_lock);
+   list_for_each_entry(c, &user->cursors, link) {
+      if (c->fp == l)   c->fp   = user_next(user, l);
+      if (c->last == l) c->last = NULL;
    }
 
+   delete_from_list(user, l);
+   order_count(user, s, -1);
 
-   /* point the head pointer to the next element (could be NULL) */
-   if (head_of_list) {
-      v->uhpw_data[uid-1].data[i] = l->next;
+   /* the deleted pair was the last for its hint, so retire the slot */
+   retire = list_empty(&s->pairs);
+   if (retire) {
 
 #ifdef DEBUG
-      printk(KERN_WARNING "delete_pair:  resetting head from %x to %x\n", 
-         l, v->uhpw_data[uid-1].data[i]);
+      printk(KERN_WARNING "delete_pair:  retiring slot of hint %s\n", hint);
 #endif
-   }
 
-   /* the hint-pwd pair about to be deleted is the last in its list */
-   if (only_element_in_list) {
-      struct hpw_list **la = v->uhpw_data[uid-1].data;
-
-      printk(KERN_WARNING "delete_pair:  compacting to avoid holes\n");
+      /* the positions of the hints after it drop without renumbering */
+      order_retire(user, s);
+      hlist_del_rcu(&s->hnode);
+      list_del_rcu(&s->list);
+      trie_delete(user, s, hint);
+   }
+   spin_unlock(&user->cur_lock);
+
+   /* readers may still be on the slot, so free it after they are done */
+   if (retire) {
+      cost += HINT_BYTES + rec_of(s->hint)->size;
+      arena_drop(user, s->hint);
+      call_rcu(&s->rcu, slot_free_rcu);
+      user->num_hints--;
+      this_cpu_dec(v->stats->hints);
+   }
 
-      /* to avoid holes among list pointers, compact the list head pointers */
-      int j;
-      for (j = i; j < num_hints-1; j++) {
+   /* reduce the total number for this uid and reclaim dead strings */
+   user->total_hpw_pairs--;
+   user->bytes -= cost;
+   WRITE_ONCE(user->gen, user->gen + 1);
+   this_cpu_inc(v->stats->deletes);
+   this_cpu_dec(v->stats->pairs);
+   this_cpu_sub(v->stats->bytes, cost);
+   arena_compact(user);
 
 #ifdef DEBUG
-         printk(KERN_WARNING "delete_pair: la[%d](%x) replaced by la[%d](%x)\n",
-                              j, la[j], j+1, la[j+1]);
+   printk(KERN_WARNING "delete_pair:  hints reduced (%d, %d)\n",
+                        user->num_hints, user->total_hpw_pairs);
 #endif
-         la[j] = la[j+1];
+}
+EXPORT_SYMBOL_GPL(delete_pair_at);
 
-      }
-      v->uhpw_data[uid-1].num_hints--;
+/* hint_pairs:  returns the user's first pair with hint, or NULL; unlike
+ *              find_hint it does not count the hint's position, which costs
+ *              a walk of the user's order index                           */
+static struct hpw_list* hint_pairs (struct pwd_vault *v,
+                                    struct hpw_list_h *user, char *hint) {
+   struct hpw_slot *s;
 
-      /* NULL-terminate what was the head pointer to the last list */
-      v->uhpw_data[uid-1].data[num_hints-1] = NULL;
+   this_cpu_inc(v->stats->lookups);
 
-#ifdef DEBUG
-      printk(KERN_WARNING "delete_pair:  NULL-terminating list la[%d]\n",
-                           num_hints-1);
-#endif
-   }
+   /* no hint-pwd pairs kept for this uid, return NULL */
+   if (user == NULL) goto miss;
 
-   delete_from_list(&l);
+   /* look up the hint in the given user's hint index */
+   s = index_lookup(v, user, hint);
+   if (s == NULL) goto miss;
 
-   /* reduce the total number for this uid */
-   v->uhpw_data[uid-1].total_hpw_pairs--;
+   /* a writer may have emptied the slot since it was found */
+   return list_first_or_null_rcu(&s->pairs, struct hpw_list, list);
 
-#ifdef DEBUG
-   printk(KERN_WARNING "delete_pair:  hints reduced (%d, %d)\n",
-                        v->uhpw_data[uid-1].num_hints,
-                        v->uhpw_data[uid-1].total_hpw_pairs);
-#endif
+ miss:
+   this_cpu_inc(v->stats->misses);
+   return NULL;
 }
 
-/* retrieve_pwd:  retrieves pwd(s) for hint for given uid (one-indexed) */
-int  retrieve_pwd (struct pwd_vault *v, int uid, char *hint, 
-                   char pwd[MAX_HINT_USER][MAX_PWD_SIZE]) {
-   
-   /* required parameter for find_hint, but not used in this function */
-   int hint_num;
+/* retrieve_pwd:  retrieves up to max pwd(s) for hint for given uid */
+int  retrieve_pwd (struct pwd_vault *v, kuid_t uid, char *hint,
+                   char pwd[][MAX_PWD_SIZE], int max) {
+
+   int cnt = 0;
+
+   /* writers may run alongside, but nothing read is freed until unlock */
+   rcu_read_lock();
 
    /* get pointer to hint-pwd pair in vault */
-   struct hpw_list *l = find_hint(v, uid, hint, &hint_num);
+   struct hpw_list *l = hint_pairs(v, find_user(v, uid), hint);
 
-   /* if l is NULL, then the hint is not present */
-   if (l == NULL) return 0;
+   /* if l is not NULL, hint was found, so retrive cnt associated pwd(s) */
+   if (l != NULL) {
+      struct hpw_slot *s = l->slot;
 
-   /* otherwise, hint was found, retrive cnt associated pwd(s) */
-   int cnt = 0;
-   while (l != NULL) {
-      strncpy(pwd[cnt], l->hpw.pwd, MAX_PWD_SIZE);
-      cnt++;
-      l = l->next;
+      list_for_each_entry_from_rcu(l, &s->pairs, list) {
+         if (cnt == max) break;
+         strncpy(pwd[cnt], pair_pwd(l), MAX_PWD_SIZE);
+         cnt++;
+      }
    }
 
+   rcu_read_unlock();
    return cnt;
 }
 
 /* find_hint:  finds the specified hint in the vault and returns a pointer to
  *            it, or returns NULL if the hint is not present; also sets
- *            hint_num to the sequential location of the hint in the vault 
- *            Note, uid is one-indexed.
+ *            hint_num to the sequential location of the hint in the vault
  */
-struct hpw_list* find_hint (struct pwd_vault *v, int uid, char *hint, 
+struct hpw_list* find_hint (struct pwd_vault *v, kuid_t uid, char *hint,
                           int *hint_num) {
 
    /* assume searched hint is not the last in the user's set */
    *hint_num = 0;
 
-   /* hint-pwd pairs not kept for this uid, return NULL */
-   if (uid < 1 || uid > v->num_users) return NULL;
-
-   /* locate the given user's hint data */
-   struct hpw_list_h *user = &v->uhpw_data[uid-1];
-   
-   /* scan this user's hints for match */
-   struct hpw_list **la = user->data;
-   int i;
-   for (i = 0; i < user->num_hints; i++) {
-      /* hint found, exit loop */
-      if (strncmp(la[i]->hpw.hint, hint, MAX_HINT_SIZE) == 0) break;
-   }
+   struct hpw_list_h *user = find_user(v, uid);
+   struct hpw_list   *l    = hint_pairs(v, user, hint);
 
    /* if hint not found, return NULL */
-   if (i == user->num_hints) return NULL;
+   if (l == NULL) return NULL;
 
-   /* otherwise, set hint_num and return l as the pointer to the hpw_list */
-   *hint_num = i;
-   return la[i];
+   /* otherwise, set hint_num and return the first pair in the slot's list */
+   *hint_num = slot_ord(user, l->slot);
+   return l;
 }
 
 /* find_hint_pwd: finds the specified hint-pwd pair and returns a pointer to
- *                it, or returns NULL if the pair is not present. uid 1-index */
-struct hpw_list*  find_hint_pwd (struct pwd_vault *v, int uid, char *hint, 
+ *                it, or returns NULL if the pair is not present. */
+struct hpw_list*  find_hint_pwd (struct pwd_vault *v, kuid_t uid, char *hint,
                                  char  *pwd) {
 
-   int hint_num;  /* unused */
-
    /* find the appropriate list of hints (if present) */
-   struct hpw_list *l = find_hint(v, uid, hint, &hint_num);
+   struct hpw_list *l = hint_pairs(v, find_user(v, uid), hint);
 
    /* if there is such a hint list, now search for the selected pwd */
    if (l != NULL) {
+      struct hpw_slot *s = l->slot;
 
-      /* loop while we have pwd to check and have not yet found the pwd */ 
-      while (l != NULL && (strncmp(l->hpw.pwd, pwd, MAX_PWD_SIZE) != 0)) {
-         l = l->next;
+      /* loop while we have pwd to check and have not yet found the pwd */
+      list_for_each_entry_from_rcu(l, &s->pairs, list) {
+         if (strncmp(pair_pwd(l), pwd, MAX_PWD_SIZE) == 0) return l;
       }
    }
 
-   /* return the outcome:  either NULL (not present) or pointer to the pair */
-   return l;
+   /* the pair is not present */
+   return NULL;
+}
+
+/* first_hint:  returns a pointer to the first hint in the user's set, or NULL
+ *              if the user has no hints.
+ */
+struct hpw_list* first_hint (struct pwd_vault *v, kuid_t uid) {
+   struct hpw_list_h *user = find_user(v, uid);
+
+   return (user != NULL) ? user_first(user) : NULL;
+}
+
+/* last_hint:  returns a pointer to the last hint in the user's set, or NULL
+ *             if the user has no hints.
+ */
+struct hpw_list* last_hint (struct pwd_vault *v, kuid_t uid) {
+   struct hpw_list_h *user = find_user(v, uid);
+
+   return (user != NULL) ? user_last(user) : NULL;
 }
 
 /* next_hint:  returns a pointer to the next hint in the current user's set,
- *            or NULL if there is no next hint.  uid is one-indexed.
+ *            or NULL if there is no next hint.
  */
-struct hpw_list* next_hint (struct pwd_vault *v, int uid, struct hpw_list *l) {
+struct hpw_list* next_hint (struct pwd_vault *v, kuid_t uid,
+                            struct hpw_list *l) {
+   struct hpw_list_h *user;
 
    /* return NULL, if l is NULL*/
    if (l == NULL) return NULL;
 
-   /* return the next hint in the current list, if present */
-   if (l->next != NULL) return l->next;
+   user = find_user(v, uid);
+   return (user != NULL) ? user_next(user, l) : NULL;
+}
+EXPORT_SYMBOL_GPL(next_hint);
 
-   /* otherwise, find the first (perhaps ony) hint of this list */
-   int hint_num;
-   l = find_hint(v, uid, l->hpw.hint, &hint_num);
+/* prev_hint:  returns a pointer to the prev hint in the current user's set,
+ *            or NULL if there is no prev hint.
+ */
+struct hpw_list* prev_hint (struct pwd_vault *v, kuid_t uid,
+                            struct hpw_list *l) {
+   struct hpw_list_h *user;
 
-   /* if this hint is last in the array of hints for this user, return NULL */
-   if (uid < 1 || uid > v->num_users || 
-       hint_num == v->uhpw_data[uid-1].num_hints-1) return NULL;
+   /* return NULL, if l is NULL*/
+   if (l == NULL) return NULL;
 
-   /* otherwise, return the next hint in the array */
-   return v->uhpw_data[uid-1].data[hint_num+1];
+   user = find_user(v, uid);
+   return (user != NULL) ? user_prev(user, l) : NULL;
 }
+EXPORT_SYMBOL_GPL(prev_hint);
 
-/* prev_hint:  returns a pointer to the prev hint in the current user's set,
- *            or NULL if there is no prev hint.  uid is one-indexed.
+/* nth_pair:  returns the pair at position n of the user's set, counting
+ *            from 0 in the order next_hint walks, or NULL if there are no
+ *            more than n pairs; the hint is found in O(log n), and then
+ *            its pairs are walked.  Exact for a caller holding the user's
+ *            lock or cur_lock, otherwise under rcu_read_lock.
  */
-struct hpw_list* prev_hint (struct pwd_vault *v, int uid, struct hpw_list *l) {
+struct hpw_list* nth_pair (struct pwd_vault *v, kuid_t uid, long n) {
+   struct hpw_list_h *user = find_user(v, uid);
+   struct hpw_order  *o;
+   struct hpw_slot   *s;
+   struct hpw_list   *l;
+   unsigned int       p;
+   int                k;
+
+   if (user == NULL || n < 0 || n > INT_MAX) return NULL;
+
+   o = order_of(user);
+   if (o == NULL) return NULL;
+
+   /* the slot at the position after the last whose pairs are at most n */
+   k = n;
+   p = fen_find(o->pairs, o->size, &k) + 1;
+   if (p > READ_ONCE(o->used)) return NULL;
+
+   s = READ_ONCE(o->slot[p]);
+   if (s == NULL) return NULL;
+
+   list_for_each_entry_rcu(l, &s->pairs, list,
+                           lockdep_is_held(&user->cur_lock)) {
+      if (k-- == 0) return l;
+   }
 
-   /* return the prev hint in the current list, if present */
-   if (l->prev != NULL) return l->prev;
+   return NULL;
+}
+EXPORT_SYMBOL_GPL(nth_pair);
+
+/* pair_pos:  returns the position of pair l in the user's set, as nth_pair
+ *            counts them, or the number of the user's pairs if l is NULL;
+ *            the pairs ahead of l's hint are counted in O(log n)         */
+long pair_pos (struct pwd_vault *v, kuid_t uid, struct hpw_list *l) {
+   struct hpw_list_h *user = find_user(v, uid);
+   struct hpw_order  *o;
+   struct hpw_slot   *s;
+   struct hpw_list   *t;
+   long               n;
+
+   if (user == NULL) return 0;
+
+   o = order_of(user);
+   if (o == NULL) return 0;
+   if (l == NULL) return fen_sum(o->pairs, o->size, o->size);
+
+   s = l->slot;
+   n = fen_sum(o->pairs, o->size, READ_ONCE(s->pos) - 1);
+
+   list_for_each_entry_rcu(t, &s->pairs, list,
+                           lockdep_is_held(&user->cur_lock)) {
+      if (t == l) break;
+      n++;
+   }
 
-   /* if this hint is first overall hint for this user, return NULL */
-   if (uid < 1 || uid > v->num_users || 
-       l==v->uhpw_data[uid-1].data[0]) return NULL;
+   return n;
+}
+EXPORT_SYMBOL_GPL(pair_pos);
+
+/* trie_after:  returns the first subtree under top whose hints all follow
+ *              key, a hint top holds, in hint order; NULL if none do.  The
+ *              caller holds rcu_read_lock.                                 */
+static void* trie_after (void *top, const char *key) {
+   size_t  len  = strlen(key);
+   void   *next = NULL;
+   void   *p    = top;
+
+   while (p != NULL && trie_is_node(p)) {
+      struct hpw_crit *q   = trie_node(p);
+      int              dir = trie_dir(q, key, len);
+
+      if (dir == 0) next = rcu_dereference(q->child[1]);
+      p = rcu_dereference(q->child[dir]);
+   }
 
-   /* otherwise, find first (perhaps ony) hint of list */
-   int num_hint;
-   l = find_hint(v, uid, l->hpw.hint, &num_hint);
+   return next;
+}
 
-   /* otherwise, return the last hint in the prev list */
-   l = get_last_in_list(v->uhpw_data[uid-1].data[num_hint-1]);
+/* prefix_walk:  calls fn on every pair whose hint starts with prefix, in hint
+ *               order; only the subtree of the trie holding the matches is
+ *               visited, so the cost follows the number of matches        */
+int  prefix_walk (struct pwd_vault *v, kuid_t uid, char *prefix,
+                  int (*fn)(struct hpw_list *l, void *arg), void *arg) {
+   struct hpw_list_h *user = find_user(v, uid);
+   size_t             len  = strnlen(prefix, MAX_HINT_SIZE);
+   void              *stack[HPW_WALK_DEPTH];
+   struct hpw_slot   *last = NULL;
+   void              *p, *top;
+   const char        *key;
+   int                sp = 0, rc = 0, dropped = FALSE;
+
+   if (user == NULL) return 0;
+
+   rcu_read_lock();
+
+   /* follow prefix down; below its last byte, any child leads to a match */
+   p = top = rcu_dereference(user->trie);
+   while (p != NULL && trie_is_node(p)) {
+      struct hpw_crit *q = trie_node(p);
+
+      p = rcu_dereference(q->child[trie_dir(q, prefix, len)]);
+      if (q->byte < len) top = p;
+   }
 
-   return l;
+   /* if the nearest hint lacks the prefix, so does every hint */
+   key = (p != NULL) ? slot_hint(p) : NULL;
+   if (key != NULL && strncmp(key, prefix, len) == 0) stack[sp++] = top;
+
+   /* visit the matching slots in order, with each one's pairs in order;
+    * the stack holds the subtrees not yet visited, deepest last
+    */
+   while (rc == 0) {
+      if (sp > 0) {
+         p = stack[--sp];
+      } else {
+         /* the subtrees dropped all follow the last slot visited */
+         if (!dropped || last == NULL) break;
+         p = trie_after(top, slot_hint(last));
+         if (p == NULL) break;
+      }
+
+      if (trie_is_node(p)) {
+         struct hpw_crit *q = trie_node(p);
+
+         /* with no room, the subtree to be visited last is dropped */
+         if (sp + 2 > HPW_WALK_DEPTH) {
+            memmove(stack, stack + 1, --sp * sizeof(void *));
+            dropped = TRUE;
+         }
+         stack[sp++] = rcu_dereference(q->child[1]);
+         stack[sp++] = rcu_dereference(q->child[0]);
+      } else {
+         struct hpw_slot *s = p;
+         struct hpw_list *l;
+
+         list_for_each_entry_rcu(l, &s->pairs, list) {
+            rc = fn(l, arg);
+            if (rc) break;
+         }
+         last = s;
+      }
+   }
+
+   rcu_read_unlock();
+
+   return rc;
+}
+EXPORT_SYMBOL_GPL(prefix_walk);
+
+/* a cursor over a vault image; a save past the end of buf only counts bytes,
+ * and a load past the end fails                                           */
+struct img_cursor {
+   char       *buf;
+   size_t      size;
+   size_t      off;
+};
+
+/* img_put:  appends n bytes from src to the image, if they fit             */
+static void img_put (struct img_cursor *c, const void *src, size_t n) {
+   if (c->buf != NULL && c->off + n <= c->size) memcpy(c->buf + c->off, src, n);
+   c->off += n;
 }
 
-/* get_last_in_list:  walks given list to last element and returns its ref */
-struct hpw_list*   get_last_in_list (struct hpw_list *l) { 
+/* img_get:  returns the next n bytes of the image, or NULL past its end    */
+static const char* img_get (struct img_cursor *c, size_t n) {
+   const char *p = c->buf + c->off;
 
-   /* return NULL if there is no list */
-   if (l == NULL) return NULL;
+   if (n > c->size - c->off) return NULL;
 
-   /* otherwise, walk list to end, returning a reference to the last item */
-   while (l->next != NULL) l = l->next; 
-   return l; 
+   c->off += n;
+   return p;
 }
 
-/* free_list:  releases any allocated memory in tail of incoming list */
-void free_list(struct hpw_list *l) {
+/* img_u32:  reads the next u32 of the image into x; FALSE past its end     */
+static int img_u32 (struct img_cursor *c, u32 *x) {
+   const char *p = img_get(c, sizeof(*x));
 
-   /* while there are list elements to release */
-   while (l != NULL) {
+   if (p != NULL) memcpy(x, p, sizeof(*x));
+   return p != NULL;
+}
+
+/* img_str:  reads the next length-prefixed string of the image, of 1 to max
+ *           bytes (0 to max if empty is TRUE) holding no NUL; FALSE if bad */
+static int img_str (struct img_cursor *c, size_t max, int empty,
+                    const char **str, size_t *len) {
+   const char *p = img_get(c, 1);
 
-      /* retain the tail of the list */
-      struct hpw_list *tail = l->next;
+   if (p == NULL) return FALSE;
 
-      /* release the current list element */
-      kfree (l);
+   *len = (u8) *p;
+   *str = img_get(c, *len);
+
+   return *str != NULL && *len <= max && (empty || *len > 0) &&
+          memchr(*str, '\0', *len) == NULL;
+}
 
-      /* reset the head of the list */
-      l = tail;
+/* save_user:  appends the user's pairs to the image, holding the user's
+ *             lock, so that each user is saved as of one moment            */
+static void save_user (struct img_cursor *c, struct hpw_list_h *user) {
+   struct vault_image_user iu;
+   struct hpw_slot        *s;
+   struct hpw_list        *l;
+   u8                      len;
+   u32                     n;
+
+   mutex_lock(&user->lock);
+
+   iu.uid    = __kuid_val(user->uid);
+   iu.nhints = user->num_hints;
+   iu.npairs = user->total_hpw_pairs;
+   img_put(c, &iu, sizeof(iu));
+
+   list_for_each_entry(s, &user->slots, list) {
+      len = strlen(slot_hint(s));
+      img_put(c, &len, 1);
+      img_put(c, slot_hint(s), len);
+
+      n = 0;
+      list_for_each_entry(l, &s->pairs, list) n++;
+      img_put(c, &n, sizeof(n));
+
+      list_for_each_entry(l, &s->pairs, list) {
+         len = strlen(l->pwd);
+         img_put(c, &len, 1);
+         img_put(c, l->pwd, len);
+      }
    }
+
+   vault_user_unlock(user);
 }
 
-/* insert_in_list:  inserts the hint-pwd pair into list l */
-int  insert_in_list (struct hpw_list **lp, char *hint, char *pwd) {
+/* save_vault:  writes an image of every user's pairs to buf, if it fits in
+ *              size bytes, and returns the bytes the image takes; a caller
+ *              may pass a NULL buf to learn the size                       */
+size_t save_vault (struct pwd_vault *v, char *buf, size_t size) {
+   struct img_cursor   c  = { .buf = buf, .size = size };
+   struct vault_image  vi = { .magic   = VAULT_IMAGE_MAGIC,
+                              .version = VAULT_IMAGE_VERSION };
+   struct hpw_list_h  *user;
+   unsigned long       idx;
+
+   /* the header is rewritten once the users are counted */
+   img_put(&c, &vi, sizeof(vi));
+
+   xa_for_each(&v->users, idx, user) {
+      if (READ_ONCE(user->total_hpw_pairs) == 0) continue;
+
+      save_user(&c, user);
+      vi.nusers++;
+      cond_resched();
+   }
 
-   struct hpw_list *l;
+   if (buf != NULL && c.off <= size) memcpy(buf, &vi, sizeof(vi));
 
-   /* no hints allocated to this list */
-   if (*lp == NULL) {
+   return c.off;
+}
+EXPORT_SYMBOL_GPL(save_vault);
+
+/* check_user:  reads the header of the next user in the image into iu and
+ *              checks the user's hints and pwds, totalling the arena bytes
+ *              their records take; FALSE if the image is malformed        */
+static int check_user (struct img_cursor *c, struct vault_image_user *iu,
+                       size_t *bytes) {
+   const char *p = img_get(c, sizeof(*iu));
+   const char *hint, *pwd;
+   size_t      hlen, plen;
+   u64         pairs = 0;
+   u32         h, k, n;
+
+   if (p == NULL) return FALSE;
+   memcpy(iu, p, sizeof(*iu));
+
+   *bytes = 0;
+   for (h = 0; h < iu->nhints; h++) {
+      if (!img_str(c, MAX_HINT_SIZE, FALSE, &hint, &hlen) ||
+          !img_u32(c, &n) || n == 0) return FALSE;
+
+      for (k = 0; k < n; k++) {
+         if (!img_str(c, MAX_PWD_SIZE, TRUE, &pwd, &plen)) return FALSE;
+         *bytes += pwd_size(plen);
+      }
+      *bytes += rec_size(hlen);
+      pairs  += n;
+   }
 
-#ifdef DEBUG
-      printk(KERN_WARNING "IIL: hint %s begins new list\n", hint);
-#endif
+   return pairs == iu->npairs;
+}
 
-      /* so allocate one */
-      *lp = kmalloc(sizeof(struct hpw_list), GFP_KERNEL);
-      memset(*lp, 0, sizeof(struct hpw_list));
+/* bulk_alloc:  allocates n objects of cache into p; FALSE if it cannot     */
+static int bulk_alloc (struct kmem_cache *cache, size_t n, void **p) {
+   return n == 0 || kmem_cache_alloc_bulk(cache, GFP_KERNEL, n, p) == n;
+}
 
-      /* if kmalloc failed, return FALSE */
-      if (*lp == NULL) return FALSE;
+/* user_build:  loads the checked pairs at c into user, who has none, with
+ *              every pair, slot and trie node allocated up front, one arena
+ *              of bytes for the strings and the index sized once.  Nothing
+ *              is published unless everything is allocated.  A read past
+ *              the checked image, which cannot happen, stops the load with
+ *              -EINVAL and keeps the pairs ahead of it.  The caller holds
+ *              the user's lock.                                            */
+static int user_build (struct pwd_vault *v, struct hpw_list_h *user,
+                       struct img_cursor *c, struct vault_image_user *iu,
+                       size_t bytes) {
+   size_t            np   = iu->npairs, nh = iu->nhints;
+   size_t            size = ARENA_MIN_SIZE;
+   unsigned int      bits = index_of(user)->bits;
+   size_t            j = 0, us = 0, uc = 0, cost;
+   struct hpw_arena *a;
+   void            **obj;
+   const char       *hint, *pwd;
+   size_t            hlen, plen;
+   char              key[MAX_HINT_SIZE + 1];
+   u32               h, k, n = 0;
+   int               rc = 0;
+
+   /* a repeated hint is charged for a slot it does not use only here */
+   if (over_quota(v, user, np, np * PAIR_BYTES + bytes + nh * HINT_BYTES))
+      return -ENOSPC;
+
+   while (size < bytes)         size *= 2;
+   while ((1UL << bits) < nh)   bits++;
+
+   /* the pairs come first in obj, then the slots, then the trie nodes */
+   obj = kvmalloc_array(np + 2 * nh, sizeof(void *), GFP_KERNEL);
+   if (obj == NULL) return -ENOMEM;
+
+   a = kvmalloc(sizeof(struct hpw_arena) + size, GFP_KERNEL_ACCOUNT);
+   if (a == NULL) goto fail_arena;
+
+   if (!bulk_alloc(hpw_list_cache, np, obj))               goto fail_pairs;
+   if (!bulk_alloc(hpw_slot_cache, nh, obj + np))          goto fail_slots;
+   if (!bulk_alloc(hpw_crit_cache, nh, obj + np + nh))     goto fail_crits;
+   if (bits > index_of(user)->bits && !index_resize(v, user, bits))
+      goto fail_index;
+   if (!order_reserve(user, nh))
+      goto fail_index;
+
+   /* the user has no live strings, so any arena it has is all dead */
+   if (user->arena != NULL) kvfree_rcu(user->arena, rcu);
+
+   a->size     = size;
+   a->used     = 0;
+   a->dead     = 0;
+   user->arena = a;
+
+   for (h = 0; h < nh && rc == 0; h++) {
+      struct hpw_slot *s;
+      int              fresh;
+
+      if (WARN_ON_ONCE(!img_str(c, MAX_HINT_SIZE, FALSE, &hint, &hlen)) ||
+          WARN_ON_ONCE(!img_u32(c, &n))) {
+         rc = -EINVAL;
+         break;
+      }
+      memcpy(key, hint, hlen);
+      key[hlen] = '\0';
+
+      /* a hint repeated in the image adds its pwds to the hint's slot */
+      s     = index_lookup(v, user, key);
+      fresh = (s == NULL);
+      if (fresh) {
+         s = obj[np + us++];
+         rec_fill(a, &s->hint, key, hlen);
+         INIT_LIST_HEAD(&s->pairs);
+         s->pos    = 0;
+         s->npairs = 0;
+      }
 
-#ifdef DEBUG
-      printk(KERN_WARNING "IIL: allocation of new list node succeeded\n");
-#endif
+      for (k = 0; k < n; k++) {
+         struct hpw_list *l;
 
-      l = *lp;
+         if (WARN_ON_ONCE(!img_str(c, MAX_PWD_SIZE, TRUE, &pwd, &plen))) {
+            rc = -EINVAL;
+            break;
+         }
+         l = obj[j++];
+         pwd_fill(a, l, pwd, plen);
+         l->slot = s;
+         list_add_tail_rcu(&l->list, &s->pairs);
 
-#ifdef DEBUG
-      printk(KERN_WARNING "IIL: l assigned to non-NULL\n");
-#endif
+         if (v->note != NULL) {
+            v->note(v, VAULT_INSERT, user->uid, s->hint, l->pwd);
+         }
+      }
 
-   /* this this already has hints */
-   } else {
+      /* a new slot the load stopped before any pwd goes back unused */
+      if (fresh && k == 0) {
+         us--;
+         break;
+      }
 
-#ifdef DEBUG
-      printk(KERN_WARNING "IIL: hint %s belongs to existing list\n", hint);
-#endif
+      /* a new slot is complete, so publish it to readers */
+      if (fresh) {
+         trie_insert(user, s, obj[np + nh + uc++]);
+         list_add_tail_rcu(&s->list, &user->slots);
+         hlist_add_head_rcu(&s->hnode,
+                            index_bucket(index_of(user), hint_hash(v, key)));
+         user->num_hints++;
+      }
 
-      /* walk the list to the last element */
-      l = *lp;
-      while (l->next != NULL) l = l->next;
+      spin_lock(&user->cur_lock);
+      order_count(user, s, k);
+      spin_unlock(&user->cur_lock);
+   }
 
-#ifdef DEBUG
-      printk(KERN_WARNING "IIL: walk to end of list complete\n");
-#endif
+   /* the objects that repeated hints or a stopped load left unused go back */
+   kmem_cache_free_bulk(hpw_list_cache, np - j, obj + j);
+   kmem_cache_free_bulk(hpw_slot_cache, nh - us, obj + np + us);
+   kmem_cache_free_bulk(hpw_crit_cache, nh - uc, obj + np + nh + uc);
 
-      /* add the new hint-pwd pair */
-      l->next = kmalloc(sizeof(struct hpw_list), GFP_KERNEL);
+   cost = j * PAIR_BYTES + us * HINT_BYTES + a->used;
 
-      /* if kmalloc failed, return FALSE */
-      if (l->next == NULL) return FALSE;
+   user->total_hpw_pairs += j;
+   user->bytes           += cost;
+   WRITE_ONCE(user->gen, user->gen + 1);
+   this_cpu_add(v->stats->inserts, j);
+   this_cpu_add(v->stats->pairs,   j);
+   this_cpu_add(v->stats->hints,   us);
+   this_cpu_add(v->stats->bytes,   cost);
 
-#ifdef DEBUG
-      printk(KERN_WARNING "IIL: allocation of tail list node succeeded\n");
-#endif
+   kvfree(obj);
+   return rc;
+
+ fail_index:
+   kmem_cache_free_bulk(hpw_crit_cache, nh, obj + np + nh);
+ fail_crits:
+   kmem_cache_free_bulk(hpw_slot_cache, nh, obj + np);
+ fail_slots:
+   kmem_cache_free_bulk(hpw_list_cache, np, obj);
+ fail_pairs:
+   kvfree(a);
+ fail_arena:
+   kvfree(obj);
+   return -ENOMEM;
+}
 
-      /* set new elem's prev ptr, NULL-term next ptr, and adv l to new elem */
-      l->next->prev = l;
-      l->next->next = NULL;
-      l = l->next;
+/* load_user:  adds the checked pairs at c to user iu->uid; a user who has
+ *             none is built in bulk, and one who has some takes the image's
+ *             pairs one insert at a time, after its own                   */
+static int load_user (struct pwd_vault *v, struct img_cursor *c,
+                      struct vault_image_user *iu, size_t bytes) {
+   kuid_t             uid  = KUIDT_INIT(iu->uid);
+   struct hpw_list_h *user = vault_user(v, uid, TRUE);
+   const char        *str;
+   char               hint[MAX_HINT_SIZE + 1];
+   char               pwd[MAX_PWD_SIZE + 1];
+   size_t             len;
+   u32                h, k, n = 0;
+   int                rc = 0;
+
+   if (user == NULL) return -ENOMEM;
+
+   mutex_lock(&user->lock);
+
+   if (user->total_hpw_pairs == 0) {
+      rc = user_build(v, user, c, iu, bytes);
+      vault_user_unlock(user);
+      return rc;
    }
 
-#ifdef DEBUG
-   printk(KERN_WARNING "IIL: copying data to list node\n");
-#endif
+   for (h = 0; h < iu->nhints && rc == 0; h++) {
+      if (WARN_ON_ONCE(!img_str(c, MAX_HINT_SIZE, FALSE, &str, &len))) {
+         rc = -EINVAL;
+         break;
+      }
+      memcpy(hint, str, len);
+      hint[len] = '\0';
+      if (WARN_ON_ONCE(!img_u32(c, &n))) {
+         rc = -EINVAL;
+         break;
+      }
 
-   /* copy the hint-pwd pair into the referenced list element */
-   strncpy(l->hpw.hint, hint, MAX_HINT_SIZE);
-   strncpy(l->hpw.pwd, pwd, MAX_PWD_SIZE);
+      for (k = 0; k < n && rc == 0; k++) {
+         if (WARN_ON_ONCE(!img_str(c, MAX_PWD_SIZE, TRUE, &str, &len))) {
+            rc = -EINVAL;
+            break;
+         }
+         memcpy(pwd, str, len);
+         pwd[len] = '\0';
+         rc = add_pair(v, uid, hint, pwd);
+      }
+   }
 
-#ifdef DEBUG
-   printk(KERN_WARNING "IIL: copy complete\n");
-#endif
+   vault_user_unlock(user);
+   return rc;
+}
 
-   return TRUE;
+/* load_vault:  adds the pairs of the image in buf to the vault, checking the
+ *              whole image before changing anything; returns 0, -EINVAL if
+ *              the image is malformed, or -ENOMEM or -ENOSPC, in which case
+ *              the users ahead of the failing one are loaded               */
+int  load_vault (struct pwd_vault *v, const char *buf, size_t size) {
+   struct img_cursor        c = { .buf = (char *) buf, .size = size };
+   struct vault_image       vi;
+   struct vault_image_user  iu;
+   const char              *p = img_get(&c, sizeof(vi));
+   size_t                   start, bytes;
+   u32                      i;
+   int                      rc;
+
+   if (p == NULL) return -EINVAL;
+   memcpy(&vi, p, sizeof(vi));
+
+   if (vi.magic != VAULT_IMAGE_MAGIC || vi.version != VAULT_IMAGE_VERSION)
+      return -EINVAL;
+
+   /* the image must hold exactly the users its header counts */
+   for (i = 0; i < vi.nusers; i++) {
+      if (!check_user(&c, &iu, &bytes)) return -EINVAL;
+   }
+   if (c.off != size) return -EINVAL;
+
+   /* each user is checked again, for its header and the bytes it needs */
+   c.off = sizeof(vi);
+   for (i = 0; i < vi.nusers; i++) {
+      start = c.off;
+      check_user(&c, &iu, &bytes);
+      c.off = start + sizeof(iu);
+
+      rc = load_user(v, &c, &iu, bytes);
+      if (rc) return rc;
+
+      cond_resched();
+   }
+
+   return 0;
+}
+EXPORT_SYMBOL_GPL(load_vault);
+
+/* vault_reclaimable:  how many bytes deleted pairs leave in the vault's
+ *                     arenas, read without taking any user's lock          */
+unsigned long vault_reclaimable (struct pwd_vault *v) {
+   struct hpw_list_h *user;
+   struct hpw_arena  *a;
+   unsigned long      idx, sum = 0;
+
+   /* arenas are freed only after readers are done */
+   rcu_read_lock();
+   xa_for_each(&v->users, idx, user) {
+      a = READ_ONCE(user->arena);
+      if (a != NULL) sum += READ_ONCE(a->dead);
+   }
+   rcu_read_unlock();
+   return sum;
 }
 
-/* delete_from_list: deletes the referenced hint-pwd pair from vault */
-void delete_from_list (struct hpw_list **la) {
-   struct hpw_list *l = *la;
+/* shrink_vault:  repacks the arenas of users whose lock is free, until at
+ *                least nr bytes are reclaimed or every arena is done; it
+ *                runs in reclaim, so it neither waits nor sleeps to
+ *                allocate.  Returns the bytes reclaimed.                   */
+unsigned long shrink_vault (struct pwd_vault *v, unsigned long nr) {
+   struct hpw_list_h *user;
+   unsigned long      idx, freed = 0;
 
-   if (l == NULL) return;
+   xa_for_each(&v->users, idx, user) {
+      if (freed >= nr) break;
+      if (!mutex_trylock(&user->lock)) continue;
+
+      freed += arena_repack(user, GFP_NOWAIT | __GFP_NOWARN);
+      vault_user_unlock(user);
+   }
+
+   return freed;
+}
+
+/* add_cursor:  registers c with user, at the user's first pair */
+void add_cursor (struct hpw_list_h *user, struct hpw_cursor *c) {
+
+   lockdep_assert_held(&user->cur_lock);
 
-   struct hpw_list *p = l->prev;
-   struct hpw_list *n = l->next;
+   c->fp   = user_first(user);
+   c->last = NULL;
+   list_add(&c->link, &user->cursors);
+}
+EXPORT_SYMBOL_GPL(add_cursor);
+
+/* remove_cursor:  unregisters c from user, which no longer moves it */
+void remove_cursor (struct hpw_list_h *user, struct hpw_cursor *c) {
+
+   lockdep_assert_held(&user->cur_lock);
+
+   list_del(&c->link);
+   c->fp   = NULL;
+   c->last = NULL;
+}
+EXPORT_SYMBOL_GPL(remove_cursor);
+
+/* get_last_in_list:  returns the last element of the list holding l */
+struct hpw_list*   get_last_in_list (struct hpw_list *l) {
+
+   /* return NULL if there is no list */
+   if (l == NULL) return NULL;
+
+   /* otherwise, the slot heading the list knows its tail */
+   return list_last_entry(&l->slot->pairs, struct hpw_list, list);
+}
+
+/* free_list:  releases slot s and any allocated memory in its list; s must
+ *             be unlinked, with any readers of it already waited out       */
+void free_list(struct hpw_list_h *user, struct hpw_slot *s) {
+   struct hpw_batch pairs = { .cache = hpw_list_cache };
+   struct hpw_batch slots = { .cache = hpw_slot_cache };
+   struct hpw_list *l;
+
+   /* the strings are left for the user's next arena_compact */
+   list_for_each_entry(l, &s->pairs, list) {
+      if (!pwd_inline(l)) arena_drop(user, l->pwd);
+   }
+   arena_drop(user, s->hint);
 
-   /* cause previous element in list to reference what appears after l */
-   if (p != NULL) {
-      p->next = n;
+   /* release the list elements and the slot itself in bulk */
+   batch_slot(&pairs, &slots, s);
+   batch_flush(&pairs);
+   batch_flush(&slots);
+}
+
+/* insert_in_list:  appends a pair of pwd to the list of slot s, whose hint
+ *                  the slot already holds */
+int  insert_in_list (struct hpw_list_h *user, struct hpw_slot *s, char *pwd) {
+   size_t len = strnlen(pwd, MAX_PWD_SIZE);
 
 #ifdef DEBUG
-      printk(KERN_WARNING "DFL:  node at %x now references %x as next\n", p, n);
+   printk(KERN_WARNING "IIL: hint %s %s list\n", s->hint,
+          list_empty(&s->pairs) ? "begins new" : "belongs to existing");
 #endif
-   }
 
-   /* cause next element in list to reference what appears before l */
-   if (n != NULL) {
-      n->prev = p;
+   /* allocate the new list element */
+   struct hpw_list *l = kmem_cache_alloc(hpw_list_cache, GFP_KERNEL);
+
+   /* if the allocation failed, return FALSE */
+   if (l == NULL) return FALSE;
 
 #ifdef DEBUG
-      printk(KERN_WARNING "DFL:  node at %x now references %x as prev\n", n, p);
+   printk(KERN_WARNING "IIL: copying data to list node\n");
 #endif
+
+   /* copy the pwd into the pair, or into the user's arena if it is long */
+   if (!arena_reserve(user, pwd_size(len))) {
+      kmem_cache_free(hpw_list_cache, l);
+      return FALSE;
    }
+   pwd_fill(user->arena, l, pwd, len);
+
+   /* the slot keeps the tail of its list, so no walk is needed; the pair
+    * is complete, so it can be published to readers                       */
+   l->slot = s;
+   list_add_tail_rcu(&l->list, &s->pairs);
 
 #ifdef DEBUG
-   printk(KERN_WARNING "DFL:  releasing %x\n", *la);
+   printk(KERN_WARNING "IIL: copy complete\n");
 #endif
 
-   kfree(*la);
-   *la = NULL;
+   return TRUE;
+}
+
+/* delete_from_list: unlinks the referenced hint-pwd pair and releases it */
+void delete_from_list (struct hpw_list_h *user, struct hpw_list *l) {
+
+   if (l == NULL) return;
 
 #ifdef DEBUG
-   printk(KERN_WARNING "DFL:  released %x\n", *la);
+   printk(KERN_WARNING "DFL:  releasing %x\n", l);
 #endif
-}
 
+   /* readers may still be on the pair, so free it after they are done */
+   if (!pwd_inline(l)) arena_drop(user, l->pwd);
+   list_del_rcu(&l->list);
+   call_rcu(&l->rcu, pair_free_rcu);
+}
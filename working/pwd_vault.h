@@ -3,9 +3,8 @@
  * Date:    8 Nov 2016
  * Purpose: Supports HW4 for CS3320 */
 
-#define MAX_HINT_SIZE 20
-#define MAX_PWD_SIZE 20
-#define MAX_HINT_USER 20
+#define MAX_HINT_SIZE 255
+#define MAX_PWD_SIZE 255
 
 #define MAX_HINT_PWD_SIZE MAX_HINT_SIZE+1+MAX_PWD_SIZE+1
 
@@ -15,58 +14,295 @@
 #define FALSE         0
 #define TRUE          1
 
-/* structure to hold the hint-password pairs                           */
-struct hint_pwd {
-   char hint[MAX_HINT_SIZE];
-   char pwd[MAX_PWD_SIZE];
-};
+/* the changes a vault reports through its note hook                        */
+#define VAULT_INSERT  0
+#define VAULT_DELETE  1
+
+/* fewest hash buckets (log2) in a user's hint index                        */
+#define HINT_INDEX_BITS 4
+
+/* smallest arena allocated for a user's strings, in bytes                    */
+#define ARENA_MIN_SIZE  512
+
+/* bytes a pair holds its pwd in, NUL included; a longer pwd is kept in the
+ * user's arena instead                                                      */
+#define HPW_INLINE_PWD  16
 
-/* allows the hint-password pairs to be grouped into a linked list     */
+/* the test programs include this file for the sizes above, so the vault
+ * structures and functions below are visible only to kernel code            */
+#ifdef __KERNEL__
+
+#include <linux/list.h>       /* for hlist_head, hlist_node */
+#include <linux/mutex.h>      /* for struct mutex */
+#include <linux/percpu.h>     /* for alloc_percpu */
+#include <linux/rcupdate.h>   /* for struct rcu_head */
+#include <linux/seqlock.h>    /* for seqcount_mutex_t */
+#include <linux/spinlock.h>   /* for spinlock_t */
+#include <linux/siphash.h>    /* for siphash_key_t */
+#include <linux/uidgid.h>     /* for kuid_t */
+#include <linux/wait.h>       /* for wait_queue_head_t */
+#include <linux/xarray.h>     /* for struct xarray */
+
+/* one hint-password pair, grouped with the others sharing its hint into a
+ * linked list; the hint is kept once, by the slot heading the list, and a
+ * short pwd inline, so most pairs are one 64-byte object                 */
 struct hpw_list {
-   struct hint_pwd  hpw;
-   struct hpw_list *next;
-   struct hpw_list *prev;
+   char              *pwd;     /* ipwd, or a record in the user's arena    */
+   struct list_head   list;    /* link in the list of pairs for this hint  */
+   struct hpw_slot   *slot;    /* the slot whose list holds this pair      */
+   struct rcu_head    rcu;     /* frees the pair once readers are done     */
+   char               ipwd[HPW_INLINE_PWD];
+};
+
+/* one string in the user's arena: a slot's hint or a long pwd        */
+struct hpw_rec {
+   char             **ref;     /* the pointer to data, NULL if dead        */
+   unsigned int       size;    /* record bytes, header included, 8-aligned */
+   char               data[];
+};
+
+/* contiguous storage for all of a user's records, in the order of the
+ * user's pairs as of the last time the arena grew                     */
+struct hpw_arena {
+   struct rcu_head    rcu;     /* frees a replaced arena after its readers */
+   size_t             size;    /* bytes available in buf                   */
+   size_t             used;    /* bytes of buf holding records             */
+   size_t             dead;    /* bytes of used held by deleted records    */
+   char               buf[];
+};
+
+/* heads the list of hint-password pairs sharing one hint             */
+struct hpw_slot {
+   char              *hint;    /* the pairs' hint, a record in the arena   */
+   struct list_head   pairs;   /* the pairs for this hint, oldest first    */
+   struct list_head   list;    /* link in the user's list of slots         */
+   struct hlist_node  hnode;   /* link in the user's hint index            */
+   unsigned int       pos;     /* position in the user's order index       */
+   int                npairs;  /* pairs in the list, as the index counts   */
+   struct rcu_head    rcu;     /* frees the slot once readers are done     */
+};
+
+/* an internal node of a user's crit-bit trie of slots, keyed by hint; the
+ * children are slots or, with the low bit set, further nodes.  Hints in the
+ * child[1] subtree have bit otherbits' complement set in hint[byte]      */
+struct hpw_crit {
+   void __rcu        *child[2];
+   u32                byte;    /* the index of the first differing byte    */
+   u8                 otherbits; /* every bit but the differing one set    */
+   struct rcu_head    rcu;     /* frees the node once readers are done     */
 };
 
-/* hold information about a list, including a pointer to the head */
+/* a user's hint index: hash buckets of slots, replaced whole when it grows */
+struct hpw_index {
+   struct rcu_head    rcu;     /* frees a replaced index after its readers */
+   unsigned int       bits;    /* log2 of the number of buckets            */
+   struct hlist_head  b[];
+};
+
+/* a user's order index: the slots, in the order of the user's list, hold
+ * positions 1 to used of two Fenwick trees, one counting the slots and one
+ * their pairs, so that the position of a hint or pair, and the pair at a
+ * position, take O(log n).  A retired slot keeps its position, counting
+ * nothing, until the index is rebuilt with only the live slots.          */
+struct hpw_order {
+   struct rcu_head    rcu;     /* frees a replaced index after its readers */
+   unsigned int       size;    /* positions in the trees, a power of 2     */
+   unsigned int       used;    /* positions given to slots so far          */
+   struct hpw_slot  **slot;    /* the slot at each position, NULL if retired */
+   int               *hints;   /* Fenwick tree of the slots                */
+   int               *pairs;   /* Fenwick tree of the slots' pairs         */
+};
+
+/* a place in one user's pairs, as each open file of the device keeps one;
+ * delete_pair moves every cursor registered with the user off a pair it
+ * deletes, and forgets the pair if it was the last read, so no cursor is
+ * left on a freed pair.  Neither of a cursor's pairs is deleted while
+ * the user's cur_lock or lock is held                                    */
+struct hpw_cursor {
+   struct hpw_list   *fp;      /* the pair at the cursor, NULL at the end   */
+   struct hpw_list   *last;    /* the pair last read, NULL if none or gone  */
+   struct list_head   link;    /* link in the user's list of cursors        */
+};
+
+/* hold information about a list, including a pointer to the head; lock
+ * serializes the user's writers, so users never contend.  Readers take no
+ * sleeping lock: they look up hints and walk pairs under rcu_read_lock,
+ * and cur_lock alone orders the cursors against pairs being unlinked    */
 struct hpw_list_h {
+   kuid_t            uid;      /* the user owning this list                */
+   struct mutex      lock;     /* held by anyone changing the user's pairs */
+   spinlock_t        cur_lock; /* guards the cursors, unlinking and order  */
+   seqcount_mutex_t  hseq;     /* bumped while the hint index is rehashed  */
+   struct list_head  ulist;    /* link in the vault's list of users        */
    int               total_hpw_pairs;
    int               num_hints;
-   char              seek_hint[MAX_HINT_PWD_SIZE];
-   struct hpw_list **data;
-   struct hpw_list  *fp;
+   size_t            bytes;    /* charged for the pairs, hints and strings */
+   u64               gen;      /* bumped by every insert and delete        */
+   wait_queue_head_t wait;     /* pollers waiting for gen to move          */
+   struct fasync_struct *fasync; /* files signalled when gen moves         */
+   struct list_head  slots;    /* one slot per hint, in insertion order    */
+   struct list_head  cursors;  /* the cursors registered with the user     */
+   struct hpw_arena *arena;    /* the strings of all of the user's pairs   */
+   struct hpw_index __rcu *index; /* hint index: hash buckets of slots     */
+   void __rcu       *trie;     /* crit-bit trie of the slots, in hint order */
+   struct hpw_order __rcu *order; /* order index of the slots and pairs    */
+};
+
+/* a vault's counters, kept per CPU so that counting shares no cache line
+ * between CPUs; the vault's totals are the sums over the CPUs.  hints, pairs
+ * and bytes count what each CPU added less what it removed, so one CPU's may
+ * be negative                                                              */
+struct vault_stats {
+   u64                inserts;  /* pairs inserted                            */
+   u64                deletes;  /* pairs deleted                             */
+   u64                lookups;  /* hints looked up                           */
+   u64                misses;   /* lookups that found no such hint           */
+   long               hints;    /* hints the vault holds                     */
+   long               pairs;    /* pairs the vault holds                     */
+   long               bytes;    /* bytes the users are charged in all        */
 };
 
-/* the password vault is essentially an array of hpw list head pointers */
+/* the password vault is a sparse map from kuid to each user's hpw list head;
+ * a user's list head is allocated on the user's first write.  List heads are
+ * never freed before finalize_vault, so a looked-up head stays valid; the
+ * xarray's own lock (xa_lock) guards num_users, ulist and pool             */
 struct pwd_vault {
    int                num_users;
-   struct hpw_list_h *uhpw_data;
+   siphash_key_t      hkey;     /* random seed for the users' hint indexes */
+   unsigned int       hbits;    /* log2 of the buckets in a new hint index */
+   struct xarray      users;    /* hpw_list_h of each user, by kuid        */
+   struct list_head   ulist;    /* the users' list heads, in kuid order    */
+   struct list_head   pool;     /* list heads preallocated for new users   */
+   int                max_pairs; /* pairs one user may hold, 0 for no limit */
+   unsigned long      max_bytes; /* bytes one user may be charged, or 0    */
+   struct vault_stats __percpu *stats; /* the vault's counters             */
+   /* told of each pair inserted or deleted, under the pair's user's lock;
+    * the strings are valid only for the call                              */
+   void             (*note)(struct pwd_vault *v, int op, kuid_t uid,
+                            const char *hint, const char *pwd);
+};
+
+/* a position in a walk of the vault in FORWARD or REVERSE order, which is
+ * resumed after each stop with no lock held in between.  While the cursor
+ * is stopped, l is trusted only if the user's gen has not moved; otherwise
+ * the walk resumes at the user's done-th pair                             */
+struct vault_cursor {
+   int                dir;      /* FORWARD or REVERSE                        */
+   int                started;  /* FALSE until the first vault_cursor_start  */
+   int                locked;   /* TRUE while the cursor holds user's lock   */
+   u64                pos;      /* pairs the cursor has passed in all        */
+   struct hpw_list_h *user;     /* the user at the cursor, NULL at the end   */
+   struct hpw_list   *l;        /* the pair at the cursor                    */
+   u64                gen;      /* user's gen when the cursor stopped        */
+   size_t             done;     /* pairs of user before l                    */
 };
 
+/* a vault image, as save_vault writes it and load_vault reads it: this
+ * header, then for each user a vault_image_user followed by the user's hints
+ * in order.  Each hint is a length byte and the hint, a u32 count of its
+ * pwds and then each pwd as a length byte and the pwd.  Strings carry no
+ * NUL, and numbers are in host order, since an image is restored on the
+ * host that saved it.                                                      */
+#define VAULT_IMAGE_MAGIC   0x56345748  /* "HW4V" */
+#define VAULT_IMAGE_VERSION 1
+
+struct vault_image {
+   u32                magic;
+   u32                version;
+   u32                nusers;   /* the users that follow                     */
+};
+
+struct vault_image_user {
+   u32                uid;      /* the user's kuid                           */
+   u32                nhints;   /* the hints that follow                     */
+   u32                npairs;   /* the pwds under all of the hints           */
+};
+
+/* pair_hint:  the hint of pair l; the caller holds the user's lock or
+ *             rcu_read_lock, as the hint may move when the arena is packed  */
+static inline char* pair_hint (struct hpw_list *l) {
+   return READ_ONCE(l->slot->hint);
+}
+
+/* pair_pwd:  the pwd of pair l, under the same conditions as pair_hint       */
+static inline char* pair_pwd (struct hpw_list *l) {
+   return READ_ONCE(l->pwd);
+}
+
 /* a typedefed function pointer for walking the data structure sequentially   */
-typedef struct hpw_list*(*seq_func_ptr)(struct pwd_vault*,int,struct hpw_list*);
+typedef struct hpw_list*(*seq_func_ptr)(struct pwd_vault*,kuid_t,
+                                        struct hpw_list*);
 
 /*
  * Function prototypes follow
  */
 
-/* initialize_vault:  initializes the pwd vault                              */
-int initialize_vault (struct pwd_vault *v, int size);
+/* initialize_vault_caches:  creates the slab caches for list elements and
+ *                           slots; must precede any initialize_vault         */
+int initialize_vault_caches (void);
+
+/* finalize_vault_caches:  destroys the caches after every finalize_vault     */
+void finalize_vault_caches (void);
+
+/* initialize_vault:  initializes the pwd vault, preallocating list heads for
+ *                    nusers users, each indexed for about nhints hints       */
+int initialize_vault (struct pwd_vault *v, int nusers, int nhints);
 
 /* dump_vault:  prints the contents of the vault to log for debugging         */
 void dump_vault (struct pwd_vault *v, int dir);
 
+/* walk_vault:  calls fn on every pair in the vault in FORWARD or REVERSE
+ *              order, stopping early if fn returns non-zero; the caller must
+ *              keep all other users of the vault out for the walk           */
+int walk_vault (struct pwd_vault *v, int dir,
+                int (*fn)(struct hpw_list *l, void *arg), void *arg);
+
+/* vault_cursor_init:  points c before the first pair of a walk in dir order */
+void vault_cursor_init (struct vault_cursor *c, int dir);
+
+/* vault_cursor_start:  returns the pair at c, holding the lock of its user
+ *                      until vault_cursor_stop, or NULL past the last pair  */
+struct hpw_list* vault_cursor_start (struct pwd_vault *v,
+                                     struct vault_cursor *c);
+
+/* vault_cursor_next:  moves c to the next pair and returns it, taking the
+ *                     next user's lock in place of the last user's when it
+ *                     moves on to the next user; NULL past the last pair    */
+struct hpw_list* vault_cursor_next (struct pwd_vault *v,
+                                    struct vault_cursor *c);
+
+/* vault_cursor_stop:  releases the lock c holds, so the walk may pause       */
+void vault_cursor_stop (struct pwd_vault *v, struct vault_cursor *c);
+
 /* finalize_vault:  releases the allocated memory for the vault               */
 void finalize_vault (struct pwd_vault *v);
 
-/* num_hints:  how many unique hints have been inserted by this user, 1-index */
-int num_hints (struct pwd_vault *v, int uid);
+/* vault_user:  returns the list head of user uid, allocating it if create is
+ *              TRUE and the user has none; NULL if absent or out of memory.
+ *              insert_pair and delete_pair expect the caller to hold that
+ *              user's lock; the lookups below may instead run under
+ *              rcu_read_lock, and prev_hint under the user's cur_lock        */
+struct hpw_list_h* vault_user (struct pwd_vault *v, kuid_t uid, int create);
+
+/* vault_user_unlock:  releases the user's lock, and wakes the user's pollers
+ *                     waiting for it to be free                             */
+void vault_user_unlock (struct hpw_list_h *user);
+
+/* num_hints:  how many unique hints have been inserted by this user          */
+int num_hints (struct pwd_vault *v, kuid_t uid);
+
+/* rem_hints:  how many addtl unique hints may be inserted by user            */
+int rem_hints (struct pwd_vault *v, kuid_t uid);
+
+/* num_pairs(int): how many hint-pwd pairs have been inserted by user         */
+int num_pairs (struct pwd_vault *v, kuid_t uid);
 
-/* rem_hints:  how many addtl unique hints may be inserted by user, 1-index   */
-int rem_hints (struct pwd_vault *v, int uid);
+/* num_bytes:  how many bytes the user's pairs are charged against the quota */
+size_t num_bytes (struct pwd_vault *v, kuid_t uid);
 
-/* num_pairs(int): how many hint-pwd pairs have been inserted by user, 1-index*/
-int num_pairs (struct pwd_vault *v, int uid);
+/* vault_stats:  sums the vault's counters over the CPUs into sum, without
+ *                taking any lock                                             */
+void vault_stats (struct pwd_vault *v, struct vault_stats *sum);
 
 /* num_vhints:  how many unique hints have been inserted into the vault       */
 int num_vhints (struct pwd_vault *v);
@@ -74,45 +310,111 @@ int num_vhints (struct pwd_vault *v);
 /* num_vpairs(void):  how many hint-pwd pairs have been inserted into vault   */
 int num_vpairs (struct pwd_vault *v);
 
-/* insert_pair: inserts hint-pwd pair for given uid (one-indexed) into vault  */
-int insert_pair (struct pwd_vault *v, int uid, char *hint, char *pwd);
+/* add_pair:  inserts hint-pwd pair for given uid into vault; returns 0,
+ *            -ENOSPC if it would put the user over max_pairs or max_bytes,
+ *            or -ENOMEM                                                      */
+int add_pair (struct pwd_vault *v, kuid_t uid, char *hint, char *pwd);
 
-/* delete_pair: deletes hint-pwd pair for given uid (one-indexed) from vault  */
-void delete_pair (struct pwd_vault *v, int uid, char *hint, char *pwd);
+/* insert_pair: inserts hint-pwd pair for given uid into vault; FALSE if
+ *              add_pair fails                                                */
+int insert_pair (struct pwd_vault *v, kuid_t uid, char *hint, char *pwd);
 
-/* retrieve_pwd:  retrieves pwd(s) for hint for uid (one-indexed) to debug    */
-int retrieve_pwd (struct pwd_vault *v, int uid, char *hint, 
-                  char  pwd[MAX_HINT_USER][MAX_PWD_SIZE]);
+/* delete_pair: deletes hint-pwd pair for given uid from vault, first moving
+ *              each of the user's cursors on it past it                      */
+void delete_pair (struct pwd_vault *v, kuid_t uid, char *hint, char *pwd);
+
+/* delete_pair_at:  deletes pair l of uid, such as one at a cursor, without
+ *                  searching for it; the caller holds the user's lock, which
+ *                  keeps l from being deleted since it was found              */
+void delete_pair_at (struct pwd_vault *v, kuid_t uid, struct hpw_list *l);
+
+/* retrieve_pwd:  retrieves up to max pwd(s) for hint for uid, taking no lock */
+int retrieve_pwd (struct pwd_vault *v, kuid_t uid, char *hint,
+                  char  pwd[][MAX_PWD_SIZE], int max);
 
 /* find_hint:  finds the specified hint in the vault and returns a pointer to
  *             it, or returns NULL if the hint is not present; also sets
- *             hint_num to the sequential location of the hint in the vault 
- *             Note, uid is one-indexed.                                      */
-struct hpw_list*  find_hint  (struct pwd_vault *v, int uid, char *hint, 
+ *             hint_num to the sequential location of the hint in the vault   */
+struct hpw_list*  find_hint  (struct pwd_vault *v, kuid_t uid, char *hint,
                               int *hint_num);
 
 /* find_hint_pwd:  finds the specified hint-pwd pair and returns a pointer to
  *                 it, or returns NULL if the pair is not present.            */
-struct hpw_list*  find_hint_pwd (struct pwd_vault *v, int uid, char *hint, 
+struct hpw_list*  find_hint_pwd (struct pwd_vault *v, kuid_t uid, char *hint,
                                  char  *pwd);
 
+/* first_hint:  returns a pointer to the first hint in the user's set, or NULL
+ *              if the user has no hints.                                     */
+struct hpw_list*  first_hint (struct pwd_vault *v, kuid_t uid);
+
+/* last_hint:  returns a pointer to the last hint in the user's set, or NULL
+ *             if the user has no hints.                                      */
+struct hpw_list*  last_hint  (struct pwd_vault *v, kuid_t uid);
+
 /* next_hint:  returns a pointer to the next hint in the current user's set,
- *             or NULL if there is no next hint.  uid is one-indexed.         */
-struct hpw_list*  next_hint  (struct pwd_vault *v, int uid, struct hpw_list *l);
+ *             or NULL if there is no next hint.                              */
+struct hpw_list*  next_hint  (struct pwd_vault *v, kuid_t uid,
+                              struct hpw_list *l);
 
 /* prev_key:  returns a pointer to the prev hint in the current user's set,
- *            or NULL if there is no prev hint.  uid is one-indexed.          */
-struct hpw_list*  prev_hint  (struct pwd_vault *v, int uid, struct hpw_list *l);
+ *            or NULL if there is no prev hint.                               */
+struct hpw_list*  prev_hint  (struct pwd_vault *v, kuid_t uid,
+                              struct hpw_list *l);
+
+/* nth_pair:  returns the pair at position n, from 0, of the user's set, or
+ *            NULL if there are no more than n pairs; exact for a caller
+ *            holding the user's lock or cur_lock                            */
+struct hpw_list*  nth_pair   (struct pwd_vault *v, kuid_t uid, long n);
+
+/* pair_pos:  returns the position of pair l in the user's set, or the
+ *            number of the user's pairs if l is NULL                         */
+long              pair_pos   (struct pwd_vault *v, kuid_t uid,
+                              struct hpw_list *l);
+
+/* prefix_walk:  calls fn on every pair of uid whose hint starts with prefix,
+ *               in hint order and then in insertion order, stopping early if
+ *               fn returns non-zero; fn runs under rcu_read_lock and must not
+ *               sleep.  Returns fn's non-zero value or 0                     */
+int prefix_walk (struct pwd_vault *v, kuid_t uid, char *prefix,
+                 int (*fn)(struct hpw_list *l, void *arg), void *arg);
+
+/* save_vault:  writes an image of the vault to buf if it fits in size bytes,
+ *              taking each user's lock in turn; returns the image's size,
+ *              so a NULL buf asks how large a buffer to pass               */
+size_t save_vault (struct pwd_vault *v, char *buf, size_t size);
+
+/* load_vault:  adds the pairs in the image of size bytes at buf to the vault,
+ *              building each user without pairs in one bulk pass; returns
+ *              0, -EINVAL for a malformed image, -ENOSPC if a user would go
+ *              over a quota, or -ENOMEM                                    */
+int load_vault (struct pwd_vault *v, const char *buf, size_t size);
+
+/* vault_reclaimable:  how many bytes of the vault's arenas deleted pairs hold */
+unsigned long vault_reclaimable (struct pwd_vault *v);
+
+/* shrink_vault:  reclaims about nr bytes of deleted pairs from the arenas of
+ *                users not being written, for a shrinker; returns the bytes
+ *                reclaimed                                                   */
+unsigned long shrink_vault (struct pwd_vault *v, unsigned long nr);
+
+/* add_cursor:  registers c with user, at the user's first pair; the caller
+ *              holds the user's cur_lock                                     */
+void add_cursor (struct hpw_list_h *user, struct hpw_cursor *c);
+
+/* remove_cursor:  unregisters c from user; the caller holds user's cur_lock  */
+void remove_cursor (struct hpw_list_h *user, struct hpw_cursor *c);
 
-/* get_last_in_list:  walks given list to last element and returns its ref    */
+/* get_last_in_list:  returns the last element in the list holding l          */
 struct hpw_list*  get_last_in_list (struct hpw_list *l);
 
-/* free_list:  releases any allocated memory in tail of incoming list         */
-void free_list (struct hpw_list *l);
+/* free_list:  releases the slot s and every pair in its list                 */
+void free_list (struct hpw_list_h *user, struct hpw_slot *s);
 
-/* insert_in_list:  inserts the hint-pwd pair into list l                     */
-int insert_in_list (struct hpw_list **l, char *hint, char *pwd);
+/* insert_in_list:  appends a pair of pwd to the list of slot s, whose hint
+ *                  the slot already holds                                    */
+int insert_in_list (struct hpw_list_h *user, struct hpw_slot *s, char *pwd);
 
-/* delete_from_list: deletes the referenced hint-pwd pair from vault          */
-void delete_from_list (struct hpw_list **l);
+/* delete_from_list: unlinks the referenced hint-pwd pair and releases it     */
+void delete_from_list (struct hpw_list_h *user, struct hpw_list *l);
 
+#endif /* __KERNEL__ */
@@ -0,0 +1,490 @@
+/*
+ * pwd_vault_bench.c -- timing harness for the pwd_vault data structure
+ *
+ * Builds scratch vaults of doubling size inside the kernel and times the
+ * FORWARD and REVERSE walks that dump_vault makes over them.  The harness
+ * uses the vault functions exported by hw4mod, so load hw4mod first:
+ *
+ *    sudo ./hw4mod_load
+ *    sudo insmod pwd_vault_bench.ko bench_max=1048576
+ *    dmesg | grep pwd_vault_bench
+ *    sudo rmmod pwd_vault_bench
+ *
+ * A linear walk reports a flat ns/pair column as the vault grows.
+ *
+ * It then runs 1, 2, 4, ... bench_threads kernel threads, each a different
+ * user doing bench_ops insert/find/delete rounds, once with every thread
+ * behind one global mutex (the old hw4mod_dev semaphore) and once behind
+ * each user's own lock.  Per-user locking should keep the ns/op column
+ * falling as threads are added, up to the number of cores.
+ *
+ * Last, 1, 2, 4, ... bench_threads reader threads look up the hints of one
+ * user with retrieve_pwd while a writer thread inserts and deletes that
+ * user's pairs, once with each lookup behind the user's lock and once
+ * under RCU alone.  RCU readers should scale with the threads.
+ *
+ * Finally, vaults of bench_min to bench_max pairs are filled one insert_pair
+ * at a time, saved to an image and restored from it into an empty vault
+ * with load_vault.  The restore, which allocates each user's pairs in bulk,
+ * should take a small, flat share of the insert time per pair.
+ *
+ * At the end, a vault of bench_max pairs is filled for each of several pwd
+ * lengths and the bytes its users are charged are reported per pair.  A
+ * pwd short enough to sit inside its pair costs only the pair and its share
+ * of the hint; a longer one adds a record in the user's arena.
+ */
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/init.h>
+
+#include <linux/kernel.h>   /* printk() */
+#include <linux/ktime.h>    /* ktime_get_ns() */
+#include <linux/sched.h>    /* cond_resched() */
+#include <linux/kthread.h>  /* kthread_run() */
+#include <linux/completion.h>
+#include <linux/mutex.h>
+#include <linux/cpumask.h>  /* num_online_cpus() */
+#include <linux/slab.h>     /* kcalloc() */
+#include <linux/mm.h>       /* kvmalloc() */
+
+#include "pwd_vault.h"
+
+/*
+ * Our parameters which can be set at load time.
+ */
+static int bench_min   = 1024;     /* pairs in the smallest vault          */
+static int bench_max   = 262144;   /* pairs in the largest vault           */
+static int bench_pairs = 4;        /* pairs stored under each hint         */
+static int bench_hints = 16;       /* hints stored by each user            */
+static int bench_threads = 0;      /* most contending threads, 0 for #cpus */
+static int bench_ops   = 100000;   /* rounds run by each contending thread */
+
+module_param(bench_min,   int, S_IRUGO);
+module_param(bench_max,   int, S_IRUGO);
+module_param(bench_pairs, int, S_IRUGO);
+module_param(bench_hints, int, S_IRUGO);
+module_param(bench_threads, int, S_IRUGO);
+module_param(bench_ops,   int, S_IRUGO);
+
+MODULE_AUTHOR("K. Shomper");
+MODULE_LICENSE("Dual BSD/GPL");
+
+/* count_pair:  walk_vault callback that counts the pairs it is shown */
+static int count_pair(struct hpw_list *l, void *arg) {
+   (*(int *) arg)++;
+   return 0;
+}
+
+/* fill_vault:  inserts n pairs into v, bench_hints hints per user, each
+ *              under the user's lock as the fops would; each pwd is plen
+ *              digits long                                               */
+static int fill_vault(struct pwd_vault *v, int n, int plen) {
+   char hint[MAX_HINT_SIZE];
+   char pwd[MAX_PWD_SIZE];
+   int  i, ok;
+
+   for (i = 0; i < n; i++) {
+      int                h    = i / bench_pairs;
+      kuid_t             uid  = KUIDT_INIT(h / bench_hints + 1000);
+      struct hpw_list_h *user = vault_user(v, uid, TRUE);
+
+      if (user == NULL) return -ENOMEM;
+
+      snprintf(hint, sizeof(hint), "hint%d", h % bench_hints);
+      snprintf(pwd,  sizeof(pwd),  "%0*d",   plen, i);
+
+      mutex_lock(&user->lock);
+      ok = insert_pair(v, uid, hint, pwd);
+      vault_user_unlock(user);
+
+      if (!ok) return -ENOMEM;
+      cond_resched();
+   }
+
+   return 0;
+}
+
+/* time_walk:  times one walk over v in direction dir, checking its length */
+static u64 time_walk(struct pwd_vault *v, int dir, int n) {
+   int cnt = 0;
+   u64 t   = ktime_get_ns();
+
+   walk_vault(v, dir, count_pair, &cnt);
+   t = ktime_get_ns() - t;
+
+   if (cnt != n) {
+      printk(KERN_WARNING "pwd_vault_bench: walk saw %d of %d pairs\n", cnt, n);
+   }
+
+   return t;
+}
+
+/* one benchmark thread, working on the pairs of its user */
+struct bench_thread {
+   struct pwd_vault  *v;
+   kuid_t             uid;
+   struct mutex      *lock;    /* held for each round, NULL for the user's */
+   int                locked;  /* lookup holds the user's lock if TRUE    */
+   struct completion *go;      /* completed once every thread is ready    */
+   struct completion  done;
+   int                err;
+};
+
+/* the single lock that every thread takes in the global runs */
+static DEFINE_MUTEX(bench_lock);
+
+/* set once the readers are done, to stop the writer running beside them */
+static int bench_stop;
+
+/* contend:  thread function that inserts, finds and deletes one pair per
+ *           round, holding its lock for each round as the fops would     */
+static int contend(void *arg) {
+   struct bench_thread *t    = arg;
+   struct hpw_list_h   *user = vault_user(t->v, t->uid, TRUE);
+   char                 hint[MAX_HINT_SIZE];
+   char                 pwd[MAX_PWD_SIZE];
+   int                  i, pos;
+
+   if (user == NULL) t->err = -ENOMEM;
+
+   wait_for_completion(t->go);
+
+   for (i = 0; i < bench_ops && t->err == 0; i++) {
+      snprintf(hint, sizeof(hint), "hint%d", i % bench_hints);
+      snprintf(pwd,  sizeof(pwd),  "pwd%d",  i);
+
+      mutex_lock(t->lock != NULL ? t->lock : &user->lock);
+      if (!insert_pair(t->v, t->uid, hint, pwd)) t->err = -ENOMEM;
+      else if (find_hint(t->v, t->uid, hint, &pos) == NULL) t->err = -EIO;
+      delete_pair(t->v, t->uid, hint, pwd);
+      if (t->lock != NULL) mutex_unlock(t->lock);
+      else                 vault_user_unlock(user);
+
+      if ((i & 255) == 0) cond_resched();
+   }
+
+   complete(&t->done);
+   return 0;
+}
+
+/* lookup:  thread function that retrieves a pwd of one hint per round,
+ *          under the user's lock if locked, or under RCU alone if not     */
+static int lookup(void *arg) {
+   struct bench_thread *t    = arg;
+   struct hpw_list_h   *user = vault_user(t->v, t->uid, FALSE);
+   char                 hint[MAX_HINT_SIZE];
+   char                 pwd[1][MAX_PWD_SIZE];
+   int                  i, cnt;
+
+   wait_for_completion(t->go);
+
+   for (i = 0; i < bench_ops && t->err == 0; i++) {
+      snprintf(hint, sizeof(hint), "hint%d", i % bench_hints);
+
+      if (t->locked) mutex_lock(&user->lock);
+      cnt = retrieve_pwd(t->v, t->uid, hint, pwd, 1);
+      if (t->locked) vault_user_unlock(user);
+
+      if (cnt != 1) t->err = -EIO;
+      if ((i & 255) == 0) cond_resched();
+   }
+
+   complete(&t->done);
+   return 0;
+}
+
+/* churn:  thread function that, until bench_stop is set, inserts and deletes
+ *         pairs of the readers' user, both under hints the readers look up
+ *         and under hints of their own, so slots come and go as well       */
+static int churn(void *arg) {
+   struct bench_thread *t    = arg;
+   struct hpw_list_h   *user = vault_user(t->v, t->uid, TRUE);
+   char                 hint[MAX_HINT_SIZE];
+   char                 pwd[MAX_PWD_SIZE];
+   int                  i;
+
+   if (user == NULL) t->err = -ENOMEM;
+
+   for (i = 0; !READ_ONCE(bench_stop) && t->err == 0; i++) {
+      if (i & 1) snprintf(hint, sizeof(hint), "hint%d",  i % bench_hints);
+      else       snprintf(hint, sizeof(hint), "churn%d", i % bench_hints);
+      snprintf(pwd, sizeof(pwd), "churn%d", i);
+
+      mutex_lock(&user->lock);
+      if (!insert_pair(t->v, t->uid, hint, pwd)) t->err = -ENOMEM;
+      delete_pair(t->v, t->uid, hint, pwd);
+      vault_user_unlock(user);
+
+      if ((i & 255) == 0) cond_resched();
+   }
+
+   complete(&t->done);
+   return 0;
+}
+
+/* run_threads:  runs nthreads threads of fn on v to completion, each as its
+ *               own user unless shared is TRUE, and returns their wall time,
+ *               or 0 if any of them failed; lock and locked set the threads'
+ *               fields of the same names                                   */
+static u64 run_threads(struct pwd_vault *v, int nthreads, int (*fn)(void *),
+                       struct mutex *lock, int locked, int shared) {
+   struct bench_thread *t;
+   struct completion    go;
+   u64                  ns  = 0;
+   int                  err = 0;
+   int                  i;
+
+   t = kcalloc(nthreads, sizeof(*t), GFP_KERNEL);
+   if (t == NULL) return 0;
+
+   init_completion(&go);
+   for (i = 0; i < nthreads; i++) {
+      struct task_struct *task;
+
+      t[i].v    = v;
+      t[i].uid  = KUIDT_INIT(shared ? 1000 : 1000 + i);
+      t[i].lock   = lock;
+      t[i].locked = locked;
+      t[i].go   = &go;
+      init_completion(&t[i].done);
+
+      task = kthread_run(fn, &t[i], "pwd_vault_bench/%d", i);
+      if (IS_ERR(task)) {
+         t[i].err = PTR_ERR(task);
+         complete(&t[i].done);
+      }
+   }
+
+   /* release the threads together and wait for the last to finish */
+   ns = ktime_get_ns();
+   complete_all(&go);
+   for (i = 0; i < nthreads; i++) {
+      wait_for_completion(&t[i].done);
+      if (t[i].err) err = t[i].err;
+   }
+   ns = ktime_get_ns() - ns;
+
+   kfree(t);
+
+   if (err) {
+      printk(KERN_WARNING "pwd_vault_bench: threads failed (%d)\n", err);
+      return 0;
+   }
+
+   return ns;
+}
+
+/* time_contention:  times nthreads users contending for the global lock, or
+ *                   for their own locks; returns 0 on failure              */
+static u64 time_contention(int nthreads, int global) {
+   struct pwd_vault v;
+   u64              ns;
+
+   if (!initialize_vault(&v, nthreads, bench_hints)) return 0;
+
+   ns = run_threads(&v, nthreads, contend, global ? &bench_lock : NULL,
+                    FALSE, FALSE);
+
+   finalize_vault(&v);
+   return ns;
+}
+
+/* time_readers:  times nthreads readers of one user's hints, with a writer
+ *                churning that user's pairs throughout; the readers take
+ *                the user's lock if locked is TRUE.  Returns 0 on failure. */
+static u64 time_readers(int nthreads, int locked) {
+   struct pwd_vault     v;
+   struct bench_thread  w = { .v = &v, .uid = KUIDT_INIT(1000) };
+   struct task_struct  *task;
+   u64                  ns = 0;
+
+   if (!initialize_vault(&v, 1, bench_hints)) return 0;
+
+   /* the readers' user holds bench_pairs pairs under each of its hints */
+   if (fill_vault(&v, bench_hints * bench_pairs, 8) != 0) goto out;
+
+   init_completion(&w.done);
+   WRITE_ONCE(bench_stop, FALSE);
+   task = kthread_run(churn, &w, "pwd_vault_bench/w");
+   if (IS_ERR(task)) goto out;
+
+   ns = run_threads(&v, nthreads, lookup, NULL, locked, TRUE);
+
+   WRITE_ONCE(bench_stop, TRUE);
+   wait_for_completion(&w.done);
+   if (w.err) ns = 0;
+
+ out:
+   finalize_vault(&v);
+   return ns;
+}
+
+/* time_restore:  fills a vault with n pairs, timing the inserts in *fill,
+ *                then restores a second vault from an image of the first,
+ *                timing the load in *load; returns 0 or an error          */
+static int time_restore(int n, u64 *fill, u64 *load) {
+   struct pwd_vault v, w;
+   int              users = ((n + bench_pairs - 1) / bench_pairs +
+                             bench_hints - 1) / bench_hints;
+   size_t           size;
+   char            *img = NULL;
+   int              cnt = 0;
+   int              rc  = -ENOMEM;
+   u64              t;
+
+   if (!initialize_vault(&v, users, bench_hints)) return -ENOMEM;
+   if (!initialize_vault(&w, users, bench_hints)) goto out_v;
+
+   t     = ktime_get_ns();
+   rc    = fill_vault(&v, n, 8);
+   *fill = ktime_get_ns() - t;
+   if (rc) goto out_w;
+
+   rc   = -ENOMEM;
+   size = save_vault(&v, NULL, 0);
+   img  = kvmalloc(size, GFP_KERNEL);
+   if (img == NULL || save_vault(&v, img, size) != size) goto out_w;
+
+   t     = ktime_get_ns();
+   rc    = load_vault(&w, img, size);
+   *load = ktime_get_ns() - t;
+   if (rc) goto out_w;
+
+   walk_vault(&w, FORWARD, count_pair, &cnt);
+   if (cnt != n) {
+      printk(KERN_WARNING "pwd_vault_bench: restored %d of %d pairs\n", cnt, n);
+   }
+
+ out_w:
+   kvfree(img);
+   finalize_vault(&w);
+ out_v:
+   finalize_vault(&v);
+   return rc;
+}
+
+/* the pwd lengths the memory table is reported for */
+static const int bench_plens[] = { 8, HPW_INLINE_PWD - 1, 24, 64 };
+
+/* measure_bytes:  fills a vault with n pairs of pwds plen long and returns
+ *                 the bytes its users are charged, or 0 on failure        */
+static size_t measure_bytes(int n, int plen) {
+   struct pwd_vault v;
+   int              users = ((n + bench_pairs - 1) / bench_pairs +
+                             bench_hints - 1) / bench_hints;
+   size_t           bytes = 0;
+   int              i;
+
+   if (!initialize_vault(&v, users, bench_hints)) return 0;
+
+   if (fill_vault(&v, n, plen) == 0) {
+      for (i = 0; i < users; i++) bytes += num_bytes(&v, KUIDT_INIT(1000 + i));
+   }
+
+   finalize_vault(&v);
+   return bytes;
+}
+
+static int __init pwd_vault_bench_init(void) {
+   int n;
+
+   if (bench_pairs < 1 || bench_hints < 1 || bench_min < 1 ||
+       bench_max < bench_min || bench_threads < 0 || bench_ops < 1) {
+      return -EINVAL;
+   }
+
+   printk(KERN_INFO "pwd_vault_bench: %10s %12s %8s %12s %8s\n", "pairs",
+          "forward ns", "ns/pair", "reverse ns", "ns/pair");
+
+   for (n = bench_min; n <= bench_max; n *= 2) {
+      struct pwd_vault v;
+      int              hints = (n + bench_pairs - 1) / bench_pairs;
+      u64              fwd, rev;
+      int              rc;
+
+      if (!initialize_vault(&v, (hints + bench_hints - 1) / bench_hints,
+                            bench_hints)) {
+         return -ENOMEM;
+      }
+
+      rc = fill_vault(&v, n, 8);
+      if (rc == 0) {
+         fwd = time_walk(&v, FORWARD, n);
+         rev = time_walk(&v, REVERSE, n);
+
+         printk(KERN_INFO "pwd_vault_bench: %10d %12llu %8llu %12llu %8llu\n",
+                n, fwd, fwd / n, rev, rev / n);
+      }
+
+      finalize_vault(&v);
+      if (rc) return rc;
+   }
+
+   if (bench_threads == 0) bench_threads = num_online_cpus();
+
+   printk(KERN_INFO "pwd_vault_bench: %10s %12s %8s %12s %8s\n", "threads",
+          "global ns", "ns/op", "per-user ns", "ns/op");
+
+   /* double the threads, ending with exactly bench_threads */
+   for (n = 1; ; n = min(2 * n, bench_threads)) {
+      u64 ops = (u64) n * bench_ops;
+      u64 glo = time_contention(n, TRUE);
+      u64 own = time_contention(n, FALSE);
+
+      if (glo == 0 || own == 0) return -ENOMEM;
+
+      printk(KERN_INFO "pwd_vault_bench: %10d %12llu %8llu %12llu %8llu\n",
+             n, glo, glo / ops, own, own / ops);
+
+      if (n == bench_threads) break;
+   }
+
+   printk(KERN_INFO "pwd_vault_bench: %10s %12s %8s %12s %8s\n", "readers",
+          "locked ns", "ns/op", "rcu ns", "ns/op");
+
+   for (n = 1; ; n = min(2 * n, bench_threads)) {
+      u64 ops = (u64) n * bench_ops;
+      u64 lck = time_readers(n, TRUE);
+      u64 rcu = time_readers(n, FALSE);
+
+      if (lck == 0 || rcu == 0) return -ENOMEM;
+
+      printk(KERN_INFO "pwd_vault_bench: %10d %12llu %8llu %12llu %8llu\n",
+             n, lck, lck / ops, rcu, rcu / ops);
+
+      if (n == bench_threads) break;
+   }
+
+   printk(KERN_INFO "pwd_vault_bench: %10s %12s %8s %12s %8s\n", "pairs",
+          "insert ns", "ns/pair", "restore ns", "ns/pair");
+
+   for (n = bench_min; n <= bench_max; n *= 2) {
+      u64 fill, load;
+      int rc = time_restore(n, &fill, &load);
+
+      if (rc) return rc;
+
+      printk(KERN_INFO "pwd_vault_bench: %10d %12llu %8llu %12llu %8llu\n",
+             n, fill, fill / n, load, load / n);
+   }
+
+   printk(KERN_INFO "pwd_vault_bench: %10s %12s %8s %12s %8s\n", "pairs",
+          "pwd length", "", "bytes", "B/pair");
+
+   for (n = 0; n < ARRAY_SIZE(bench_plens); n++) {
+      size_t bytes = measure_bytes(bench_max, bench_plens[n]);
+
+      if (bytes == 0) return -ENOMEM;
+
+      printk(KERN_INFO "pwd_vault_bench: %10d %12d %8s %12zu %8zu\n",
+             bench_max, bench_plens[n], "", bytes, bytes / bench_max);
+   }
+
+   return 0;
+}
+
+static void __exit pwd_vault_bench_exit(void) {
+}
+
+module_init(pwd_vault_bench_init);
+module_exit(pwd_vault_bench_exit);
@@ -8,9 +8,10 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <string.h>
+#include "pwd_vault.h"
 
 #define  MAX_USERS 20
-#define  BUF_SIZE  80
+#define  BUF_SIZE  (MAX_HINT_PWD_SIZE)
 
 int main () {
 	char buf[BUF_SIZE];
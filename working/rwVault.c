@@ -11,15 +11,16 @@
 #include <string.h>
 #include "pwd_vault.h"
 
-#define  BUF_SIZE  80
+#define  BUF_SIZE  (MAX_HINT_PWD_SIZE)
 
 #define HW4MOD_IOC_MAGIC  'k'
 #define HW4MOD_IOCSKEY     _IOW (HW4MOD_IOC_MAGIC,   1, char)
+#define HW4MOD_IOCDELETE   _IO  (HW4MOD_IOC_MAGIC,   6)
 
 int main () {
 	char buf[BUF_SIZE];
-   char hint[MAX_HINT_SIZE] = "";
-   char pwd[MAX_PWD_SIZE];
+   char hint[MAX_HINT_SIZE+1] = "";
+   char pwd[MAX_PWD_SIZE+1];
 	int  fd;
 	int  count = BUF_SIZE;
 
@@ -55,9 +56,8 @@ int main () {
 	while (rc = read(fd, buf, count)) {
 		if (rc > 0) {
 			if (i % 2) {
-				ioctl(fd, HW4MOD_IOCSKEY, buf);
-				rc = lseek(fd, 0, 0);
-				if (rc) write(fd, "", 1);
+				/* delete the password just read, where it lies */
+				if (ioctl(fd, HW4MOD_IOCDELETE) == -1) perror("delete");
 			} else {
 				printf("Key %2d:  %s\n", i, buf);
 			}
@@ -0,0 +1,74 @@
+/* Author:  Keith Shomper
+ * Date:    1 Nov 2017
+ * Purpose: Follows the vault journal, printing each change to a vault as it
+ *          is made.  An optional argument is the seq to resume from.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#define MAX_HINT_SIZE 255
+#define MAX_PWD_SIZE  255
+
+/*
+ * Journal record layout, as the journal device reads it
+ */
+
+struct hw4mod_jrec {
+	uint64_t seq;
+	uint32_t uid;
+	uint8_t  op;
+	uint8_t  dev;
+	uint8_t  hlen;
+	uint8_t  plen;
+	char     hint[MAX_HINT_SIZE];
+	char     pwd[MAX_PWD_SIZE];
+};
+
+int main (int argc, char *argv[]) {
+	struct hw4mod_jrec rec[64];
+	ssize_t n;
+	int     fd;
+	int     i;
+
+   if ((fd = open ("/dev/hw4mod_journal", O_RDONLY)) == -1) {
+     perror("opening file");
+     return -1;
+   }
+
+	if (argc > 1 && lseek(fd, strtoull(argv[1], NULL, 0), SEEK_SET) == -1) {
+		perror("lseek");
+		return -1;
+	}
+
+	for (;;) {
+		n = read(fd, rec, sizeof(rec));
+
+		/* the journal overwrote records we had not read; go on from the oldest */
+		if (n == -1 && errno == EPIPE) {
+			fprintf(stderr, "journal overrun, resuming at %lld\n",
+			        (long long) lseek(fd, 0, SEEK_CUR));
+			continue;
+		}
+		if (n <= 0) {
+			perror("read");
+			break;
+		}
+
+		for (i = 0; i < n / sizeof(rec[0]); i++) {
+			printf("%llu  hw4mod%u  uid %u  %s  %.*s %.*s\n",
+			       (unsigned long long) rec[i].seq, rec[i].dev, rec[i].uid,
+			       rec[i].op == 0 ? "insert" : "delete",
+			       rec[i].hlen, rec[i].hint, rec[i].plen, rec[i].pwd);
+		}
+		fflush(stdout);
+	}
+
+   close(fd);
+
+   return 0;
+}
@@ -0,0 +1 @@
+#include "../ushim.h"
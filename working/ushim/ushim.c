@@ -0,0 +1,302 @@
+/* Author:  Keith Shomper
+ * Date:    8 Nov 2016
+ * Purpose: The out-of-line half of the userspace kernel shim, see ushim.h
+ */
+
+#include <stdarg.h>
+#include <sys/random.h>
+
+#include "ushim.h"
+
+FILE *ushim_log;
+
+/* printk:  prints to ushim_log, or stderr if the program has not set it */
+int printk(const char *fmt, ...) {
+   va_list ap;
+   int     n;
+
+   va_start(ap, fmt);
+   n = vfprintf(ushim_log != NULL ? ushim_log : stderr, fmt, ap);
+   va_end(ap);
+
+   return n;
+}
+
+/* get_random_bytes:  fills buf from the system's random source */
+void get_random_bytes(void *buf, size_t n) {
+   char    *p = buf;
+   ssize_t  got;
+
+   while (n > 0) {
+      got = getrandom(p, n, 0);
+      if (got <= 0) {
+         if (got < 0 && errno == EINTR) continue;
+         abort();
+      }
+      p += got;
+      n -= got;
+   }
+}
+
+/*
+ * RCU: readers hold ushim_rcu_lock shared, so a grace period has passed
+ * once a writer has held it exclusively.  call_rcu queues its callback for
+ * a background thread, which takes the queue, waits out a grace period and
+ * runs the callbacks.  A callback "address" below 4096 is instead the
+ * offset of the rcu_head in an object kvfree_rcu is to free.
+ */
+pthread_rwlock_t ushim_rcu_lock = PTHREAD_RWLOCK_INITIALIZER;
+__thread int     ushim_rcu_nest;
+
+#define RCU_MAX_OFFSET 4096
+
+static struct {
+   pthread_mutex_t  lock;
+   pthread_cond_t   cond;
+   struct rcu_head *head;      /* callbacks not yet taken by the thread */
+   unsigned long    queued;    /* callbacks ever queued                 */
+   unsigned long    done;      /* callbacks ever run                    */
+   int              started;
+} rcu = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* rcu_thread:  runs queued callbacks once a grace period has passed */
+static void *rcu_thread(void *arg) {
+   struct rcu_head *list, *next;
+   unsigned long    n;
+
+   for (;;) {
+      pthread_mutex_lock(&rcu.lock);
+      while (rcu.head == NULL) pthread_cond_wait(&rcu.cond, &rcu.lock);
+      list     = rcu.head;
+      rcu.head = NULL;
+      pthread_mutex_unlock(&rcu.lock);
+
+      synchronize_rcu();
+
+      for (n = 0; list != NULL; list = next, n++) {
+         uintptr_t off = (uintptr_t) list->func;
+
+         next = list->next;
+         if (off < RCU_MAX_OFFSET) free((char *) list - off);
+         else                      list->func(list);
+      }
+
+      pthread_mutex_lock(&rcu.lock);
+      rcu.done += n;
+      pthread_cond_broadcast(&rcu.cond);
+      pthread_mutex_unlock(&rcu.lock);
+   }
+
+   return NULL;
+}
+
+/* ushim_call_rcu:  queues func to run on head after a grace period */
+void ushim_call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *)) {
+   pthread_t t;
+
+   pthread_mutex_lock(&rcu.lock);
+   if (!rcu.started && pthread_create(&t, NULL, rcu_thread, NULL) == 0) {
+      pthread_detach(t);
+      rcu.started = 1;
+   }
+
+   head->func = func;
+   head->next = rcu.head;
+   rcu.head   = head;
+   rcu.queued++;
+
+   pthread_cond_broadcast(&rcu.cond);
+   pthread_mutex_unlock(&rcu.lock);
+}
+
+/* ushim_free_rcu:  frees the object head is offset bytes into after a
+ *                  grace period                                          */
+void ushim_free_rcu(struct rcu_head *head, size_t offset) {
+   ushim_call_rcu(head, (void (*)(struct rcu_head *)) (uintptr_t) offset);
+}
+
+/* rcu_barrier:  waits for every callback queued so far to have run */
+void rcu_barrier(void) {
+   unsigned long want;
+
+   pthread_mutex_lock(&rcu.lock);
+   want = rcu.queued;
+   while (rcu.done < want) pthread_cond_wait(&rcu.cond, &rcu.lock);
+   pthread_mutex_unlock(&rcu.lock);
+}
+
+/*
+ * SipHash-2-4
+ */
+#define ROTL64(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND(v0, v1, v2, v3) do {                                       \
+   v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32);            \
+   v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;                                 \
+   v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;                                 \
+   v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32);            \
+} while (0)
+
+u64 siphash(const void *data, size_t len, const siphash_key_t *key) {
+   const u8 *p    = data;
+   const u8 *end  = p + (len & ~(size_t) 7);
+   u64       v0   = 0x736f6d6570736575ULL ^ key->key[0];
+   u64       v1   = 0x646f72616e646f6dULL ^ key->key[1];
+   u64       v2   = 0x6c7967656e657261ULL ^ key->key[0];
+   u64       v3   = 0x7465646279746573ULL ^ key->key[1];
+   u64       b    = (u64) len << 56;
+   u64       m;
+
+   for (; p != end; p += 8) {
+      memcpy(&m, p, sizeof(m));
+      v3 ^= m;
+      SIPROUND(v0, v1, v2, v3);
+      SIPROUND(v0, v1, v2, v3);
+      v0 ^= m;
+   }
+
+   switch (len & 7) {
+   case 7: b |= (u64) p[6] << 48; /* fall through */
+   case 6: b |= (u64) p[5] << 40; /* fall through */
+   case 5: b |= (u64) p[4] << 32; /* fall through */
+   case 4: b |= (u64) p[3] << 24; /* fall through */
+   case 3: b |= (u64) p[2] << 16; /* fall through */
+   case 2: b |= (u64) p[1] <<  8; /* fall through */
+   case 1: b |= (u64) p[0];
+   }
+
+   v3 ^= b;
+   SIPROUND(v0, v1, v2, v3);
+   SIPROUND(v0, v1, v2, v3);
+   v0 ^= b;
+   v2 ^= 0xff;
+   SIPROUND(v0, v1, v2, v3);
+   SIPROUND(v0, v1, v2, v3);
+   SIPROUND(v0, v1, v2, v3);
+   SIPROUND(v0, v1, v2, v3);
+
+   return (v0 ^ v1) ^ (v2 ^ v3);
+}
+
+/*
+ * xarray
+ */
+
+/* xa_pos:  the position of the first entry whose index is not below index */
+static size_t xa_pos(struct xarray *xa, unsigned long index) {
+   size_t lo = 0, hi = xa->n;
+
+   while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+
+      if (xa->a[mid].index < index) lo = mid + 1;
+      else                          hi = mid;
+   }
+   return lo;
+}
+
+void xa_init_flags(struct xarray *xa, unsigned int flags) {
+   pthread_mutex_init(&xa->lock, NULL);
+   pthread_rwlock_init(&xa->rw, NULL);
+   xa->a   = NULL;
+   xa->n   = 0;
+   xa->cap = 0;
+}
+
+void xa_destroy(struct xarray *xa) {
+   free(xa->a);
+   xa->a   = NULL;
+   xa->n   = 0;
+   xa->cap = 0;
+}
+
+void *xa_load(struct xarray *xa, unsigned long index) {
+   void   *entry = NULL;
+   size_t  i;
+
+   pthread_rwlock_rdlock(&xa->rw);
+   i = xa_pos(xa, index);
+   if (i < xa->n && xa->a[i].index == index) entry = xa->a[i].entry;
+   pthread_rwlock_unlock(&xa->rw);
+
+   return entry;
+}
+
+/* __xa_insert:  stores entry at index, with xa_lock held; -EBUSY if taken */
+int __xa_insert(struct xarray *xa, unsigned long index, void *entry,
+                gfp_t gfp) {
+   size_t i   = xa_pos(xa, index);
+   int    err = 0;
+
+   if (i < xa->n && xa->a[i].index == index) return -EBUSY;
+
+   pthread_rwlock_wrlock(&xa->rw);
+   if (xa->n == xa->cap) {
+      size_t           cap = xa->cap ? 2 * xa->cap : 8;
+      struct xa_entry *a   = realloc(xa->a, cap * sizeof(*a));
+
+      if (a == NULL) {
+         err = -ENOMEM;
+         goto out;
+      }
+      xa->a   = a;
+      xa->cap = cap;
+   }
+
+   memmove(&xa->a[i + 1], &xa->a[i], (xa->n - i) * sizeof(xa->a[0]));
+   xa->a[i].index = index;
+   xa->a[i].entry = entry;
+   xa->n++;
+
+  out:
+   pthread_rwlock_unlock(&xa->rw);
+   return err;
+}
+
+/* __xa_erase:  removes and returns the entry at index, with xa_lock held */
+void *__xa_erase(struct xarray *xa, unsigned long index) {
+   size_t  i     = xa_pos(xa, index);
+   void   *entry = NULL;
+
+   if (i == xa->n || xa->a[i].index != index) return NULL;
+
+   pthread_rwlock_wrlock(&xa->rw);
+   entry = xa->a[i].entry;
+   memmove(&xa->a[i], &xa->a[i + 1], (xa->n - i - 1) * sizeof(xa->a[0]));
+   xa->n--;
+   pthread_rwlock_unlock(&xa->rw);
+
+   return entry;
+}
+
+/* xa_find:  the first entry at or after *index, up to max, which it stores
+ *           in *index                                                   */
+void *xa_find(struct xarray *xa, unsigned long *index, unsigned long max,
+              int filter) {
+   void   *entry = NULL;
+   size_t  i;
+
+   pthread_rwlock_rdlock(&xa->rw);
+   i = xa_pos(xa, *index);
+   if (i < xa->n && xa->a[i].index <= max) {
+      *index = xa->a[i].index;
+      entry  = xa->a[i].entry;
+   }
+   pthread_rwlock_unlock(&xa->rw);
+
+   return entry;
+}
+
+/* xa_find_after:  as xa_find, but for the first entry after *index */
+void *xa_find_after(struct xarray *xa, unsigned long *index,
+                    unsigned long max, int filter) {
+   unsigned long next = *index + 1;
+   void         *entry;
+
+   if (*index == ULONG_MAX) return NULL;
+
+   entry = xa_find(xa, &next, max, filter);
+   if (entry != NULL) *index = next;
+
+   return entry;
+}
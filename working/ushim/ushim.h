@@ -0,0 +1,637 @@
+/* Author:  Keith Shomper
+ * Date:    8 Nov 2016
+ * Purpose: The few kernel interfaces pwd_vault.c uses, built on libc and
+ *          pthreads, so the vault can be compiled and timed in userspace.
+ *          The headers under linux/ only include this file.
+ *
+ *          RCU is modelled with one rwlock that readers hold shared; a
+ *          grace period is taking it exclusively, and a background thread
+ *          runs the callbacks queued by call_rcu once one has passed.
+ */
+
+#ifndef _USHIM_H_
+#define _USHIM_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/types.h>
+
+/*
+ * Types and annotations
+ */
+typedef uint8_t            u8;
+typedef uint16_t           u16;
+typedef uint32_t           u32;
+typedef unsigned long long u64;
+typedef long long          s64;
+typedef unsigned int       gfp_t;
+typedef unsigned int       slab_flags_t;
+
+#define __rcu
+#define __user
+#define __init
+#define __exit
+#define __must_check
+#define likely(x)               (x)
+#define unlikely(x)             (x)
+
+#define EXPORT_SYMBOL(sym)
+#define EXPORT_SYMBOL_GPL(sym)
+
+#define container_of(p, t, m)   ((t *) ((char *) (p) - offsetof(t, m)))
+#define ARRAY_SIZE(a)           (sizeof(a) / sizeof((a)[0]))
+#define ALIGN(x, a)             (((x) + (a) - 1) & ~((typeof(x)) (a) - 1))
+#define min(a, b)               ((a) < (b) ? (a) : (b))
+#define max(a, b)               ((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)          ((t) (a) < (t) (b) ? (t) (a) : (t) (b))
+#define max_t(t, a, b)          ((t) (a) > (t) (b) ? (t) (a) : (t) (b))
+#define struct_size(p, m, n)    (sizeof(*(p)) + sizeof((p)->m[0]) * (n))
+#define BUILD_BUG_ON(c)         ((void) sizeof(char[1 - 2 * !!(c)]))
+#define WARN_ON(c)              (c)
+#define WARN_ON_ONCE(c)         (c)
+
+#define lockdep_is_held(l)      1
+#define lockdep_assert_held(l)  ((void) 0)
+
+/*
+ * Memory ordering; READ_ONCE acquires, which is stronger than the kernel's
+ * dependency ordering but the nearest thing C11 offers
+ */
+#define READ_ONCE(x)            __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define WRITE_ONCE(x, v)        __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define smp_load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define smp_rmb()               __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb()               __atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_mb()                __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/*
+ * printk goes to ushim_log, stderr unless the program points it elsewhere
+ */
+#define KERN_ERR     ""
+#define KERN_WARNING ""
+#define KERN_NOTICE  ""
+#define KERN_INFO    ""
+#define KERN_DEBUG   ""
+
+extern FILE *ushim_log;
+int printk(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/*
+ * Allocation; the gfp flags and slab flags are accepted and ignored
+ */
+#define GFP_KERNEL          0x01u
+#define GFP_ATOMIC          0x02u
+#define GFP_NOWAIT          0x04u
+#define __GFP_ZERO          0x08u
+#define __GFP_NOWARN        0x10u
+#define __GFP_ACCOUNT       0x20u
+#define GFP_KERNEL_ACCOUNT  (GFP_KERNEL | __GFP_ACCOUNT)
+
+#define SLAB_HWCACHE_ALIGN  0x01u
+#define SLAB_ACCOUNT        0x02u
+#define SLAB_NO_MERGE       0x04u
+#define SLAB_PANIC          0x08u
+
+static inline void *kmalloc(size_t n, gfp_t gfp) {
+   return (gfp & __GFP_ZERO) ? calloc(1, n) : malloc(n);
+}
+
+static inline void *kzalloc(size_t n, gfp_t gfp) {
+   return calloc(1, n);
+}
+
+static inline void *kmalloc_array(size_t n, size_t size, gfp_t gfp) {
+   size_t bytes;
+
+   if (__builtin_mul_overflow(n, size, &bytes)) return NULL;
+   return kmalloc(bytes, gfp);
+}
+
+static inline void *kcalloc(size_t n, size_t size, gfp_t gfp) {
+   return calloc(n, size);
+}
+
+static inline void kfree(const void *p) {
+   free((void *) p);
+}
+
+#define kvmalloc(n, gfp)              kmalloc(n, gfp)
+#define kvzalloc(n, gfp)              kzalloc(n, gfp)
+#define kvmalloc_array(n, size, gfp)  kmalloc_array(n, size, gfp)
+#define kvcalloc(n, size, gfp)        kcalloc(n, size, gfp)
+#define kvfree(p)                     kfree(p)
+#define vmalloc(n)                    malloc(n)
+#define vzalloc(n)                    calloc(1, n)
+#define vfree(p)                      kfree(p)
+
+struct kmem_cache {
+   const char *name;
+   size_t      size;
+};
+
+static inline struct kmem_cache *kmem_cache_create(const char *name,
+                                                   unsigned int size,
+                                                   unsigned int align,
+                                                   slab_flags_t flags,
+                                                   void (*ctor)(void *)) {
+   struct kmem_cache *c = malloc(sizeof(*c));
+
+   if (c != NULL) {
+      c->name = name;
+      c->size = size;
+   }
+   return c;
+}
+
+#define KMEM_CACHE(s, flags) \
+   kmem_cache_create(#s, sizeof(struct s), __alignof__(struct s), (flags), NULL)
+
+static inline void kmem_cache_destroy(struct kmem_cache *c) {
+   free(c);
+}
+
+static inline void *kmem_cache_alloc(struct kmem_cache *c, gfp_t gfp) {
+   return kmalloc(c->size, gfp);
+}
+
+static inline void *kmem_cache_zalloc(struct kmem_cache *c, gfp_t gfp) {
+   return calloc(1, c->size);
+}
+
+static inline void kmem_cache_free(struct kmem_cache *c, void *p) {
+   free(p);
+}
+
+static inline void kmem_cache_free_bulk(struct kmem_cache *c, size_t n,
+                                        void **p) {
+   size_t i;
+
+   for (i = 0; i < n; i++) free(p[i]);
+}
+
+static inline int kmem_cache_alloc_bulk(struct kmem_cache *c, gfp_t gfp,
+                                        size_t n, void **p) {
+   size_t i;
+
+   for (i = 0; i < n; i++) {
+      p[i] = kmalloc(c->size, gfp);
+      if (p[i] == NULL) {
+         kmem_cache_free_bulk(c, i, p);
+         return 0;
+      }
+   }
+   return (int) n;
+}
+
+static inline void cond_resched(void) {
+}
+
+void get_random_bytes(void *buf, size_t n);
+
+/*
+ * Wait queues, on which no one ever sleeps in userspace
+ */
+typedef struct { int unused; } wait_queue_head_t;
+struct fasync_struct;
+
+#define EPOLLIN      0x001u
+#define EPOLLOUT     0x004u
+#define EPOLLRDNORM  0x040u
+#define EPOLLWRNORM  0x100u
+
+static inline void init_waitqueue_head(wait_queue_head_t *q) {
+}
+
+static inline int wq_has_sleeper(wait_queue_head_t *q) {
+   return 0;
+}
+
+static inline void wake_up_interruptible_poll(wait_queue_head_t *q,
+                                              unsigned int events) {
+}
+
+/*
+ * Per-CPU data: a program is one CPU, so each per-CPU object is a single
+ * copy that the this_cpu ops update atomically
+ */
+#define __percpu
+#define alloc_percpu(t)             ((t *) kzalloc(sizeof(t), GFP_KERNEL))
+#define free_percpu(p)              kfree(p)
+#define per_cpu_ptr(p, cpu)         (p)
+#define for_each_possible_cpu(cpu)  for ((cpu) = 0; (cpu) < 1; (cpu)++)
+#define this_cpu_add(x, v)          __atomic_fetch_add(&(x), (v), __ATOMIC_RELAXED)
+#define this_cpu_sub(x, v)          __atomic_fetch_sub(&(x), (v), __ATOMIC_RELAXED)
+#define this_cpu_inc(x)             this_cpu_add(x, 1)
+#define this_cpu_dec(x)             this_cpu_sub(x, 1)
+
+/*
+ * Locks
+ */
+struct mutex {
+   pthread_mutex_t m;
+};
+
+#define DEFINE_MUTEX(name) struct mutex name = { PTHREAD_MUTEX_INITIALIZER }
+
+static inline void mutex_init(struct mutex *l)    { pthread_mutex_init(&l->m, NULL); }
+static inline void mutex_destroy(struct mutex *l) { pthread_mutex_destroy(&l->m); }
+static inline void mutex_lock(struct mutex *l)    { pthread_mutex_lock(&l->m); }
+static inline void mutex_unlock(struct mutex *l)  { pthread_mutex_unlock(&l->m); }
+static inline int  mutex_trylock(struct mutex *l) {
+   return pthread_mutex_trylock(&l->m) == 0;
+}
+static inline int  mutex_lock_interruptible(struct mutex *l) {
+   pthread_mutex_lock(&l->m);
+   return 0;
+}
+
+typedef struct {
+   pthread_mutex_t m;
+} spinlock_t;
+
+#define DEFINE_SPINLOCK(name) spinlock_t name = { PTHREAD_MUTEX_INITIALIZER }
+
+static inline void spin_lock_init(spinlock_t *l) { pthread_mutex_init(&l->m, NULL); }
+static inline void spin_lock(spinlock_t *l)      { pthread_mutex_lock(&l->m); }
+static inline void spin_unlock(spinlock_t *l)    { pthread_mutex_unlock(&l->m); }
+
+typedef struct {
+   unsigned int sequence;
+} seqcount_t;
+
+typedef seqcount_t seqcount_mutex_t;
+typedef seqcount_t seqcount_spinlock_t;
+
+#define seqcount_init(s)               ((s)->sequence = 0)
+#define seqcount_mutex_init(s, lock)   seqcount_init(s)
+#define seqcount_spinlock_init(s, lock) seqcount_init(s)
+
+static inline unsigned int read_seqcount_begin(seqcount_t *s) {
+   unsigned int seq;
+
+   while ((seq = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE)) & 1) {
+      sched_yield();
+   }
+   return seq;
+}
+
+static inline int read_seqcount_retry(seqcount_t *s, unsigned int seq) {
+   __atomic_thread_fence(__ATOMIC_ACQUIRE);
+   return __atomic_load_n(&s->sequence, __ATOMIC_RELAXED) != seq;
+}
+
+static inline void write_seqcount_begin(seqcount_t *s) {
+   __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void write_seqcount_end(seqcount_t *s) {
+   __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * RCU
+ */
+struct rcu_head {
+   struct rcu_head *next;
+   void           (*func)(struct rcu_head *);
+};
+
+extern pthread_rwlock_t ushim_rcu_lock;
+extern __thread int     ushim_rcu_nest;
+
+void ushim_call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *));
+void ushim_free_rcu(struct rcu_head *head, size_t offset);
+void rcu_barrier(void);
+
+static inline void rcu_read_lock(void) {
+   if (ushim_rcu_nest++ == 0) pthread_rwlock_rdlock(&ushim_rcu_lock);
+}
+
+static inline void rcu_read_unlock(void) {
+   if (--ushim_rcu_nest == 0) pthread_rwlock_unlock(&ushim_rcu_lock);
+}
+
+static inline void synchronize_rcu(void) {
+   pthread_rwlock_wrlock(&ushim_rcu_lock);
+   pthread_rwlock_unlock(&ushim_rcu_lock);
+}
+
+#define call_rcu(head, func)  ushim_call_rcu(head, func)
+
+/* frees the object p once a grace period has passed, as the kernel does,
+ * by queuing its field f and the offset back to p                       */
+#define kvfree_rcu(p, f)      ushim_free_rcu(&(p)->f, offsetof(typeof(*(p)), f))
+#define kfree_rcu(p, f)       kvfree_rcu(p, f)
+
+#define rcu_dereference(p)              __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_dereference_check(p, c)     rcu_dereference(p)
+#define rcu_dereference_protected(p, c) (p)
+#define rcu_dereference_raw(p)          rcu_dereference(p)
+#define rcu_access_pointer(p)           __atomic_load_n(&(p), __ATOMIC_RELAXED)
+#define rcu_assign_pointer(p, v)        __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define RCU_INIT_POINTER(p, v)          ((p) = (v))
+
+/*
+ * Lists, with the _rcu variants publishing with release stores
+ */
+struct list_head {
+   struct list_head *next, *prev;
+};
+
+struct hlist_head {
+   struct hlist_node *first;
+};
+
+struct hlist_node {
+   struct hlist_node *next, **pprev;
+};
+
+#define LIST_POISON1 ((void *) 0x100)
+#define LIST_POISON2 ((void *) 0x122)
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+#define LIST_HEAD(name)      struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD(struct list_head *h) {
+   h->next = h;
+   h->prev = h;
+}
+
+static inline void __list_add(struct list_head *n, struct list_head *prev,
+                              struct list_head *next) {
+   next->prev = n;
+   n->next    = next;
+   n->prev    = prev;
+   prev->next = n;
+}
+
+static inline void list_add(struct list_head *n, struct list_head *h) {
+   __list_add(n, h, h->next);
+}
+
+static inline void list_add_tail(struct list_head *n, struct list_head *h) {
+   __list_add(n, h->prev, h);
+}
+
+static inline void __list_del(struct list_head *prev, struct list_head *next) {
+   next->prev = prev;
+   prev->next = next;
+}
+
+static inline void list_del(struct list_head *e) {
+   __list_del(e->prev, e->next);
+   e->next = LIST_POISON1;
+   e->prev = LIST_POISON2;
+}
+
+static inline void list_del_init(struct list_head *e) {
+   __list_del(e->prev, e->next);
+   INIT_LIST_HEAD(e);
+}
+
+static inline void list_move_tail(struct list_head *e, struct list_head *h) {
+   __list_del(e->prev, e->next);
+   list_add_tail(e, h);
+}
+
+static inline void list_replace(struct list_head *old, struct list_head *n) {
+   n->next       = old->next;
+   n->next->prev = n;
+   n->prev       = old->prev;
+   n->prev->next = n;
+}
+
+static inline int list_empty(const struct list_head *h) {
+   return h->next == h;
+}
+
+static inline int list_is_first(const struct list_head *e,
+                                const struct list_head *h) {
+   return e->prev == h;
+}
+
+static inline int list_is_last(const struct list_head *e,
+                               const struct list_head *h) {
+   return e->next == h;
+}
+
+static inline void list_splice_tail_init(struct list_head *l,
+                                         struct list_head *h) {
+   if (!list_empty(l)) {
+      struct list_head *first = l->next, *last = l->prev, *at = h->prev;
+
+      first->prev = at;
+      at->next    = first;
+      last->next  = h;
+      h->prev     = last;
+      INIT_LIST_HEAD(l);
+   }
+}
+
+#define list_entry(p, t, m)           container_of(p, t, m)
+#define list_first_entry(h, t, m)     list_entry((h)->next, t, m)
+#define list_last_entry(h, t, m)      list_entry((h)->prev, t, m)
+#define list_first_entry_or_null(h, t, m) \
+   (list_empty(h) ? NULL : list_first_entry(h, t, m))
+#define list_next_entry(p, m)         list_entry((p)->m.next, typeof(*(p)), m)
+#define list_prev_entry(p, m)         list_entry((p)->m.prev, typeof(*(p)), m)
+#define list_entry_is_head(p, h, m)   (&(p)->m == (h))
+
+#define list_for_each(p, h) \
+   for (p = (h)->next; p != (h); p = p->next)
+#define list_for_each_entry(p, h, m) \
+   for (p = list_first_entry(h, typeof(*(p)), m); \
+        !list_entry_is_head(p, h, m); p = list_next_entry(p, m))
+#define list_for_each_entry_reverse(p, h, m) \
+   for (p = list_last_entry(h, typeof(*(p)), m); \
+        !list_entry_is_head(p, h, m); p = list_prev_entry(p, m))
+#define list_for_each_entry_safe(p, n, h, m) \
+   for (p = list_first_entry(h, typeof(*(p)), m), n = list_next_entry(p, m); \
+        !list_entry_is_head(p, h, m); p = n, n = list_next_entry(n, m))
+#define list_for_each_entry_continue(p, h, m) \
+   for (p = list_next_entry(p, m); \
+        !list_entry_is_head(p, h, m); p = list_next_entry(p, m))
+#define list_for_each_entry_from(p, h, m) \
+   for (; !list_entry_is_head(p, h, m); p = list_next_entry(p, m))
+
+static inline void list_add_rcu(struct list_head *n, struct list_head *h) {
+   struct list_head *next = h->next;
+
+   n->next = next;
+   n->prev = h;
+   __atomic_store_n(&h->next, n, __ATOMIC_RELEASE);
+   next->prev = n;
+}
+
+static inline void list_add_tail_rcu(struct list_head *n, struct list_head *h) {
+   struct list_head *prev = h->prev;
+
+   n->next = h;
+   n->prev = prev;
+   __atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+   h->prev = n;
+}
+
+/* leaves e->next alone, so a reader standing on e can still walk on */
+static inline void list_del_rcu(struct list_head *e) {
+   struct list_head *prev = e->prev, *next = e->next;
+
+   next->prev = prev;
+   __atomic_store_n(&prev->next, next, __ATOMIC_RELEASE);
+   e->prev = LIST_POISON2;
+}
+
+#define list_entry_rcu(p, t, m) \
+   container_of(__atomic_load_n(&(p), __ATOMIC_ACQUIRE), t, m)
+#define list_first_or_null_rcu(h, t, m) ({                                   \
+   struct list_head *h__ = (h);                                              \
+   struct list_head *n__ = __atomic_load_n(&h__->next, __ATOMIC_ACQUIRE);    \
+   n__ != h__ ? container_of(n__, t, m) : NULL; })
+#define list_next_or_null_rcu(h, e, t, m) ({                                 \
+   struct list_head *h__ = (h);                                              \
+   struct list_head *n__ = __atomic_load_n(&(e)->next, __ATOMIC_ACQUIRE);    \
+   n__ != h__ ? container_of(n__, t, m) : NULL; })
+#define list_for_each_entry_rcu(p, h, m, ...) \
+   for (p = list_entry_rcu((h)->next, typeof(*(p)), m); \
+        &(p)->m != (h); p = list_entry_rcu((p)->m.next, typeof(*(p)), m))
+#define list_for_each_entry_from_rcu(p, h, m) \
+   for (; &(p)->m != (h); p = list_entry_rcu((p)->m.next, typeof(*(p)), m))
+#define list_for_each_entry_continue_rcu(p, h, m) \
+   for (p = list_entry_rcu((p)->m.next, typeof(*(p)), m); \
+        &(p)->m != (h); p = list_entry_rcu((p)->m.next, typeof(*(p)), m))
+
+#define INIT_HLIST_HEAD(h) ((h)->first = NULL)
+
+static inline void INIT_HLIST_NODE(struct hlist_node *n) {
+   n->next  = NULL;
+   n->pprev = NULL;
+}
+
+static inline int hlist_unhashed(const struct hlist_node *n) {
+   return n->pprev == NULL;
+}
+
+static inline int hlist_empty(const struct hlist_head *h) {
+   return h->first == NULL;
+}
+
+static inline void hlist_add_head_rcu(struct hlist_node *n,
+                                      struct hlist_head *h) {
+   struct hlist_node *first = h->first;
+
+   n->next  = first;
+   n->pprev = &h->first;
+   __atomic_store_n(&h->first, n, __ATOMIC_RELEASE);
+   if (first != NULL) first->pprev = &n->next;
+}
+
+static inline void hlist_del_rcu(struct hlist_node *n) {
+   struct hlist_node *next = n->next, **pprev = n->pprev;
+
+   __atomic_store_n(pprev, next, __ATOMIC_RELEASE);
+   if (next != NULL) next->pprev = pprev;
+   n->pprev = LIST_POISON2;
+}
+
+#define hlist_entry(p, t, m) container_of(p, t, m)
+#define hlist_entry_safe(p, t, m) ({                                         \
+   typeof(p) p__ = (p);                                                      \
+   p__ != NULL ? hlist_entry(p__, t, m) : NULL; })
+#define hlist_for_each_entry_rcu(p, h, m, ...)                               \
+   for (p = hlist_entry_safe(__atomic_load_n(&(h)->first, __ATOMIC_ACQUIRE), \
+                             typeof(*(p)), m);                               \
+        p != NULL;                                                           \
+        p = hlist_entry_safe(__atomic_load_n(&(p)->m.next, __ATOMIC_ACQUIRE),\
+                             typeof(*(p)), m))
+
+/*
+ * Users
+ */
+typedef struct {
+   uid_t val;
+} kuid_t;
+
+#define KUIDT_INIT(v) ((kuid_t) { (uid_t) (v) })
+
+static inline uid_t __kuid_val(kuid_t uid)       { return uid.val; }
+static inline bool  uid_eq(kuid_t a, kuid_t b)   { return a.val == b.val; }
+
+/*
+ * SipHash-2-4, as lib/siphash.c computes it
+ */
+typedef struct {
+   u64 key[2];
+} siphash_key_t;
+
+u64 siphash(const void *data, size_t len, const siphash_key_t *key);
+
+/*
+ * xarray, as a sorted array of indexes; readers look entries up under a
+ * rwlock rather than RCU, since growing the array moves it
+ */
+struct xa_entry {
+   unsigned long  index;
+   void          *entry;
+};
+
+struct xarray {
+   pthread_mutex_t   lock;     /* xa_lock, held by writers          */
+   pthread_rwlock_t  rw;       /* held exclusive while a writer changes a */
+   struct xa_entry  *a;
+   size_t            n, cap;
+};
+
+#define XA_PRESENT      1
+#define XA_FLAGS_ALLOC  0
+
+#define xa_lock(xa)     pthread_mutex_lock(&(xa)->lock)
+#define xa_unlock(xa)   pthread_mutex_unlock(&(xa)->lock)
+
+void  xa_init_flags(struct xarray *xa, unsigned int flags);
+void  xa_destroy   (struct xarray *xa);
+void *xa_load      (struct xarray *xa, unsigned long index);
+int   __xa_insert  (struct xarray *xa, unsigned long index, void *entry,
+                    gfp_t gfp);
+void *__xa_erase   (struct xarray *xa, unsigned long index);
+void *xa_find      (struct xarray *xa, unsigned long *index,
+                    unsigned long max, int filter);
+void *xa_find_after(struct xarray *xa, unsigned long *index,
+                    unsigned long max, int filter);
+
+#define xa_init(xa)     xa_init_flags(xa, 0)
+
+static inline int xa_insert(struct xarray *xa, unsigned long index,
+                            void *entry, gfp_t gfp) {
+   int err;
+
+   xa_lock(xa);
+   err = __xa_insert(xa, index, entry, gfp);
+   xa_unlock(xa);
+   return err;
+}
+
+static inline void *xa_erase(struct xarray *xa, unsigned long index) {
+   void *entry;
+
+   xa_lock(xa);
+   entry = __xa_erase(xa, index);
+   xa_unlock(xa);
+   return entry;
+}
+
+#define xa_for_each(xa, index, entry)                                        \
+   for (index = 0, entry = xa_find(xa, &index, ULONG_MAX, XA_PRESENT);       \
+        entry != NULL;                                                       \
+        entry = xa_find_after(xa, &index, ULONG_MAX, XA_PRESENT))
+
+#endif /* _USHIM_H_ */
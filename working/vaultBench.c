@@ -0,0 +1,248 @@
+/* Author:  Keith Shomper
+ * Date:    8 Nov 2016
+ * Purpose: Times the pwd_vault operations in userspace, built against the
+ *          kernel shim in ushim/ with "make vaultBench", so no module need
+ *          be loaded.  For vaults of 10^2 up to max records it reports the
+ *          throughput and latency percentiles of insert_pair, find_hint,
+ *          retrieve_pwd and delete_pair, each run once per record in a
+ *          shuffled order, and the throughput of a next_hint walk over
+ *          every user and of dump_vault.
+ *
+ *          usage:  vaultBench [max records] [pairs per hint] [users]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "pwd_vault.h"
+
+#define MAX_RECORDS    1000000
+#define PAIRS_PER_HINT 4
+#define NUM_USERS      16
+
+/* the pwds retrieve_pwd copies out, one per pair of a hint */
+static char pwds[PAIRS_PER_HINT * 64][MAX_PWD_SIZE];
+
+static int pairs = PAIRS_PER_HINT;
+static int users = NUM_USERS;
+
+/* now:  the monotonic clock, in ns */
+static inline u64 now(void) {
+   struct timespec t;
+
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return (u64) t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/* record i belongs to user i % users, and shares its hint with pairs-1
+ * other records of that user                                              */
+static kuid_t rec_uid(int i) {
+   return KUIDT_INIT(1000 + i % users);
+}
+
+static void rec_hint(int i, char *hint) {
+   sprintf(hint, "hint%d", (i / users) / pairs);
+}
+
+static void rec_pwd(int i, char *pwd) {
+   sprintf(pwd, "pwd%d", i);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+   u64 x = *(const u64 *) a, y = *(const u64 *) b;
+
+   return (x > y) - (x < y);
+}
+
+/* report:  prints a row for n ops taking ns in all, with the latency of
+ *          each op in lat, or only the throughput if lat is NULL        */
+static void report(int records, const char *op, long n, u64 ns, u64 *lat) {
+   printf("%9d %-12s %9ld %9.1f %9.2f", records, op, n, (double) ns / n,
+          n * 1e3 / ns);
+
+   if (lat != NULL) {
+      qsort(lat, n, sizeof(*lat), cmp_u64);
+      printf(" %8llu %8llu %8llu\n", lat[n / 2], lat[n * 99 / 100],
+             lat[n * 999 / 1000]);
+   } else {
+      printf(" %8s %8s %8s\n", "-", "-", "-");
+   }
+}
+
+/* bench:  runs each timed pass over a vault of n records */
+static int bench(int n, int *order, u64 *lat) {
+   struct pwd_vault   v;
+   char               hint[MAX_HINT_SIZE + 1];
+   char               pwd[MAX_PWD_SIZE + 1];
+   struct hpw_list   *l;
+   long               cnt;
+   u64                t, t0;
+   int                i, k, pos;
+
+   if (!initialize_vault(&v, users, n / users / pairs + 1)) return -1;
+
+   /* insert_pair, under the user's lock as the fops take it */
+   t0 = now();
+   for (k = 0; k < n; k++) {
+      struct hpw_list_h *user;
+
+      i    = order[k];
+      user = vault_user(&v, rec_uid(i), TRUE);
+      rec_hint(i, hint);
+      rec_pwd(i, pwd);
+
+      mutex_lock(&user->lock);
+      t = now();
+      if (!insert_pair(&v, rec_uid(i), hint, pwd)) {
+         fprintf(stderr, "insert_pair failed at %d of %d\n", k, n);
+         return -1;
+      }
+      lat[k] = now() - t;
+      vault_user_unlock(user);
+   }
+   report(n, "insert_pair", n, now() - t0, lat);
+
+   /* find_hint, under rcu_read_lock as the lookups run */
+   t0 = now();
+   for (k = 0; k < n; k++) {
+      i = order[k];
+      rec_hint(i, hint);
+
+      rcu_read_lock();
+      t = now();
+      l = find_hint(&v, rec_uid(i), hint, &pos);
+      lat[k] = now() - t;
+      rcu_read_unlock();
+
+      if (l == NULL) {
+         fprintf(stderr, "find_hint missed %s\n", hint);
+         return -1;
+      }
+   }
+   report(n, "find_hint", n, now() - t0, lat);
+
+   /* retrieve_pwd, which takes rcu_read_lock itself */
+   t0 = now();
+   for (k = 0; k < n; k++) {
+      i = order[k];
+      rec_hint(i, hint);
+
+      t = now();
+      cnt = retrieve_pwd(&v, rec_uid(i), hint, pwds, pairs);
+      lat[k] = now() - t;
+
+      if (cnt < 1) {
+         fprintf(stderr, "retrieve_pwd missed %s\n", hint);
+         return -1;
+      }
+   }
+   report(n, "retrieve_pwd", n, now() - t0, lat);
+
+   /* next_hint, walking every user's pairs from the first */
+   cnt = 0;
+   t0  = now();
+   for (i = 0; i < users; i++) {
+      rcu_read_lock();
+      for (l = first_hint(&v, rec_uid(i)); l != NULL;
+           l = next_hint(&v, rec_uid(i), l)) {
+         cnt++;
+      }
+      rcu_read_unlock();
+   }
+   t = now() - t0;
+   if (cnt != n) {
+      fprintf(stderr, "next_hint walked %ld of %d pairs\n", cnt, n);
+      return -1;
+   }
+   report(n, "next_hint", n, t, NULL);
+
+   /* dump_vault, printing to /dev/null */
+   t0 = now();
+   dump_vault(&v, FORWARD);
+   report(n, "dump_vault", n, now() - t0, NULL);
+
+   /* delete_pair, under the user's lock */
+   t0 = now();
+   for (k = 0; k < n; k++) {
+      struct hpw_list_h *user;
+
+      i    = order[k];
+      user = vault_user(&v, rec_uid(i), FALSE);
+      rec_hint(i, hint);
+      rec_pwd(i, pwd);
+
+      mutex_lock(&user->lock);
+      t = now();
+      delete_pair(&v, rec_uid(i), hint, pwd);
+      lat[k] = now() - t;
+      vault_user_unlock(user);
+   }
+   report(n, "delete_pair", n, now() - t0, lat);
+
+   if (num_vpairs(&v) != 0) {
+      fprintf(stderr, "%d pairs left after deleting all\n", num_vpairs(&v));
+      return -1;
+   }
+
+   finalize_vault(&v);
+   return 0;
+}
+
+int main(int argc, char *argv[]) {
+   int  max = MAX_RECORDS;
+   int *order;
+   u64 *lat;
+   u64  t;
+   int  n, i, j, tmp;
+
+   if (argc > 1) max   = atoi(argv[1]);
+   if (argc > 2) pairs = atoi(argv[2]);
+   if (argc > 3) users = atoi(argv[3]);
+
+   if (max < 1 || pairs < 1 || pairs > PAIRS_PER_HINT * 64 || users < 1) {
+      fprintf(stderr, "usage: %s [max records] [pairs per hint] [users]\n",
+              argv[0]);
+      return 1;
+   }
+
+   order = malloc(max * sizeof(*order));
+   lat   = malloc(max * sizeof(*lat));
+   if (order == NULL || lat == NULL || !initialize_vault_caches()) {
+      fprintf(stderr, "out of memory\n");
+      return 1;
+   }
+
+   /* dump_vault prints every pair through printk */
+   ushim_log = fopen("/dev/null", "w");
+
+   /* the clock is read around each op, so its cost is in each latency */
+   t = now();
+   for (i = 0; i < 1000; i++) now();
+   printf("clock overhead %llu ns; latencies in ns\n", (now() - t) / 1000);
+
+   printf("%9s %-12s %9s %9s %9s %8s %8s %8s\n", "records", "op", "ops",
+          "ns/op", "Mops/s", "p50", "p99", "p999");
+
+   srand(3320);
+   for (n = 100; n <= max; n *= 10) {
+
+      /* a fresh shuffle of the records for each vault */
+      for (i = 0; i < n; i++) order[i] = i;
+      for (i = n - 1; i > 0; i--) {
+         j        = rand() % (i + 1);
+         tmp      = order[i];
+         order[i] = order[j];
+         order[j] = tmp;
+      }
+
+      if (bench(n, order, lat) != 0) return 1;
+      rcu_barrier();
+   }
+
+   finalize_vault_caches();
+   free(order);
+   free(lat);
+
+   return 0;
+}
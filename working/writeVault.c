@@ -12,12 +12,12 @@
 #include "pwd_vault.h"
 
 #define  MAX_USERS 20
-#define  BUF_SIZE  80
+#define  BUF_SIZE  (MAX_HINT_PWD_SIZE)
 
 int main () {
 	char buf[BUF_SIZE];
-   char hint[MAX_HINT_SIZE] = "";
-   char pwd[MAX_PWD_SIZE];
+   char hint[MAX_HINT_SIZE+1] = "";
+   char pwd[MAX_PWD_SIZE+1];
 	int  fd;
 	int  count = BUF_SIZE;
 